@@ -15,97 +15,870 @@
 
 #include "Arduino.h"
 #include "Sim800C.h"
-#include <SoftwareSerial.h>
+
+#ifdef ARDUINO
+#include <EEPROM.h>
 
 #ifdef SwSerial
   SoftwareSerial HwSwSerial(DEFAULT_RX_PIN, DEFAULT_TX_PIN); // RX, TX  
 #else
   #define HwSwSerial  Serial   
 #endif  
+#endif
+
+uint32_t Sim800CClock::millis()
+{
+    return ::millis();
+}
+
+void Sim800CClock::delay(uint32_t ms)
+{
+    ::delay(ms);
+}
+
+void Sim800CClock::idle(uint32_t /*ms*/)
+{
+}
+
+static Sim800CClock arduinoClock;
+
+bool Sim800CConfigStore::load(config_descriptor &aDesc)
+{
+#ifdef ARDUINO
+    EEPROM.get(CONFIG_EEPROM_ADDR,aDesc);
+    return aDesc.magic==CONFIG_MAGIC;
+#else
+    (void)aDesc;
+    return false;
+#endif
+}
+
+void Sim800CConfigStore::save(const config_descriptor &aDesc)
+{
+#ifdef ARDUINO
+    EEPROM.put(CONFIG_EEPROM_ADDR,aDesc);
+#else
+    (void)aDesc;
+#endif
+}
 
 Sim800C::Sim800C(void)
 {
+#ifdef ARDUINO
+    _serial = &HwSwSerial;
+#else
+    _serial = NULL;
+#endif
+    _clock = &arduinoClock;
+    _config = NULL;
+    _pool = NULL;
+    _powerPin = DEFAULT_POWER_PIN;
+    _cmdHead = 0;
+    _cmdCount = 0;
+    _cmdIssued = 0;
+    _bootStart = 0;
+    memset(&_boot,0,sizeof(_boot));
+    memset(_done,0,sizeof(_done));
+    for (uint8_t i=0; i<CMD_QUEUE_SIZE; i++) _done[i].ticket = 0xFFFF;
+    _doneNext = 0;
+    _waitTicket = 0xFFFF;
+    _waitDepth = 0;
+    _lastResult = CMD_ERROR;
+    _rxLen = 0;
+    _rxFull = false;
+    _rxSplit = false;
+    _rxPrompt = false;
+    _rxBody = false;
+    _rxRaw = 0;
+    _rxCmt = false;
+    _rxCmtLine = false;
+#ifdef SIM800C_SOCKETS
+    _rxSock = 0;
+#endif
+#ifdef SIM800C_HTTP
+    _rxHttp = false;
+#endif
+    _rxDrop = false;
+    _power.step = POWER_IDLE;
+    _wl.mode = Disable;
+    _wl.parsing = false;
+#ifdef SIM800C_WHITELIST_MIRROR
+    _wl.loaded = false;
+    memset(_wl.digits,0xFF,sizeof(_wl.digits));
+    memset(_wl.index,0,sizeof(_wl.index));
+#endif
+#ifdef SIM800C_HTTP
+    _http.step = HTTP_IDLE;
+    _http.etag[0] = 0;
+    _http.modified[0] = 0;
+#endif
+#ifdef SIM800C_SOCKETS
+    for (uint8_t i=0; i<SOCKET_COUNT; i++)
+    {
+        _sockets[i].state = SOCKET_CLOSED;
+        _sockets[i].sending = false;
+        _sockets[i].dropped = 0;
+    }
+#endif
+    memset(&_cmt,0,sizeof(_cmt));
+    _cmtReady = false;
+    _cmtAck = false;
+    _smsWatch = false;
+#ifdef SIM800C_LONG_SMS
+    _rxPdu = false;
+    _smsRef = 0;
+#endif
+    memset(&_call,0,sizeof(_call));
+    memset(&_net,0,sizeof(_net));
+    _net.registration = 0xFF;
+    _net.rssi = 99;
+    _net.ber = 99;
+    _netCallback = NULL;
+    _outboxHead = 0;
+    _outboxCount = 0;
+    _outboxBusy = false;
+    memset(&_outboxStats,0,sizeof(_outboxStats));
+    _arenaClear();
+    _rxBytes = 0;
+    _rxMark = 0;
+    _urcHead = 0;
+    _urcCount = 0;
+    _urcDropped = 0;
+    memset(_urcHandlers,0,sizeof(_urcHandlers));
+    memset(&_timing,0,sizeof(_timing));
+    _rxFirst = false;
+    _result.type = RESULT_OK;
+    _result.code = 0;
+#ifdef SIM800C_STATS
+    clearStats();
+#endif
 }
 
+#ifdef ARDUINO
 void Sim800C::begin()
 {
-    pinMode(DEFAULT_POWER_PIN, OUTPUT);
+    pinMode(_powerPin, OUTPUT);
 
     _baud = DEFAULT_BAUD_RATE;			// Default baud rate 9600
     HwSwSerial.begin(_baud);
+    _serial = &HwSwSerial;
 
     _sleepMode = 0;
     _functionalityMode = 1;
 
-    SimBuffer.reserve(BUFFER_RESERVE_MEMORY); // Reserve memory to prevent intern fragmention
     Setup();
 }
 
 void Sim800C::begin(uint32_t baud)
 {
 
-    pinMode(DEFAULT_POWER_PIN, OUTPUT);
+    pinMode(_powerPin, OUTPUT);
 
     _baud = baud;
     HwSwSerial.begin(_baud);
+    _serial = &HwSwSerial;
+
+    _sleepMode = 0;
+    _functionalityMode = 1;
+
+    Setup();
+}
+#endif
+
+/*
+ * Use an already opened transport instead of the default serial port, baud is
+ * the rate the stream was opened with, the modem is not re-clocked: a channel
+ * of Sim800CMux runs at the rate of its link. powerPin drives the PWRKEY of
+ * this modem, with NO_POWER_PIN Setup() only waits for it to answer.
+ */
+void Sim800C::begin(Stream &serial,uint32_t baud,uint8_t powerPin)
+{
+
+    _powerPin = powerPin;
+    if (_powerPin!=NO_POWER_PIN) pinMode(_powerPin, OUTPUT);
+
+    _baud = baud;
+    _serial = &serial;
 
     _sleepMode = 0;
     _functionalityMode = 1;
 
-    SimBuffer.reserve(BUFFER_RESERVE_MEMORY); // Reserve memory to prevent intern fragmention
     Setup();
 }
 
+void Sim800C::setClock(Sim800CClock &clock)
+{
+    _clock = &clock;
+}
+
+/*
+ * Configuration sent as one command line once the modem is up, the modem
+ * runs the commands in order and answers with a single OK:
+ *   +CSMP=17,167,0,0			SMS text mode parameters
+ *   +MORING=1					"MO RING" / "MO CONNECTED" for outgoing calls
+ *   +CLIR=0					send the caller id
+ *   +CUSD=1					USSD result codes
+ *   +CMGF=1					text mode
+ *   +CSDH=1					text length in +CMGR/+CMGL headers, the body is streamed by that length
+ *   +CPMS="SM","SM","SM"		storage all to Sim card
+ *   +CLIP=1					display incoming call number
+ *   +CNMI=2,1,0,0,0			return SMS as: +CMTI: "SM",i        i=INDEX
+ *   +CMEE=1					numeric +CME / +CMS ERROR codes instead of a bare ERROR
+ *   +CLCC=1					+CLCC: call state reports, they drive ringAndDrop()
+ *   +CREG=2					+CREG: registration reports with the cell, kept in the network cache
+ */
+static const char bootConfig[] PROGMEM = "AT+CSMP=17,167,0,0;+MORING=1;+CLIR=0;+CUSD=1;+CMGF=1;+CSDH=1;"
+                                         "+CPMS=\"SM\",\"SM\",\"SM\";+CLIP=1;+CNMI=2,1,0,0,0;+CMEE=1;+CLCC=1;+CREG=2\r\n";
+
+static const char atPing[] PROGMEM          = "AT\r\n";
+static const char atEchoIpr[] PROGMEM       = "ATE0;+IPR=%\r\n";
+static const char atEcho[] PROGMEM          = "ATE0\r\n";
+static const char atIpr[] PROGMEM           = "AT+IPR=%\r\n";
+static const char atConfigCheck[] PROGMEM   = "AT+CMGF?;+CSDH?;+CNMI?;+MORING?\r\n";
+static const char atIdentity[] PROGMEM      = "AT+GMR;+CGMM;+GMI;+GSN\r\n";
+static const char atCreg[] PROGMEM          = "AT+CREG?\r\n";		//+CREG: 0,1
+static const char atCsclk[] PROGMEM         = "AT+CSCLK=%\r\n";
+static const char atCfun[] PROGMEM          = "AT+CFUN=%\r\n";
+static const char atCpin[] PROGMEM          = "AT+CPIN=%\r\n";
+static const char atInfo[] PROGMEM          = "ATI\r\n";
+static const char atCopsList[] PROGMEM      = "AT+COPS=?\r\n";
+static const char atCops[] PROGMEM          = "AT+COPS?\r\n";
+static const char atCsq[] PROGMEM           = "AT+CSQ\r\n";
+static const char atAnswer[] PROGMEM        = "ATA\r\n";
+static const char atDial[] PROGMEM          = "ATD%;\r\n";
+static const char atCpas[] PROGMEM          = "AT+CPAS\r\n";
+static const char atHangup[] PROGMEM        = "ATH\r\n";
+static const char atWhiteListOff[] PROGMEM  = "AT+CWHITELIST=0\r\n";
+static const char atWhiteList[] PROGMEM     = "AT+CWHITELIST=%,%,%\r\n";
+static const char atWhiteListList[] PROGMEM = "AT+CWHITELIST?\r\n";
+static const char atCmgs[] PROGMEM          = "AT+CMGS=\"%\"\r";
+static const char atCmgsPdu[] PROGMEM       = "AT+CMGS=%\r";
+static const char atCmgr[] PROGMEM          = "AT+CMGR=%\r\n";
+static const char atCmgl[] PROGMEM          = "AT+CMGL=\"%\"\r\n";
+static const char atCmgd[] PROGMEM          = "AT+CMGD=%\r\n";
+static const char atCmgda[] PROGMEM         = "AT+CMGDA=\"DEL ALL\"\r\n";
+static const char atCmgf[] PROGMEM          = "AT+CMGF=%\r\n";
+static const char atCclk[] PROGMEM          = "AT+CCLK?\r\n";
+static const char atGsmLoc[] PROGMEM        = "AT+CIPGSMLOC=2,1\r\n";
+static const char atCnmi[] PROGMEM          = "AT+CNMI=2,%,0,0,0\r\n";
+static const char atCsmsQuery[] PROGMEM     = "AT+CSMS?\r\n";
+static const char atCnma[] PROGMEM          = "AT+CNMA\r\n";
+static const char atCpmsQuery[] PROGMEM     = "AT+CPMS?\r\n";
+static const char atCpms[] PROGMEM          = "AT+CPMS=\"%\",\"%\",\"%\"\r\n";
+static const char atCipmux[] PROGMEM        = "AT+CIPMUX=1\r\n";
+static const char atCstt[] PROGMEM          = "AT+CSTT=\"%\",\"%\",\"%\"\r\n";
+static const char atCiicr[] PROGMEM         = "AT+CIICR\r\n";
+static const char atCifsr[] PROGMEM         = "AT+CIFSR\r\n";
+static const char atCipstart[] PROGMEM      = "AT+CIPSTART=%,\"%\",\"%\",%\r\n";
+static const char atCipsend[] PROGMEM       = "AT+CIPSEND=%,%\r\n";
+static const char atCipclose[] PROGMEM      = "AT+CIPCLOSE=%\r\n";
+static const char atCipshut[] PROGMEM       = "AT+CIPSHUT\r\n";
+static const char atSapbrGprs[] PROGMEM     = "AT+SAPBR=3,1,\"Contype\",\"GPRS\"\r\n";
+static const char atSapbrApn[] PROGMEM      = "AT+SAPBR=3,1,\"APN\",\"%\"\r\n";
+static const char atSapbrOpen[] PROGMEM     = "AT+SAPBR=1,1\r\n";
+static const char atSapbrQuery[] PROGMEM    = "AT+SAPBR=2,1\r\n";
+static const char atHttpinit[] PROGMEM      = "AT+HTTPINIT\r\n";
+static const char atHttpcid[] PROGMEM       = "AT+HTTPPARA=\"CID\",1\r\n";
+static const char atHttpurl[] PROGMEM       = "AT+HTTPPARA=\"URL\",\"%\"\r\n";
+static const char atHttpnonematch[] PROGMEM = "AT+HTTPPARA=\"USERDATA\",\"If-None-Match: %\"\r\n";
+static const char atHttpmodified[] PROGMEM  = "AT+HTTPPARA=\"USERDATA\",\"If-Modified-Since: %\"\r\n";
+static const char atHttpnouserdata[] PROGMEM = "AT+HTTPPARA=\"USERDATA\",\"\"\r\n";
+static const char atHttpcontent[] PROGMEM   = "AT+HTTPPARA=\"CONTENT\",\"%\"\r\n";
+static const char atHttpdata[] PROGMEM      = "AT+HTTPDATA=%,10000\r\n";
+static const char atHttpaction[] PROGMEM    = "AT+HTTPACTION=%\r\n";
+static const char atHttphead[] PROGMEM      = "AT+HTTPHEAD\r\n";
+static const char atHttpread[] PROGMEM      = "AT+HTTPREAD=%,%\r\n";
+static const char atHttpterm[] PROGMEM      = "AT+HTTPTERM\r\n";
+
+// Rows in at_id_enum order.
+static const at_spec atTable[AT_COMMANDS] PROGMEM =
+{
+    { atPing,          RESPON_OK, 500 },
+    { atPing,          RESPON_OK, 300 },
+    { atEchoIpr,       RESPON_OK, 1000 },
+    { atEcho,          RESPON_OK, 500 },
+    { atIpr,           RESPON_OK, 500 },
+    { bootConfig,      RESPON_OK, 5000 },
+    { atConfigCheck,   RESPON_OK, 1000 },
+    { atIdentity,      RESPON_OK, 1000 },
+    { atCreg,          RESPON_OK, 25000 },
+    { atCsclk,         RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atCfun,          RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atCpin,          RESPON_OK, 5000 },			// can take up to 5 seconds
+    { atInfo,          RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atCopsList,      RESPON_OK, 45000 },			// can take up to 45 seconds
+    { atCops,          RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atCsq,           RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atAnswer,        RESPON_OK, 10000 },
+    { atDial,          RESPON_OK, 30000 },
+    { atCpas,          RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atHangup,        RESPON_OK, 10000 },
+    { atWhiteListOff,  RESPON_OK, 30000 },
+    { atWhiteList,     RESPON_OK, 20000 },
+    { atWhiteListList, RESPON_OK, 30000 },
+    { atCmgs,          ">",       10000 },
+    { atCmgsPdu,       ">",       10000 },
+    { atCmgr,          RESPON_OK, 5000 },
+    { atCmgl,          RESPON_OK, 25000 },
+    { atCmgd,          RESPON_OK, 25000 },
+    { atCmgda,         RESPON_OK, 25000 },			// can take up to 25 seconds
+    { atCmgf,          RESPON_OK, 5000 },
+    { atCclk,          RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atGsmLoc,        RESPON_OK, TIME_OUT_READ_SERIAL },
+    { atCnmi,          RESPON_OK, 5000 },
+    { atCsmsQuery,     RESPON_OK, 5000 },
+    { atCnma,          RESPON_OK, 5000 },
+    { atCpmsQuery,     RESPON_OK, 5000 },
+    { atCpms,          RESPON_OK, 5000 },
+    { atCipmux,        RESPON_OK, 5000 },
+    { atCstt,          RESPON_OK, 5000 },
+    { atCiicr,         RESPON_OK, 65000 },			// can take up to 85 seconds, capped by the row
+    { atCifsr,         RESPON_LINE, 5000 },
+    { atCipstart,      RESPON_OK, 10000 },
+    { atCipsend,       ">",       5000 },
+    { atCipclose,      RESPON_LINE, 5000 },
+    { atCipshut,       "SHUT OK", 65000 },
+    { atSapbrGprs,     RESPON_OK, 5000 },
+    { atSapbrApn,      RESPON_OK, 5000 },
+    { atSapbrOpen,     RESPON_OK, 65000 },
+    { atSapbrQuery,    RESPON_OK, 5000 },
+    { atHttpinit,      RESPON_OK, 5000 },
+    { atHttpcid,       RESPON_OK, 5000 },
+    { atHttpurl,       RESPON_OK, 5000 },
+    { atHttpnonematch, RESPON_OK, 5000 },
+    { atHttpmodified,  RESPON_OK, 5000 },
+    { atHttpnouserdata, RESPON_OK, 5000 },
+    { atHttpcontent,   RESPON_OK, 5000 },
+    { atHttpdata,      "DOWNLOAD", 5000 },
+    { atHttpaction,    RESPON_OK, 5000 },
+    { atHttphead,      RESPON_OK, 5000 },
+    { atHttpread,      RESPON_OK, 10000 },
+    { atHttpterm,      RESPON_OK, 5000 }
+};
+
+void Sim800C::_spec(uint8_t id,at_spec *aSpec)
+{
+    memcpy_P(aSpec,&atTable[id],sizeof(at_spec));
+}
+
+// Copy the format up to its next '%' (skipped) or its end.
+bool Sim800C::_formatText(char *&out,const char *end,const char *&spec)
+{
+    char ch;
+    while ((ch=pgm_read_byte(spec))!=0)
+    {
+        spec++;
+        if (ch=='%') return true;
+        if (out+1>=end) return false;
+        *out++=ch;
+    }
+    return true;
+}
+
+bool Sim800C::_formatArg(char *&out,const char *end,uint32_t value)
+{
+    char digits[11];
+    uint8_t n=0;
+    do
+    {
+        digits[n++]='0'+value%10;
+        value/=10;
+    } while (value);
+    if (out+n>=end) return false;
+    while (n) *out++=digits[--n];
+    return true;
+}
+
+bool Sim800C::_formatArg(char *&out,const char *end,const char *text)
+{
+    if (text==NULL) return true;
+    while (*text)
+    {
+        if (out+1>=end) return false;
+        *out++=*text++;
+    }
+    return true;
+}
+
+bool Sim800C::_formatArg(char *&out,const char *end,at_quoted quoted)
+{
+    const char *text=quoted.text;
+    uint8_t ch;
+
+    if (text==NULL) return true;
+    while ((ch=*text++)!=0)
+    {
+        if (ch!='"' && ch!='\\')
+        {
+            if (out+1>=end) return false;
+            *out++=ch;
+            continue;
+        }
+        if (out+3>=end) return false;
+        *out++='\\';
+        *out++="0123456789ABCDEF"[ch>>4];
+        *out++="0123456789ABCDEF"[ch&0x0F];
+    }
+    return true;
+}
+
+bool Sim800C::_format(char *out,const char *end,const char *spec)
+{
+    if (!_formatText(out,end,spec)) return false;
+    *out=0;
+    return true;
+}
+
+at_command *Sim800C::_prepare(uint8_t id,command_callback aCallback)
+{
+    at_spec spec;
+    at_command *c;
+    _spec(id,&spec);
+    c=_enqueue(spec.respon,spec.timeout,aCallback);
+    if (c==NULL) return NULL;
+    c->cmd=spec.format;
+    c->flash=true;
+    return c;
+}
+
+uint8_t Sim800C::_send(uint8_t id)
+{
+    at_command *c=_prepare(id);
+    if (c==NULL) return ERROR;
+    return _waitCommand(c)==CMD_OK ? OK : ERROR;
+}
+
+// Settings of bootConfig the modem reports in one AT+CMGF?;+CSDH?;+CNMI?;+MORING? round trip.
+static const char configCheck[] PROGMEM = "+CMGF: 1\0+CSDH: 1\0+CNMI: 2,1,0,0,0\0+MORING: 1\0";
+
+/*
+ * Bring the modem up as fast as it allows: no power pulse when it already
+ * answers, AT polled until it does, and the configuration retried as soon as
+ * "SMS Ready" shows up instead of after fixed sleeps. When only the MCU was
+ * restarted and the saved descriptor still matches, one query replaces the
+ * configuration. bootTiming() tells how long each phase took.
+ * A configuration still refused after BOOT_TIMEOUT (no SIM, say) is sent one
+ * command at a time so the others take effect, and Setup() returns ERROR.
+ */
 uint8_t Sim800C::Setup(void)
 {
-    uint8_t respons = 0;
-    int tryCount=0;
-    PowerOn();
-    delay(10000);
-    send_cmd_wait_reply("AT+IPR="+String(_baud)+"\r\n",RESPON_OK,10000);
-    send_cmd_wait_reply(F("ATE0\r\n"),RESPON_OK,10000);
-    while ((respons = send_cmd_wait_reply(F("AT\r\n"),RESPON_OK, 10000))!=1)
-    {
-        delay(1500);
-        tryCount++;
-        if(tryCount>10) return ERROR;
-    }
-    send_cmd_wait_reply("AT+IPR="+String(_baud)+"\r\n",RESPON_OK,10000);
-    //no cmd echo
-    send_cmd_wait_reply(F("ATE0\r\n"), RESPON_OK, 500000);
-    //Set SMS Text Mode Parameters
-    send_cmd_wait_reply(F("AT+CSMP=17,167,0,0\r\n"), RESPON_OK, 500000);
-    //FOR ENABLE TO DISPLAY WHEN RING HOST PHONE => SIM SEND "MO RING" AND WHEN CONNECT SIM SEND "MO CONNECTED"
-    send_cmd_wait_reply(F("AT+MORING=1\r\n"),RESPON_OK, 500000);
-    //ENABLE CALL
-    send_cmd_wait_reply(F("AT+CLIR=0\r\n"),RESPON_OK, 500000);
-    //USSD text mode enable
-    send_cmd_wait_reply(F("AT+CUSD=1\r\n"),RESPON_OK, 500000);
-    //text mode
-    send_cmd_wait_reply(F("AT+CMGF=1\r\n"),RESPON_OK, 500000);
-    //storage all to Sim card
-    send_cmd_wait_reply(F("AT+CPMS=\"SM\",\"SM\",\"SM\"\r\n"),RESPON_OK, 500000);
-    //clip=1 //for display income call
-    send_cmd_wait_reply(F("AT+CLIP=1\r\n"),RESPON_OK, 500000);
-    // AT+CNMI=2,1, return SMS as: +CMTI: "SM",i        i=INDEX
-    send_cmd_wait_reply(F("AT+CNMI=2,1,0,0,0\r\n"), RESPON_OK, 500000);
+    uint32_t wait,sent;
+    uint32_t want=_baud;
+    uint32_t pause=CONFIG_RETRY_PAUSE;
+    bool ready;
+    config_descriptor desc;
+
+    memset(&_boot,0,sizeof(_boot));
+    _bootStart=_clock->millis();
+
+    // pulsing PWRKEY of a running modem would switch it off, look for one
+    // locked to another rate with AT+IPR before deciding the modem is off
+    if (_send(AT_PROBE)!=OK && detectBaud()==0)
+    {
+        if (_powerPin!=NO_POWER_PIN)
+        {
+            PowerOn();
+            _powerWait();
+            _boot.powerOn=_clock->millis()-_bootStart;
+        }
+        if (!_waitReady(BOOT_TIMEOUT) && detectBaud()==0) return ERROR;
+    }
+    _boot.firstAt=_clock->millis()-_bootStart;
+    if (_baud!=want) _switchBaud(want);
+
+    //no cmd echo, fixed baud rate on our own port
+    if (_ownPort()) _send(AT_ECHO_IPR,_baud);
+    else            _send(AT_ECHO);
+
+    // warm start, the modem was not power cycled
+    if (_boot.powerOn==0 && _config!=NULL && _config->load(desc) && desc.hash==_configHash() && _configValid())
+    {
+        _boot.configured=_clock->millis()-_bootStart;
+        wait=_boot.configured-_boot.firstAt;
+        if (desc.configMs>wait) _boot.saved=desc.configMs-wait;
+        is_network_registered();
+        return OK;
+    }
+
+    // SMS commands are refused until the SIM is read, retry on "SMS Ready" or every second,
+    // after it with a pause that doubles up to a second
+    sent=_clock->millis();
+    while (_send(AT_CONFIG)!=OK)
+    {
+        if (_clock->millis()-_bootStart>=BOOT_TIMEOUT)
+        {
+            _configParts();
+            return ERROR;
+        }
+        ready=_boot.smsReady!=0;
+        wait=_clock->millis();
+        while (_clock->millis()-wait<(ready ? pause : 1000) && (ready || _boot.smsReady==0))
+        {
+            poll();
+            if (_pool!=NULL) _pool->_pollOthers(this);
+            _clock->idle(IDLE_TICK);
+        }
+        if (ready && pause<1000) pause*=2;
+        sent=_clock->millis();
+        _retryNext();
+    }
+    _boot.configured=_clock->millis()-_bootStart;
+
+    if (_config!=NULL)
+    {
+        desc.magic=CONFIG_MAGIC;
+        desc.hash=_configHash();
+        desc.configMs=_clock->millis()-sent;
+        _config->save(desc);
+    }
+
     is_network_registered();
+    return OK;
+}
+
+// Each command of bootConfig on a line of its own, a refused one does not stop the others.
+void Sim800C::_configParts()
+{
+    char line[CMD_MAX_LENGTH];
+    const char *p=bootConfig+2;
+    uint8_t len=2;
+    char ch;
+
+    line[0]='A';
+    line[1]='T';
+    do
+    {
+        ch=pgm_read_byte(p++);
+        if (ch==';' || ch==cr)
+        {
+            strcpy(line+len,"\r\n");
+            send_cmd_wait_reply(line,RESPON_OK,1000);
+            len=2;
+        }
+        else if (len+3<(uint8_t)sizeof(line)) line[len++]=ch;
+    } while (ch!=cr);
+}
+
+// Poll AT until the modem answers, each try waits up to 500 ms for the OK.
+bool Sim800C::_waitReady(uint32_t timeout)
+{
+    uint32_t start=_clock->millis();
+    while (_send(AT_PING)!=OK)
+    {
+        if (_clock->millis()-start>=timeout) return false;
+        _retryNext();
+    }
+    return true;
+}
+
+const boot_timing &Sim800C::bootTiming()
+{
+    return _boot;
+}
+
+void Sim800C::setConfigStore(Sim800CConfigStore *store)
+{
+    _config = store;
+}
+
+// FNV-1a of the configuration line and the baud rate, changes whenever either does.
+uint32_t Sim800C::_configHash()
+{
+    uint32_t hash=2166136261UL;
+    const char *p=bootConfig;
+    char c;
+    uint8_t i;
+
+    while ((c=pgm_read_byte(p++))!=0)
+    {
+        hash^=(uint8_t)c;
+        hash*=16777619UL;
+    }
+    for (i=0; i<4; i++)
+    {
+        hash^=(uint8_t)(_baud>>(i*8));
+        hash*=16777619UL;
+    }
+    return hash;
+}
+
+// One query for the settings that a modem power cycle would have reset.
+bool Sim800C::_configValid()
+{
+    const char *expect=configCheck;
+    const char *line;
+    bool found;
+
+    if (_send(AT_CONFIG_CHECK)!=OK) return false;
+    while (pgm_read_byte(expect)!=0)
+    {
+        found=false;
+        for (line=_firstLine(); line!=NULL && !found; line=_nextLine(line))
+        {
+            found=strcmp_P(line,expect)==0;
+        }
+        if (!found) return false;
+        expect+=strlen_P(expect)+1;
+    }
+    return true;
+}
+
+/*
+ * Rates of AT+IPR, fastest first. The modem autobauds on "AT" after power on
+ * unless a fixed rate was stored, so every one of them is probed.
+ */
+static const uint32_t baudRates[] PROGMEM = { 460800, 230400, 115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200 };
+#define BAUD_RATES (sizeof(baudRates)/sizeof(baudRates[0]))
+
+// The port the library opened itself, the only one it may re-clock.
+bool Sim800C::_ownPort()
+{
+#ifdef ARDUINO
+    return _serial==&HwSwSerial;
+#else
+    return false;
+#endif
+}
+
+// Two tries, the first "AT" at a new rate is often eaten by the autobaud detection.
+bool Sim800C::_probeBaud(uint32_t baud)
+{
+#ifdef ARDUINO
+    HwSwSerial.begin(baud);
+#endif
+    _baud=baud;
+    _rx.clear();
+    _rxLen=0;
+    if (_send(AT_PROBE)==OK) return true;
+    _retryNext();
+    return _send(AT_PROBE)==OK;
+}
+
+uint32_t Sim800C::detectBaud()
+{
+    uint32_t first=_baud;
+    uint32_t baud;
+    uint8_t i;
+
+    if (!_ownPort())
+    {
+        if (_send(AT_PING)==OK) return _baud;
+        return 0;
+    }
+    if (_probeBaud(first)) return first;
+    for (i=0; i<BAUD_RATES; i++)
+    {
+        baud=pgm_read_dword(&baudRates[i]);
+        if (baud==first) continue;
+        if (_probeBaud(baud)) return baud;
+    }
+    _probeBaud(first);
+    return 0;
+}
+
+// Move the modem and HwSwSerial to baud, back to the old rate when the modem is lost.
+bool Sim800C::_switchBaud(uint32_t baud)
+{
+    uint32_t old=_baud;
+
+    if (_send(AT_IPR,baud)!=OK) return false;
+    if (_probeBaud(baud)) return true;
+
+    // framing errors at the new rate, ask for the old one blind and look for the modem again
+    _send(AT_IPR,old);
+    if (!_probeBaud(old)) detectBaud();
+    return false;
+}
+
+/*
+ * BAUD_BURST chained identity queries, their replies must all be alike. The
+ * hash of the replies is returned, 0 when one differs, failed or overflowed
+ * the software serial buffer.
+ */
+uint32_t Sim800C::_burst(uint32_t *bytes,uint32_t *ms)
+{
+    uint32_t hash,first=0;
+    const char *line;
+    const char *p;
+    uint8_t i;
+
+    *bytes=0;
+    *ms=0;
+    for (i=0; i<BAUD_BURST; i++)
+    {
+        if (_send(AT_IDENTITY)!=OK) return 0;
+#ifdef SwSerial
+        if (HwSwSerial.overflow()) return 0;
+#endif
+        *bytes+=_timing.bytesReceived;
+        *ms+=_timing.latency;
+
+        hash=2166136261UL;
+        for (line=_firstLine(); line!=NULL; line=_nextLine(line))
+        {
+            for (p=line; *p; p++)
+            {
+                hash^=(uint8_t)*p;
+                hash*=16777619UL;
+            }
+        }
+        if (i==0) first=hash;
+        else if (hash!=first) return 0;
+    }
+    return first;
+}
+
+uint32_t Sim800C::negotiateBaud(uint32_t maxBaud)
+{
+    uint32_t base,ref,bytes,ms;
+    uint32_t baud;
+    uint8_t i;
+
+    base=detectBaud();
+    if (base==0 || !_ownPort()) return base;
+    ref=_burst(&bytes,&ms);
+    if (ref==0) return base;
+
+    for (i=0; i<BAUD_RATES; i++)
+    {
+        baud=pgm_read_dword(&baudRates[i]);
+        if (baud<=base) break;
+        if (baud>maxBaud || baud>BAUD_MAX) continue;
+        if (!_switchBaud(baud)) continue;
+        if (_burst(&bytes,&ms)==ref) return baud;
+        _switchBaud(base);
+    }
+    return _baud;
+}
+
+/*
+ * One line per rate:
+ * baud=57600 rx=392 ms=61 bps=6426
+ * Nothing on a Stream passed to begin(), its rate cannot be changed here.
+ */
+void Sim800C::benchmarkBaud(Print &out,uint32_t maxBaud)
+{
+    uint32_t base,ref,bytes,ms;
+    uint32_t baud;
+    int8_t i;
+
+    if (!_ownPort()) return;
+    base=detectBaud();
+    if (base==0) return;
+    ref=_burst(&bytes,&ms);
+
+    for (i=BAUD_RATES-1; i>=0; i--)
+    {
+        baud=pgm_read_dword(&baudRates[i]);
+        if (baud>maxBaud || baud>BAUD_MAX) continue;
+        if (baud!=_baud && !_switchBaud(baud)) continue;
+        out.print(F("baud="));
+        out.print(baud);
+        if (_burst(&bytes,&ms)!=ref || ref==0)
+        {
+            out.println(F(" failed"));
+            continue;
+        }
+        out.print(F(" rx="));
+        out.print(bytes);
+        out.print(F(" ms="));
+        out.print(ms);
+        out.print(F(" bps="));
+        out.println(ms==0 ? 0 : bytes*1000/ms);
+    }
+    negotiateBaud(maxBaud);
 }
 
 uint8_t Sim800C::is_network_registered()
 {
-    unsigned char connCode;
-	HwSwSerial.print(F("AT+CREG?\r\n")); //+CREG: 0,1
-    SimBuffer=_readSerial(25000); 
-    if ( ((SimBuffer.indexOf(network_registered1)) != -1) || ((SimBuffer.indexOf(network_registered2)) != -1))
+    // the reply of AT+CREG? is taken in by the +CREG report handling
+    if (_net.regTime==0) _send(AT_CREG);
+    if (_net.registration==1 || _net.registration==5)
     {
         //setStatus(READY);
-		delay(1000);
 		return REG_REGISTERED;
     }	
 	return REG_NOT_REGISTERED;
 }
 
+const network_status &Sim800C::networkStatus()
+{
+    return _net;
+}
+
+void Sim800C::onNetworkChange(network_callback aCallback)
+{
+    _netCallback = aCallback;
+}
+
+// Refresh the signal level every NET_CSQ_INTERVAL while the line is free.
+void Sim800C::_netStep()
+{
+    if (_net.regTime==0 || _clock->millis()-_net.csqTime<NET_CSQ_INTERVAL) return;
+    if (_post(AT_CSQ,&Sim800C::_netCsqDone)) _net.csqTime=_clock->millis();
+}
+
+void Sim800C::_netCsqDone(Sim800C &gsm,uint8_t result)
+{
+    if (result==CMD_OK) gsm._netCsq();
+}
+
+/*
+ * +CREG: <stat>[,"<lac>","<ci>"]			report of AT+CREG=2
+ * +CREG: <n>,<stat>[,"<lac>","<ci>"]		reply to AT+CREG?
+ */
+void Sim800C::_netCreg()
+{
+    const char *p=_rxLine+6;
+    const char *comma=strchr(p,',');
+    uint16_t lac=_net.lac,ci=_net.ci;
+    uint8_t stat;
+    bool changed;
+
+    if (comma!=NULL && comma[1]>='0' && comma[1]<='9') p=comma+1;
+    stat=atoi(p);
+    if (stat==1 || stat==5)
+    {
+        p=strchr(p,'"');
+        if (p!=NULL)
+        {
+            lac=strtoul(p+1,NULL,16);
+            p=strchr(p+1,',');
+            if (p!=NULL && p[1]=='"') ci=strtoul(p+2,NULL,16);
+        }
+    }
+    changed=stat!=_net.registration || lac!=_net.lac || ci!=_net.ci;
+    _net.registration=stat;
+    _net.lac=lac;
+    _net.ci=ci;
+    _net.regTime=_clock->millis();
+    if (_net.regTime==0) _net.regTime=1;
+    _netChanged(changed);
+}
+
+// +CSQ: <rssi>,<ber> in the arena
+void Sim800C::_netCsq()
+{
+    const char *line=_responseLine("+CSQ:");
+    const char *comma;
+    uint8_t rssi,ber;
+    bool changed;
+
+    if (line==NULL || (comma=strchr(line,','))==NULL) return;
+    rssi=atoi(line+5);
+    ber=atoi(comma+1);
+    changed=rssi!=_net.rssi;
+    _net.rssi=rssi;
+    _net.ber=ber;
+    _net.csqTime=_clock->millis();
+    _netChanged(changed);
+}
+
+void Sim800C::_netChanged(bool changed)
+{
+    if (changed && _netCallback!=NULL) _netCallback(*this,_net);
+}
+
 
 /*
  * AT+CSCLK=0	Disable slow clock, module will not enter sleep mode.
@@ -116,16 +889,7 @@ bool Sim800C::setSleepMode(bool state)
 
     _sleepMode = state;
 
-    if (_sleepMode) HwSwSerial.print(F("AT+CSCLK=1\r\n "));
-    else 			HwSwSerial.print(F("AT+CSCLK=0\r\n "));
-
-    if ( (_readSerial().indexOf("ER")) == -1)
-    {
-        return false;
-    }
-    else return true;
-    // Error found, return 1
-    // Error NOT found, return 0
+    return _send(AT_CSCLK,_sleepMode ? 1 : 0)==OK;
 }
 
 bool Sim800C::getSleepMode()
@@ -146,26 +910,7 @@ bool Sim800C::setFunctionalityMode(uint8_t fun)
 
         _functionalityMode = fun;
 
-        switch(_functionalityMode)
-        {
-        case 0:
-            HwSwSerial.print(F("AT+CFUN=0\r\n "));
-            break;
-        case 1:
-            HwSwSerial.print(F("AT+CFUN=1\r\n "));
-            break;
-        case 4:
-            HwSwSerial.print(F("AT+CFUN=4\r\n "));
-            break;
-        }
-
-        if ( (_readSerial().indexOf("ER")) == -1)
-        {
-            return false;
-        }
-        else return true;
-        // Error found, return 1
-        // Error NOT found, return 0
+        return _send(AT_CFUN,_functionalityMode)==OK;
     }
     return false;
 }
@@ -178,85 +923,118 @@ uint8_t Sim800C::getFunctionalityMode()
 
 bool Sim800C::setPIN(String pin)
 {
-    String command;
-    command  = "AT+CPIN=";
-    command += pin;
-    command += "\r";
-
-    // Can take up to 5 seconds
-
-    HwSwSerial.print(command);
-
-    if ( (_readSerial(5000).indexOf("ER")) == -1)
-    {
-        return false;
-    }
-    else return true;
-    // Error found, return 1
-    // Error NOT found, return 0
+    return _send(AT_CPIN,pin.c_str())==OK;
 }
 
 
 String Sim800C::getProductInfo()
 {
-    HwSwSerial.print("ATI\r");
-    return (_readSerial());
+    _send(AT_INFO);
+    return _responseString();
 }
 
 
 String Sim800C::getOperatorsList()
 {
 
-    // Can take up to 45 seconds
-
-    HwSwSerial.print("AT+COPS=?\r");
+    _send(AT_COPS_LIST);
 
-    return _readSerial(45000);
+    return _responseString();
 
 }
 
 String Sim800C::getOperator()
 {
 
-    HwSwSerial.print("AT+COPS ?\r");
+    _send(AT_COPS);
 
-    return _readSerial();
+    return _responseString();
 
 }
 
+// PWRKEY pulse only, Setup() and reset() then wait for the modem to answer.
 void Sim800C::PowerOn()
 {
-	digitalWrite(DEFAULT_POWER_PIN,LOW);
-	delay(1000);
-	digitalWrite(DEFAULT_POWER_PIN,HIGH);
-	delay(2200);
+	_powerPulse(0);
 }
 
 void Sim800C::PowerOff()
 {
-	digitalWrite(DEFAULT_POWER_PIN,LOW);
-	delay(1000);
-	digitalWrite(DEFAULT_POWER_PIN,HIGH);
-	delay(1700);
+	_powerPulse(POWER_OFF_SETTLE);
 	//Or
-	//HwSwSerial.print(F("AT+CPOWD=1",1);
+	//_serial->print(F("AT+CPOWD=1",1);
+}
+
+bool Sim800C::powerBusy()
+{
+    return _power.step!=POWER_IDLE;
+}
+
+// Pull PWRKEY low and leave the rest to poll(), a new pulse replaces a running one.
+void Sim800C::_powerPulse(uint16_t settle)
+{
+    if (_powerPin==NO_POWER_PIN) return;
+    digitalWrite(_powerPin,LOW);
+    _power.step=POWER_PULSE_LOW;
+    _power.since=_clock->millis();
+    _power.settle=settle;
+    _timing.slept+=POWER_PULSE+settle;
 }
 
-void Sim800C::reset()
+void Sim800C::_powerStep()
+{
+    uint32_t now=_clock->millis();
+
+    switch (_power.step)
+    {
+    case POWER_PULSE_LOW:
+        if (now-_power.since<POWER_PULSE) return;
+        digitalWrite(_powerPin,HIGH);
+        _power.step=_power.settle ? POWER_SETTLE : POWER_IDLE;
+        _power.since=now;
+        break;
+
+    case POWER_SETTLE:
+        if (now-_power.since>=_power.settle) _power.step=POWER_IDLE;
+        break;
+    }
+}
+
+// For the blocking Setup() and reset(): poll, the rest of the pool too, until the sequence ends.
+void Sim800C::_powerWait()
+{
+    while (_power.step!=POWER_IDLE)
+    {
+        poll();
+        if (_pool!=NULL) _pool->_pollOthers(this);
+        if (_power.step!=POWER_IDLE) _clock->idle(IDLE_TICK);
+    }
+}
+
+// Power cycle, then BOOT_TIMEOUT for the modem to answer and report SMS Ready. ERROR when it does not.
+uint8_t Sim800C::reset()
 {
     PowerOff();
-	delay(500);
+    if (_power.step!=POWER_IDLE)
+    {
+        _power.settle+=RESET_OFF_PAUSE;
+        _timing.slept+=RESET_OFF_PAUSE;
+    }
+    _powerWait();
+    _boot.smsReady=0;
+    _bootStart=_clock->millis();
 	PowerOn();
+    _powerWait();
     // wait for the module response
+    if (!_waitReady(BOOT_TIMEOUT)) return ERROR;
 
-    HwSwSerial.print(F("AT\r\n"));
-    while (_readSerial().indexOf("OK")==-1 )
+    //wait for sms ready
+    while (_boot.smsReady==0)
     {
-        HwSwSerial.print(F("AT\r\n"));
+        if (_clock->millis()-_bootStart>=BOOT_TIMEOUT) return ERROR;
+        poll();
     }
-
-    //wait for sms ready
-    while (_readSerial().indexOf("SMS")==-1 );
+    return OK;
 }
 
 void Sim800C::setPhoneFunctionality()
@@ -268,7 +1046,7 @@ void Sim800C::setPhoneFunctionality()
     4 Disable phone both transmit and receive RF circuits.
     <rst> 1 Reset the MT before setting it to <fun> power level.
     */
-    HwSwSerial.print (F("AT+CFUN=1\r\n"));
+    _post(AT_CFUN,NULL,1);
 }
 
 
@@ -287,19 +1065,27 @@ String Sim800C::signalQuality()
     subclause 7.2.4
     99 Not known or not detectable
     */
-    HwSwSerial.print (F("AT+CSQ\r\n"));
-    return(_readSerial());
+    char line[16];
+
+    // a fresh cache saves the round trip
+    if (_net.csqTime==0 || _clock->millis()-_net.csqTime>=NET_CSQ_INTERVAL)
+    {
+        if (_send(AT_CSQ)!=OK) return _responseString();
+        _netCsq();
+    }
+    sprintf(line,"+CSQ: %u,%u",_net.rssi,_net.ber);
+    return String(line);
 }
 
 bool Sim800C::answerCall()
 {
-    return send_cmd_wait_reply(F("ATA\r\n"),RESPON_OK,10000);
+    return _send(AT_ANSWER);
 }
 
 
 bool Sim800C::callNumber(String number)
 {
-    return send_cmd_wait_reply("ATD"+number+";\r\n",RESPON_OK,30000);
+    return _send(AT_DIAL,number.c_str());
 }
 
 
@@ -315,381 +1101,2614 @@ uint8_t Sim800C::getCallStatus()
      4 Call in progress
 
     */
-    HwSwSerial.print (F("AT+CPAS\r\n"));
-    SimBuffer=_readSerial();
-    return SimBuffer.substring(SimBuffer.indexOf("+CPAS: ")+7,SimBuffer.indexOf("+CPAS: ")+9).toInt();
+    const char *line;
+    _send(AT_CPAS);
+    line=_responseLine("+CPAS: ");
+    if (line==NULL) return 0;
+    return atoi(line+7);
 }
 
 
 bool Sim800C::hangoffCall()
 {
-    return send_cmd_wait_reply(F("ATH\r\n"),RESPON_OK,10000);
+    return _send(AT_HANGUP);
 }
 
-bool Sim800C::send_cmd_wait_reply(String aCmd,const char*aResponExit,uint32_t aTimeoutMax)
+// The caller's buffer outlives the wait, so it is sent in place and may exceed CMD_MAX_LENGTH.
+bool Sim800C::send_cmd_wait_reply(const char *aCmd,const char*aResponExit,uint32_t aTimeoutMax)
 {
-    HwSwSerial.print(aCmd);
-    SimBuffer=_readSerial(aTimeoutMax);
-    if ( (SimBuffer.indexOf(aResponExit)) != -1)
-    {
-        delay(100);
-        return OK;
-    }
-    delay(100);
-    return ERROR;    
+    at_command *c=_enqueue(aResponExit,aTimeoutMax,NULL);
+    if (c==NULL) return ERROR;
+    c->cmd=aCmd;
+    c->flash=false;
+    return _waitCommand(c)==CMD_OK ? OK : ERROR;
 }
 
 bool Sim800C::send_cmd_wait_reply(const __FlashStringHelper *aCmd,const char*aResponExit,uint32_t aTimeoutMax)
 {
-    HwSwSerial.print(aCmd);
-    SimBuffer=_readSerial(aTimeoutMax);
-    if ( (SimBuffer.indexOf(aResponExit)) != -1)
+    at_command *c=_enqueue(aResponExit,aTimeoutMax,NULL);
+    if (c==NULL) return ERROR;
+    c->cmd=(const char*)aCmd;
+    c->flash=true;
+    return _waitCommand(c)==CMD_OK ? OK : ERROR;
+}
+
+/*
+ * Take a free slot at the back of the queue, or with aFront ahead of every
+ * command not yet written. The front is for steps that continue the exchange
+ * that just finished, like the text after the SMS prompt.
+ */
+at_command *Sim800C::_enqueue(const char*aResponExit,uint32_t aTimeoutMax,command_callback aCallback,bool aFront)
+{
+    at_command *c;
+#ifdef SIM800C_STATS
+    bool retry=_statsRetry;
+    // a retry that cannot be queued is not sent, nothing to count
+    _statsRetry=false;
+#endif
+    if (_cmdCount>=CMD_QUEUE_SIZE) return NULL;
+    if (aFront)
     {
-        delay(100);
-        return OK;
+        if (_cmdCount && _cmdQueue[_cmdHead].state==CMD_WAITING) return NULL;
+        _cmdHead=(_cmdHead+CMD_QUEUE_SIZE-1)%CMD_QUEUE_SIZE;
+        c=&_cmdQueue[_cmdHead];
     }
-    delay(100);
-    return ERROR;
+    else c=&_cmdQueue[(_cmdHead+_cmdCount)%CMD_QUEUE_SIZE];
+    c->ticket=_cmdIssued++;
+    c->respon=aResponExit;
+    c->timeout=aTimeoutMax;
+    c->callback=aCallback;
+    c->handler=NULL;
+    c->state=CMD_PENDING;
+    c->queued=_clock->millis();
+#ifdef SIM800C_STATS
+    c->retry=retry;
+#endif
+    _cmdCount++;
+    return c;
 }
 
-bool Sim800C::AddToWhiteList(uint8_t Command,uint8_t index,char * PhoneNumber) //index=1-30
+bool Sim800C::submit(const __FlashStringHelper *aCmd,const char*aResponExit,uint32_t aTimeoutMax,command_callback aCallback)
 {
-    if(Command==Disable) 
-    {
-        return send_cmd_wait_reply(F("AT+CWHITELIST=0\r\n"),RESPON_OK,30000);    
-    }  
-    HwSwSerial.print (F("AT+CWHITELIST="));  	// command to send sms
-    HwSwSerial.print (Command);
-    HwSwSerial.print (F(",")); 
-    HwSwSerial.print (index);
-    HwSwSerial.print (F(",")); 
-    HwSwSerial.print (PhoneNumber);
-    HwSwSerial.print(F("\r\n"));
-    SimBuffer=_readSerial(20000);
-    if ( (SimBuffer.indexOf(RESPON_OK)) != -1)
-    {
-        return OK;    
-    }  
-    return ERROR;
+    at_command *c=_enqueue(aResponExit,aTimeoutMax,aCallback);
+    if (c==NULL) return false;
+    c->cmd=(const char*)aCmd;
+    c->flash=true;
+    return true;
 }
 
-uint8_t Sim800C::whiteListStatus(char * PhoneNumbers)
+bool Sim800C::submit(const char *aCmd,const char*aResponExit,uint32_t aTimeoutMax,command_callback aCallback)
+{
+    if (strlen(aCmd)>=CMD_MAX_LENGTH) return false;
+    at_command *c=_enqueue(aResponExit,aTimeoutMax,aCallback);
+    if (c==NULL) return false;
+    strcpy(c->text,aCmd);
+    c->cmd=c->text;
+    c->flash=false;
+    return true;
+}
+
+bool Sim800C::busy()
+{
+    return _cmdCount!=0;
+}
+
+/*
+ * Drive the command at the head of the queue one step: write it when pending,
+ * collect the reply while waiting and complete it on the expected reply,
+ * ERROR or timeout. Never blocks, call it as often as possible from loop().
+ */
+void Sim800C::poll()
 {
-    int index1,index2;
-    uint8_t retVal=255;
-    if(send_cmd_wait_reply(F("AT+CWHITELIST?\r\n"),RESPON_OK,30000)==OK)
+    if (_waitDepth==0 && _urcCount) _deferredUrcs();
+    if (_power.step!=POWER_IDLE) _powerStep();
+    if (_call.state!=CALL_IDLE) _callStep();
+#ifdef SIM800C_HTTP
+    if (_http.step!=HTTP_IDLE) _httpStep();
+#endif
+    if (_cmdCount==0) _outboxStep();
+    if (_cmdCount==0) _netStep();
+    if (_cmdCount==0)
+    {
+        while (_readLine())
+        {
+            if (!_dispatchUrc()) _queueUrc(NOT_Recog_Data,0,_rxLine);
+        }
+        if (_cmtReady) _cmtDeliver();
+        return;
+    }
+    at_command *c=&_cmdQueue[_cmdHead];
+    bool body;
+
+    switch (c->state)
     {
-        index1=SimBuffer.indexOf("+CWHITELIST:");
-        if(index1!=-1)
+    case CMD_PENDING:
+        _arenaClear();
+        c->start=_clock->millis();
+        _timing.queued=c->start-c->queued;
+        _timing.firstByte=0;
+        _timing.urcs=0;
+        _rxFirst=true;
+        _result.type=RESULT_OK;
+        _result.code=0;
+        _rxMark=_rxBytes;
+        // a wait-only step (after the SMS prompt) keeps counting what was sent before it
+        if (c->cmd!=NULL)
+        {
+            if (c->flash) _timing.bytesSent=_serial->print((const __FlashStringHelper *)c->cmd);
+            else          _timing.bytesSent=_serial->print(c->cmd);
+        }
+        c->state=CMD_WAITING;
+        break;
+
+    case CMD_WAITING:
+        while (_readLine())
         {
-            index1=SimBuffer.indexOf(",",index1);
-            
-            if(index1!=-1)
+            // the line after an SMS header is message text, never a URC
+            body=_rxBody;
+            _rxBody=false;
+            if (_rxFirst)
+            {
+                _timing.firstByte=_clock->millis()-c->start;
+                _rxFirst=false;
+            }
+            if (!body && _dispatchUrc())
+            {
+                _timing.urcs++;
+                continue;
+            }
+            if (_lineIs(c->respon))
             {
-                retVal=SimBuffer.substring(index1-1,index1).toInt();
-                index1++;
-                index2=SimBuffer.indexOf(RESPON_OK);
-                if(index2!=-1)
-                {
-                    SimBuffer.substring(index1,index2).toCharArray(PhoneNumbers, index2-index1+1);  
-                }    
+                _finishCommand(c,CMD_OK);
+                return;
             }
+            if (_lineIs(RESPON_ERROR) || _lineStartsWith("+CME ERROR:") || _lineStartsWith("+CMS ERROR:"))
+            {
+                _classify();
+                _arenaAppend(_rxLine,false);
+                _finishCommand(c,CMD_ERROR);
+                return;
+            }
+            if (c->respon[0]==0)
+            {
+                _arenaAppend(_rxLine,false);
+                _finishCommand(c,CMD_OK);
+                return;
+            }
+            _rxBody=_lineStartsWith("+CMGR:") || _lineStartsWith("+CMGL:");
+            if (c->handler!=NULL) (this->*(c->handler))();
+            else                  _arenaAppend(_rxLine,_rxSplit);
         }
+        if (_cmtReady) _cmtDeliver();
+        if (_clock->millis()-c->start>=c->timeout)
+        {
+            _finishCommand(c,CMD_TIMEOUT);
+        }
+        break;
     }
-    return retVal;
 }
 
-bool Sim800C::sendSms(char* number,char* text)
+void Sim800C::_finishCommand(at_command *c,uint8_t result)
 {
-    // Can take up to 60 seconds
-    HwSwSerial.print (F("AT+CMGS=\""));  	// command to send sms
-    HwSwSerial.print (number);
-    HwSwSerial.print(F("\"\r"));
-    delay(100);
-    SimBuffer=_readSerial(10000);
-    if ( (SimBuffer.indexOf(">")) != -1)
-    {
-        HwSwSerial.print(text);
-        HwSwSerial.print((char)ctrlz);
-        SimBuffer=_readSerial(60000);
-        //expect CMGS:xxx   , where xxx is a number,for the sending sms.
-        if ( (SimBuffer.indexOf("ER")) == -1)
+    command_callback callback=c->callback;
+    _timing.latency=_clock->millis()-c->start;
+    _timing.bytesReceived=_rxBytes-_rxMark;
+    _timing.result=result;
+    if (result==CMD_TIMEOUT) _result.type=RESULT_TIMEOUT;
+    c->state=CMD_IDLE;
+    _cmdHead=(_cmdHead+1)%CMD_QUEUE_SIZE;
+    _cmdCount--;
+    _lastResult=result;
+    _done[_doneNext].ticket=c->ticket;
+    _done[_doneNext].result=result;
+    _doneNext=(_doneNext+1)%CMD_QUEUE_SIZE;
+#ifdef SIM800C_STATS
+    _statsRecord(c,result);
+#endif
+    if (callback!=NULL) callback(*this,result);
+}
+
+/*
+ * Run the queue until command c finishes, poll() returns right after it so
+ * its reply is intact. Nested in a callback of another blocking call's wait,
+ * c goes ahead of every command not yet written, or fails when the command
+ * waited for is already on the line: its reply would be lost to c's.
+ */
+uint8_t Sim800C::_waitCommand(at_command *c)
+{
+    uint16_t outer=_waitTicket;
+    uint16_t ticket;
+    uint8_t result;
+
+    if (_waitDepth>0)
+    {
+        if (_started(outer))
         {
-            return OK;
-        }    
+            _dropCommand(c);
+            _lastResult=CMD_ERROR;
+            return CMD_ERROR;
+        }
+        c=_promote(c);
     }
-    
-    return ERROR;
+    ticket=c->ticket;
+    _waitTicket=ticket;
+    _waitDepth++;
+    while (!_finished(ticket,&result))
+    {
+        poll();
+        if (_pool!=NULL) _pool->_pollOthers(this);
+        if (!_finished(ticket,&result)) _clock->idle(IDLE_TICK);
+    }
+    _waitDepth--;
+    _waitTicket=outer;
+    _lastResult=result;
+    return result;
 }
 
-uint8_t Sim800C::readSms(uint8_t index,char * phone_number,char * SMS_text)
+bool Sim800C::_finished(uint16_t ticket,uint8_t *result)
 {
-    uint8_t ret_val=ERROR;
-    int index1,index2;
-    HwSwSerial.print (F("AT+CMGR="));
-    HwSwSerial.print (index);
-    HwSwSerial.print ("\r\n");
-    SimBuffer=_readSerial(5000);
-    /* +CMGR: "REC UNREAD","+989132383246","","19/01/17,10:06:21+14"
-        
-        MESSAGE TEXT
+    for (uint8_t i=0; i<CMD_QUEUE_SIZE; i++)
+    {
+        if (_done[i].ticket!=ticket) continue;
+        *result=_done[i].result;
+        return true;
+    }
+    return false;
+}
 
-        OK
-    */
-    if (SimBuffer.indexOf(RESPON_OK)!=-1)
+// Command ticket has been written and waits for its reply.
+bool Sim800C::_started(uint16_t ticket)
+{
+    for (uint8_t i=0; i<_cmdCount; i++)
+    {
+        at_command *c=&_cmdQueue[(_cmdHead+i)%CMD_QUEUE_SIZE];
+        if (c->ticket==ticket) return c->state==CMD_WAITING;
+    }
+    return false;
+}
+
+// Move the command at the back ahead of every command not yet written, the slots between shift back by one.
+at_command *Sim800C::_promote(at_command *c)
+{
+    uint8_t i=(_cmdHead+_cmdCount-1)%CMD_QUEUE_SIZE;
+    uint8_t prev;
+    at_command moved;
+
+    if (c!=&_cmdQueue[i]) return c;
+    moved=*c;
+    for (;;)
+    {
+        prev=(i+CMD_QUEUE_SIZE-1)%CMD_QUEUE_SIZE;
+        if (i==_cmdHead || _cmdQueue[prev].state!=CMD_PENDING) break;
+        _cmdQueue[i]=_cmdQueue[prev];
+        if (!_cmdQueue[i].flash && _cmdQueue[prev].cmd==_cmdQueue[prev].text) _cmdQueue[i].cmd=_cmdQueue[i].text;
+        i=prev;
+    }
+    if (!moved.flash && moved.cmd==c->text) moved.cmd=_cmdQueue[i].text;
+    _cmdQueue[i]=moved;
+    return &_cmdQueue[i];
+}
+
+// Take back a command never written, it is at the front or the back of the queue.
+void Sim800C::_dropCommand(at_command *c)
+{
+    c->state=CMD_IDLE;
+    if (c==&_cmdQueue[_cmdHead]) _cmdHead=(_cmdHead+1)%CMD_QUEUE_SIZE;
+    _cmdCount--;
+}
+
+// Wait for a line starting with aResponExit without sending anything, ahead of queued commands.
+uint8_t Sim800C::_waitReply(const char*aResponExit,uint32_t aTimeoutMax)
+{
+    at_command *c=_enqueue(aResponExit,aTimeoutMax,NULL,true);
+    if (c==NULL) return CMD_ERROR;
+    c->cmd=NULL;
+    return _waitCommand(c);
+}
+
+// Move everything the serial port holds into the receive ring.
+void Sim800C::_pump()
+{
+    while (_rx.space() && _serial->available())
     {
-        ret_val=GETSMS_NO_SMS;
-        if (SimBuffer.indexOf("+CMGR:")!=-1) 
-		{
-			if (SimBuffer.indexOf("REC UNREAD")!=-1) 			
-				ret_val=GETSMS_UNREAD_SMS;	
-			else if (SimBuffer.indexOf("REC READ")!=-1)
-				ret_val=GETSMS_READ_SMS;
-			else
-				ret_val=GETSMS_OTHER_SMS;
+        _rx.put((uint8_t) _serial->read());
+        _rxBytes++;
+    }
+    if (_rx.available()>_timing.ringPeak) _timing.ringPeak=_rx.available();
+}
+
+// Called right before a command is queued again after failing, counted by SIM800C_STATS.
+void Sim800C::_retryNext()
+{
+#ifdef SIM800C_STATS
+    _statsRetry=true;
+#endif
+}
+
+#ifdef SIM800C_STATS
+/*
+ * Fold the finished command into the row of its name, a wait-only step after
+ * an SMS prompt counts as ">". A new name takes a free row or, when none is
+ * left, the last one.
+ */
+void Sim800C::_statsRecord(at_command *c,uint8_t result)
+{
+    char name[STATS_NAME_SIZE];
+    command_stats *row;
+    uint8_t i,n,cls;
+    uint32_t bound;
+    char ch;
 
-            index1=SimBuffer.indexOf(",")+5;
-            index2=SimBuffer.indexOf(",",index1)-1;  
-            SimBuffer.substring(index1,index2).toCharArray(phone_number, index2-index1+1);   
-            
-            index1=SimBuffer.indexOf(lf,index2)+1;
-            index2=SimBuffer.length();    
-            index2-=8;   //Cr,Lf,Cr,Lf OK Cr,Lf   
-            SimBuffer.substring(index1,index2).toCharArray(SMS_text, index2-index1+1);  
+    if (c->cmd==NULL) strcpy(name,">");
+    else
+    {
+        for (n=0; n<STATS_NAME_SIZE-1; n++)
+        {
+            ch=c->flash ? pgm_read_byte(c->cmd+n) : c->cmd[n];
+            if (ch==0 || ch=='=' || ch=='?' || ch==';' || ch==cr) break;
+            // the dialled number is not part of the key, every call shares the ATD row
+            if (n==3 && strncmp(name,"ATD",3)==0) break;
+            name[n]=ch;
         }
+        name[n]=0;
+    }
+    for (i=0; i<STATS_COMMANDS-1; i++)
+    {
+        if (_stats[i].name[0]==0) strcpy(_stats[i].name,name);
+        if (strcmp(_stats[i].name,name)==0) break;
     }
-    else return ret_val;
+    row=&_stats[i];
+    if (row->name[0]==0) strcpy(row->name,"*");
+
+    if      (result==CMD_OK)      cls=STATS_OK;
+    else if (result==CMD_TIMEOUT) cls=STATS_TIMEOUT;
+    else if (_result.type!=RESULT_ERROR) cls=STATS_CME;
+    else                          cls=STATS_ERROR;
+
+    if (c->retry) row->retries++;
+
+    row->count++;
+    row->results[cls]++;
+    row->bytesSent+=_timing.bytesSent;
+    row->bytesReceived+=_timing.bytesReceived;
+    row->urcs+=_timing.urcs;
+    if (_timing.firstByte>row->firstByteMax) row->firstByteMax=_timing.firstByte;
+    if (_timing.latency>row->latencyMax)     row->latencyMax=_timing.latency;
+    row->latencySum+=_timing.latency;
+    for (n=0,bound=16; n<STATS_BUCKETS-1 && _timing.latency>=bound; n++) bound<<=1;
+    row->histogram[n]++;
 }
 
-bool Sim800C::deleteSMS(uint8_t position)
+const command_stats *Sim800C::getStats()
 {
-    HwSwSerial.print(F("AT+CMGD="));
-    HwSwSerial.print(position);
-    HwSwSerial.print(F("\r\n"));
+    return _stats;
+}
+
+void Sim800C::clearStats()
+{
+    memset(_stats,0,sizeof(_stats));
+    _statsRetry=false;
+}
 
-    SimBuffer=_readSerial(25000);
+/*
+ * One line per command, the histogram counts replies under 16, 32 ... ms:
+ * stats cmd=AT+CREG n=12 ok=12 err=0 cme=0 timeout=0 retries=0 tx=120 rx=240 urcs=1 first_max=9 avg=20 max=31 hist=3,9,0,0,0,0,0,0
+ */
+void Sim800C::printStats(Print &out)
+{
+    command_stats *row;
+    uint8_t i,n;
 
-	if ( (SimBuffer.indexOf("ER")) == -1)
+    for (i=0; i<STATS_COMMANDS; i++)
     {
-        return OK;
+        row=&_stats[i];
+        if (row->count==0) continue;
+        out.print(F("stats cmd="));
+        out.print(row->name);
+        out.print(F(" n="));
+        out.print(row->count);
+        out.print(F(" ok="));
+        out.print(row->results[STATS_OK]);
+        out.print(F(" err="));
+        out.print(row->results[STATS_ERROR]);
+        out.print(F(" cme="));
+        out.print(row->results[STATS_CME]);
+        out.print(F(" timeout="));
+        out.print(row->results[STATS_TIMEOUT]);
+        out.print(F(" retries="));
+        out.print(row->retries);
+        out.print(F(" tx="));
+        out.print(row->bytesSent);
+        out.print(F(" rx="));
+        out.print(row->bytesReceived);
+        out.print(F(" urcs="));
+        out.print(row->urcs);
+        out.print(F(" first_max="));
+        out.print(row->firstByteMax);
+        out.print(F(" avg="));
+        out.print(row->latencySum/row->count);
+        out.print(F(" max="));
+        out.print(row->latencyMax);
+        out.print(F(" hist="));
+        for (n=0; n<STATS_BUCKETS; n++)
+        {
+            if (n>0) out.print(',');
+            out.print(row->histogram[n]);
+        }
+        out.println();
     }
-    else return ERROR;
 }
+#endif
 
-bool Sim800C::delAllSms()
+const command_timing &Sim800C::lastTiming()
 {
-    // Can take up to 25 seconds
-    return send_cmd_wait_reply(F("AT+CMGDA=\"DEL ALL\"\r\n"),RESPON_OK,25000);
+    return _timing;
 }
 
-uint8_t Sim800C::check_receive_command(void)
+/*
+ * One machine readable line per command, e.g.
+ * timing result=1 queued=0 first_byte=12 latency=84 tx=11 rx=20 urcs=0 slept=0 ring_peak=20 arena_peak=14
+ */
+void Sim800C::printTiming(Print &out)
+{
+    out.print(F("timing result="));
+    out.print(_timing.result);
+    out.print(F(" queued="));
+    out.print(_timing.queued);
+    out.print(F(" first_byte="));
+    out.print(_timing.firstByte);
+    out.print(F(" latency="));
+    out.print(_timing.latency);
+    out.print(F(" tx="));
+    out.print(_timing.bytesSent);
+    out.print(F(" rx="));
+    out.print(_timing.bytesReceived);
+    out.print(F(" urcs="));
+    out.print(_timing.urcs);
+    out.print(F(" slept="));
+    out.print(_timing.slept);
+    out.print(F(" ring_peak="));
+    out.print(_timing.ringPeak);
+    out.print(F(" arena_peak="));
+    out.println(_timing.arenaPeak);
+}
+
+/*
+ * Incremental receive tokenizer: consume whatever the receive ring holds, one
+ * byte at a time, and return true as soon as a line terminated by CR LF (or
+ * the "> " SMS prompt while a command waits for it) is framed in _rxLine.
+ * Empty lines are skipped. A line longer than RX_LINE_SIZE is handed out in
+ * pieces, _rxSplit marks the pieces that continue the previous one.
+ * While _rxRaw is set that many bytes of SMS text bypass the line buffer and
+ * are streamed straight into the caller's buffer (the direct delivery one
+ * with _rxCmt), a connection's ring or the HTTP window, or dropped with
+ * _rxDrop. While _rxPdu is set the line is fed to the PDU decoder.
+ */
+bool Sim800C::_readLine()
 {
-    SimBuffer=_readSerial(10);
-    int index1,index2;
-    if (SimBuffer.length()>=6)
+    char ch;
+    uint8_t i;
+    _pump();
+    while (_rx.available())
     {
-        //Serial.println(SimBuffer);
-        if (SimBuffer.indexOf("+CMTI:")!=-1)   //+CMTI: "SM",i        i=INDEX
+        ch=(char) _rx.get();
+        if (_rx.available()==0) _pump();
+
+        if (_rxRaw)
         {
-            //Sms received
-            if(SimBuffer.length()>=14)
+            if (_rxDrop) ;
+#ifdef SIM800C_HTTP
+            else if (_rxHttp)
             {
-                index1=SimBuffer.indexOf(",");
-			    index2=SimBuffer.indexOf(cr);
-                if(index1>index2)
-					index2=SimBuffer.indexOf(cr,index2+1);
-                sms_index=SimBuffer.substring(index1+1,index2).toInt();
-                if(sms_index>0)
-                    return Sms_received;
+                if (_http.fill<HTTP_WINDOW) _http.window[_http.fill++]=(uint8_t)ch;
             }
-        }
-        else if (SimBuffer.indexOf("+CLIP:")!=-1)  //+CLIP: "+983152401442",145,"",,"",0
-        {
-            //Calling
-            if(SimBuffer.length()>=11)
+#endif
+#ifdef SIM800C_SOCKETS
+            else if (_rxSock)
             {
-                index1=SimBuffer.indexOf("\"");
-                index2=SimBuffer.indexOf("\"",index1+1);
-                SimBuffer=SimBuffer.substring(index1+4,index2);
-                return Calling_with_number;
+                socket_state *s=&_sockets[_rxSock-1];
+                if (!s->rx.put((uint8_t)ch)) s->dropped++;
             }
-        }
-        else if (SimBuffer.indexOf("+CUSD:")!=-1)
-        {
-            index1=SimBuffer.indexOf("\"");
-            index2=SimBuffer.lastIndexOf("\"");
-            if(index1==index2 && index1!=-1)
-                index2=SimBuffer.length();
-            
-            if (index1!=-1 && index2!=-1)
+#endif
+            else _smsByte(ch);
+            if (--_rxRaw==0)
             {
-                SimBuffer=SimBuffer.substring(index1+1,index2);
-                return CUSD;
+                if (_rxCmt) _cmtReady=true;
+                _rxCmt=false;
+#ifdef SIM800C_SOCKETS
+                _rxSock=0;
+#endif
+#ifdef SIM800C_HTTP
+                _rxHttp=false;
+#endif
+                _rxDrop=false;
             }
+            continue;
         }
-        else if (SimBuffer.indexOf("NO CARRIER")!=-1)
+#ifdef SIM800C_LONG_SMS
+        if (_rxPdu)
         {
-            return NO_CARRIER;
+            // hex digits of a PDU go to the decoder up to the line end
+            if (ch==cr || ch==lf) _rxPdu=false;
+            else                  _pdu.put(ch);
+            continue;
         }
-        /*else if (SimBuffer.indexOf("RING")!=-1)
-        {
-            return RING;
-        }*/
-        else if (SimBuffer.indexOf("NO DIALTONE")!=-1)
-        {
-            return NO_DIALTONE;
-        }
-        else if (SimBuffer.indexOf("BUSY")!=-1)
+#endif
+
+        if (_rxLen==0 && _rxFull) _rxSplit=true;
+        else if (_rxLen==0)       _rxSplit=false;
+        _rxFull=false;
+
+        if (ch==cr) continue;
+        if (ch==lf)
         {
-            return BUSY;
+            if (_rxLen==0) continue;
+            _rxLine[_rxLen]=0;
+            _rxLen=0;
+            if (_rxCmtLine)
+            {
+                // text of a +CMT header without length, never a line of its own
+                _rxCmtLine=false;
+                _rxCmt=true;
+                for (i=0; _rxLine[i]; i++) _smsByte(_rxLine[i]);
+                _rxCmt=false;
+                _cmtReady=true;
+                continue;
+            }
+            return true;
         }
-        else if (SimBuffer.indexOf("NO ANSWER")!=-1)
+        if (ch=='>' && _rxLen==0 && !_rxSplit && _cmdCount && _cmdQueue[_cmdHead].respon[0]=='>')
         {
-            return NO_ANSWER;
+            // SMS prompt, the modem sends "> " without a line end
+            _rxLine[0]='>';
+            _rxLine[1]=0;
+            _rxPrompt=true;
+            return true;
         }
-        else if (SimBuffer.indexOf("MO RING")!=-1)
+        if (ch==':' && _rxLen>=5 && strncmp(_rxLine,"+IPD,",5)==0)
         {
-            return MO_RING;
+            // +IPD,[<n>,]<length>: the data follows the colon on the same line
+            _rxLine[_rxLen]=0;
+            _rxLen=0;
+            return true;
         }
-        else if (SimBuffer.indexOf("MO CONNECTED")!=-1)
+        if (ch==' ' && _rxLen==0 && _rxPrompt) continue;
+        _rxPrompt=false;
+
+        _rxLine[_rxLen++]=ch;
+        if (_rxLen>=RX_LINE_SIZE-1)
         {
-            return MO_CONNECTED;
+            _rxLine[_rxLen]=0;
+            _rxLen=0;
+            _rxFull=true;
+            return true;
         }
-        else
+    }
+    return false;
+}
+
+/*
+ * Response line arena. SimBuffer holds the lines of the current reply back to
+ * back, each NUL terminated. Lines that do not fit any more are dropped.
+ */
+void Sim800C::_arenaClear()
+{
+    _arenaLen=0;
+    _arenaLines=0;
+    SimBuffer[0]=0;
+}
+
+void Sim800C::_arenaAppend(const char *aLine,bool aContinue)
+{
+    uint16_t len=strlen(aLine);
+    if (aContinue)
+    {
+        if (_arenaLines==0) return;
+        _arenaLen--;			// overwrite the previous NUL
+    }
+    else
+    {
+        if (_arenaLen>=BUFFER_RESERVE_MEMORY-1) return;
+        _arenaLines++;
+    }
+
+    if (_arenaLen+len+1>BUFFER_RESERVE_MEMORY)
+    {
+        len=BUFFER_RESERVE_MEMORY-_arenaLen-1;
+    }
+    memcpy(SimBuffer+_arenaLen,aLine,len);
+    _arenaLen+=len;
+    SimBuffer[_arenaLen++]=0;
+    if (_arenaLen>_timing.arenaPeak) _timing.arenaPeak=_arenaLen;
+}
+
+const char *Sim800C::_firstLine()
+{
+    if (_arenaLines==0) return NULL;
+    return SimBuffer;
+}
+
+const char *Sim800C::_nextLine(const char *aLine)
+{
+    aLine+=strlen(aLine)+1;
+    if (aLine>=SimBuffer+_arenaLen) return NULL;
+    return aLine;
+}
+
+const char *Sim800C::_responseLine(const char *aPrefix)
+{
+    const char *line;
+    uint8_t len=strlen(aPrefix);
+    for (line=_firstLine(); line!=NULL; line=_nextLine(line))
+    {
+        if (strncmp(line,aPrefix,len)==0) return line;
+    }
+    return NULL;
+}
+
+// Reply lines joined with CR LF, for the public methods that return a String.
+String Sim800C::_responseString()
+{
+    String str;
+    const char *line;
+    for (line=_firstLine(); line!=NULL; line=_nextLine(line))
+    {
+        if (line!=SimBuffer) str += "\r\n";
+        str += line;
+    }
+    return str;
+}
+
+/*
+ * Verbose +CME ERROR texts of AT+CMEE=2 and their numbers (3GPP TS 27.007),
+ * the ones a SIM800 reports in practice.
+ */
+static const char cmeSimNotInserted[] PROGMEM = "SIM not inserted";
+static const char cmeSimPin[] PROGMEM         = "SIM PIN required";
+static const char cmeSimPuk[] PROGMEM         = "SIM PUK required";
+static const char cmeSimFailure[] PROGMEM     = "SIM failure";
+static const char cmeSimBusy[] PROGMEM        = "SIM busy";
+static const char cmeSimWrong[] PROGMEM       = "SIM wrong";
+static const char cmePassword[] PROGMEM       = "incorrect password";
+static const char cmeMemoryFull[] PROGMEM     = "memory full";
+static const char cmeInvalidIndex[] PROGMEM   = "invalid index";
+static const char cmeNotFound[] PROGMEM       = "not found";
+static const char cmeNoService[] PROGMEM      = "no network service";
+static const char cmeNetTimeout[] PROGMEM     = "network timeout";
+static const char cmeNotAllowed[] PROGMEM     = "operation not allowed";
+
+struct cme_text
+{
+    const char *text;
+    uint16_t code;
+};
+
+static const cme_text cmeTable[] PROGMEM =
+{
+    { cmeNotAllowed,     3 },
+    { cmeSimNotInserted, 10 },
+    { cmeSimPin,         11 },
+    { cmeSimPuk,         12 },
+    { cmeSimFailure,     13 },
+    { cmeSimBusy,        14 },
+    { cmeSimWrong,       15 },
+    { cmePassword,       16 },
+    { cmeMemoryFull,     20 },
+    { cmeInvalidIndex,   21 },
+    { cmeNotFound,       22 },
+    { cmeNoService,      30 },
+    { cmeNetTimeout,     31 }
+};
+
+// Type and number of the error line in _rxLine.
+void Sim800C::_classify()
+{
+    const char *p;
+    uint8_t i;
+
+    _result.code=0;
+    if (_rxLine[0]!='+')
+    {
+        _result.type=RESULT_ERROR;
+        return;
+    }
+    _result.type=(_rxLine[3]=='S') ? RESULT_CMS : RESULT_CME;
+    for (p=_rxLine+11; *p==' '; p++);
+    if (*p>='0' && *p<='9')
+    {
+        _result.code=atoi(p);
+        return;
+    }
+    _result.code=RESULT_CODE_UNKNOWN;
+    if (_result.type!=RESULT_CME) return;
+    for (i=0; i<sizeof(cmeTable)/sizeof(cmeTable[0]); i++)
+    {
+        if (strcasecmp_P(p,(const char*)pgm_read_ptr(&cmeTable[i].text))==0)
         {
-            return NOT_Recog_Data;
+            _result.code=pgm_read_word(&cmeTable[i].code);
+            return;
         }
     }
-    return No_data;
 }
 
-bool Sim800C::miss_call(String aSenderNumber,uint8_t NumOfTry) //NumOfTry 1-255
+const at_result &Sim800C::lastResult()
 {
-    uint8_t st;
-    uint32_t del;
-	int i;
-    bool _break=false;
-	for (i = 0; i < NumOfTry; i++)
-	{
-		if(callNumber(aSenderNumber)==OK)
-		{
-            del=millis();
-			while(millis()-del<10000 && !_break)
-			{
-				st=check_receive_command();
-				switch (st)
-				{
-					case NO_ANSWER:hangoffCall(); i=256;_break=true;
-					break;
-					case NO_DIALTONE: hangoffCall();_break=true;
-					break;
-					case BUSY: hangoffCall();_break=true;
-					break;
-					case MO_RING: hangoffCall(); i=256;_break=true;
-					break;
-					case MO_CONNECTED: hangoffCall(); i=256;_break=true;
-					break;
-					case NO_CARRIER: hangoffCall();_break=true;
-					break;
-				}
-			}
-			delay(300);
-			hangoffCall();
-			delay(1000);
-		}
-		delay(100);
-	}
-	if(i>=256) return OK;
-	return ERROR;
+    return _result;
 }
 
-void Sim800C::RTCtime(int *day,int *month, int *year,int *hour,int *minute, int *second)
+// The whole line, final result codes are matched exactly.
+bool Sim800C::_lineIs(const char *aText)
 {
-    HwSwSerial.print(F("at+cclk?\r\n"));
-    // if respond with ERROR try one more time.
-    SimBuffer=_readSerial();
-    if ((SimBuffer.indexOf("ERR"))!=-1)
+    uint8_t i;
+    for (i=0; aText[i]!=0 && aText[i]!=cr; i++)
     {
-        delay(50);
-        HwSwSerial.print(F("at+cclk?\r\n"));
+        if (_rxLine[i]!=aText[i]) return false;
     }
-    if ((SimBuffer.indexOf("ERR"))==-1)
+    return _rxLine[i]==0;
+}
+
+bool Sim800C::_lineStartsWith(const char *aPrefix)
+{
+    uint8_t i;
+    for (i=0; aPrefix[i]!=0 && aPrefix[i]!=cr; i++)
     {
-        SimBuffer=SimBuffer.substring(SimBuffer.indexOf("\"")+1,SimBuffer.lastIndexOf("\"")-1);
-        *year=SimBuffer.substring(0,2).toInt();
-        *month= SimBuffer.substring(3,5).toInt();
-        *day=SimBuffer.substring(6,8).toInt();
-        *hour=SimBuffer.substring(9,11).toInt();
-        *minute=SimBuffer.substring(12,14).toInt();
-        *second=SimBuffer.substring(15,17).toInt();
+        if (_rxLine[i]!=aPrefix[i]) return false;
     }
+    return true;
 }
 
-//Get the time  of the base of GSM
-String Sim800C::dateNet()
+bool Sim800C::AddToWhiteList(uint8_t Command,uint8_t index,char * PhoneNumber) //index=1-30
+{
+    if(Command==Disable) 
+    {
+        if(_send(AT_WHITELIST_OFF)!=OK) return false;
+        _wl.mode=Disable;
+        return true;
+    }  
+    if(_send(AT_WHITELIST,Command,index,PhoneNumber)!=OK) return false;
+    _wl.mode=Command;
+#ifdef SIM800C_WHITELIST_MIRROR
+    uint8_t key[WHITELIST_KEY_SIZE];
+    _whiteKey(PhoneNumber,key);
+    if(index>=1 && index<=WHITELIST_SIZE) _whiteSlot(index-1,key);
+#endif
+    return true;
+}
+
+uint8_t Sim800C::whiteListStatus(char * PhoneNumbers)
+{
+    return whiteListStatus(PhoneNumbers,0xFFFF);
+}
+
+uint8_t Sim800C::whiteListStatus(char * PhoneNumbers,uint16_t size)
 {
-    HwSwSerial.print(F("AT+CIPGSMLOC=2,1\r\n "));
-    SimBuffer=_readSerial();
+    if(!_whiteRead(PhoneNumbers,size)) return 255;
+    return _wl.mode;
+}
+
+#ifdef SIM800C_WHITELIST_MIRROR
+bool Sim800C::whiteListLoad()
+{
+    return _whiteRead(NULL,0);
+}
 
-    if (SimBuffer.indexOf("OK")!=-1 )
+int8_t Sim800C::whiteListSync(uint8_t mode,const char * const *numbers,uint8_t count)
+{
+    const char *number;
+    uint8_t key[WHITELIST_KEY_SIZE];
+    uint8_t slot;
+    int8_t written=0;
+
+    if (!_wl.loaded && !whiteListLoad()) return -1;
+    if (mode==Disable)
     {
-        return SimBuffer.substring(SimBuffer.indexOf(":")+2,(SimBuffer.indexOf("OK")-4));
+        if (_wl.mode!=Disable && !AddToWhiteList(Disable,0,NULL)) return -1;
+        return 0;
     }
-    else
-        return "0";
+    for (slot=0; slot<WHITELIST_SIZE; slot++)
+    {
+        number=(slot<count && numbers[slot]!=NULL) ? numbers[slot] : "";
+        _whiteKey(number,key);
+        if (memcmp(key,_wl.digits[slot],sizeof(key))==0 && mode==_wl.mode) continue;
+        // the mode goes with every write, once it is set only changed numbers are written
+        if (_send(AT_WHITELIST,mode,slot+1,number)!=OK) return -1;
+        _wl.mode=mode;
+        _whiteSlot(slot,key);
+        written++;
+    }
+    return written;
+}
+
+bool Sim800C::isAuthorized(const char *number)
+{
+    uint8_t key[WHITELIST_KEY_SIZE];
+    uint8_t bucket,slot;
+
+    // with the list off the modem lets every number through
+    if (_wl.loaded && _wl.mode==Disable) return true;
+    if (!_whiteKey(number,key)) return false;
+    for (bucket=_whiteBucket(key); (slot=_wl.index[bucket])!=0; bucket=(bucket+1)&(WHITELIST_INDEX-1))
+    {
+        if (memcmp(_wl.digits[slot-1],key,sizeof(key))==0) return true;
+    }
+    return false;
 }
 
-String Sim800C::_readSerial()
+// The trailing digits in BCD, right aligned after 0xF nibbles. false for a number without any.
+bool Sim800C::_whiteKey(const char *number,uint8_t *key)
 {
+    const char *p;
+    uint8_t nibble=2*WHITELIST_KEY_SIZE,digits=0;
 
-    uint64_t timeOld = millis();
-    int len,i;
+    memset(key,0xFF,WHITELIST_KEY_SIZE);
+    for (p=number+strlen(number); p>number && digits<WHITELIST_DIGITS; p--)
+    {
+        if (p[-1]<'0' || p[-1]>'9') continue;
+        nibble--;
+        if (nibble&1) key[nibble/2]=(key[nibble/2]&0xF0)|(p[-1]-'0');
+        else          key[nibble/2]=(key[nibble/2]&0x0F)|((p[-1]-'0')<<4);
+        digits++;
+    }
+    return digits!=0;
+}
+
+// FNV-1a of the digits, the first bucket of their slot.
+uint8_t Sim800C::_whiteBucket(const uint8_t *key)
+{
+    uint32_t hash=2166136261UL;
+    uint8_t i;
 
-    while (!HwSwSerial.available() && !(millis() > timeOld + TIME_OUT_READ_SERIAL))
+    for (i=0; i<WHITELIST_KEY_SIZE; i++)
     {
-        delay(13);
+        hash^=key[i];
+        hash*=16777619UL;
     }
+    return hash&(WHITELIST_INDEX-1);
+}
 
-    String str;
+// Rebuilt whole on every change, 30 insertions are cheaper than deleting from open addressing.
+void Sim800C::_whiteIndex()
+{
+    uint8_t slot,bucket;
 
-    while(HwSwSerial.available())
+    memset(_wl.index,0,sizeof(_wl.index));
+    for (slot=0; slot<WHITELIST_SIZE; slot++)
     {
-        len=HwSwSerial.available();
-        for(i=0;i<len;i++)
-        {
-            str += (char) HwSwSerial.read();
-        }
-        delay(15);
+        if (_wl.digits[slot][WHITELIST_KEY_SIZE-1]==0xFF) continue;
+        for (bucket=_whiteBucket(_wl.digits[slot]); _wl.index[bucket]!=0; bucket=(bucket+1)&(WHITELIST_INDEX-1));
+        _wl.index[bucket]=slot+1;
     }
+}
 
-    return str;
+void Sim800C::_whiteSlot(uint8_t slot,const uint8_t *key)
+{
+    if (memcmp(_wl.digits[slot],key,WHITELIST_KEY_SIZE)==0) return;
+    memcpy(_wl.digits[slot],key,WHITELIST_KEY_SIZE);
+    _whiteIndex();
+}
+#endif
 
+/*
+ * AT+CWHITELIST? into the mode and the mirror, "+CWHITELIST: <mode>,<number1>,...,<number30>".
+ * The line is longer than RX_LINE_SIZE, its pieces are parsed as they come
+ * and the numbers copied into PhoneNumbers when it is given.
+ */
+bool Sim800C::_whiteRead(char *PhoneNumbers,uint16_t size)
+{
+    at_command *c=_prepare(AT_WHITELIST_LIST);
+
+    if (c==NULL) return false;
+    _wl.out=PhoneNumbers;
+    _wl.outSize=size;
+    _wl.outLen=0;
+    if (PhoneNumbers!=NULL && size) PhoneNumbers[0]=0;
+    c->handler=&Sim800C::_whiteLine;
+    if (_waitCommand(c)!=CMD_OK || !_wl.parsing)
+    {
+        _wl.parsing=false;
+        return false;
+    }
+    _whiteField();
+    _wl.parsing=false;
+#ifdef SIM800C_WHITELIST_MIRROR
+    _wl.loaded=true;
+    _whiteIndex();
+#endif
+    return true;
 }
 
-String Sim800C::_readSerial(uint32_t timeout)
+void Sim800C::_whiteLine()
 {
+    const char *p=_rxLine;
 
-    uint64_t timeOld = millis();
-    int len,i;
+    if (!_rxSplit)
+    {
+        if (!_lineStartsWith("+CWHITELIST:")) return;
+        p+=12;
+        _wl.parsing=true;
+        _wl.field=0;
+        _wl.len=0;
+#ifdef SIM800C_WHITELIST_MIRROR
+        memset(_wl.digits,0xFF,sizeof(_wl.digits));
+#endif
+    }
+    else if (!_wl.parsing) return;
 
-    while (!HwSwSerial.available() && !(millis() > timeOld + timeout))
+    for (; *p; p++)
     {
-        delay(13);
+        if (*p==',') _whiteField();
+        else if (*p!='"' && *p!=' ' && _wl.len<WHITELIST_NUMBER_SIZE-1) _wl.number[_wl.len++]=*p;
     }
+}
 
-    String str;
+void Sim800C::_whiteField()
+{
+    uint16_t len;
 
-    while(HwSwSerial.available())
+    _wl.number[_wl.len]=0;
+    _wl.len=0;
+    if (_wl.field==0) _wl.mode=atoi(_wl.number);
+    else if (_wl.field<=WHITELIST_SIZE)
     {
-        len=HwSwSerial.available();
-        for(i=0;i<len;i++)
+#ifdef SIM800C_WHITELIST_MIRROR
+        _whiteKey(_wl.number,_wl.digits[_wl.field-1]);
+#endif
+        len=strlen(_wl.number);
+        if (_wl.out!=NULL && _wl.outLen+len+2<=_wl.outSize)
         {
-            str += (char) HwSwSerial.read();
+            if (_wl.field>1) _wl.out[_wl.outLen++]=',';
+            strcpy(_wl.out+_wl.outLen,_wl.number);
+            _wl.outLen+=len;
         }
-        delay(15);
+        else _wl.out=NULL;		// the list is cut at the last number that fit
     }
-
-    return str;
-
+    _wl.field++;
 }
 
+bool Sim800C::sendSms(char* number,char* text)
+{
+    // Can take up to 60 seconds
+    if (_send(AT_CMGS,number)==OK)
+    {
+        _timing.bytesSent+=_serial->print(text);
+        _timing.bytesSent+=_serial->print((char)ctrlz);
+        //expect CMGS:xxx   , where xxx is a number,for the sending sms.
+        if (_waitReply(RESPON_OK,60000)==CMD_OK)
+        {
+            return OK;
+        }    
+    }
+    
+    return ERROR;
+}
+
+/*
+ * Read one message, streamed into phone_number and SMS_text without ever
+ * writing more than numberSize / textSize bytes (NUL included). Returns one
+ * of GETSMS_..., smsTruncated() tells if the number or the text was cut.
+ */
+uint8_t Sim800C::readSms(uint8_t index,char * phone_number,uint8_t numberSize,char * SMS_text,uint16_t textSize)
+{
+    at_command *c;
+    char cmd[16];
+    /* +CMGR: "REC UNREAD","+989132383246","","19/01/17,10:06:21+14"
+        
+        MESSAGE TEXT
+
+        OK
+    */
+    _smsBegin(NULL,phone_number,numberSize,SMS_text,textSize);
+    _sms.index=index;
+    if (numberSize) phone_number[0]=0;
+    if (textSize)   SMS_text[0]=0;
+
+    c=_prepare(AT_CMGR,cmd,sizeof(cmd),index);
+    if (c==NULL) return ERROR;
+    c->handler=&Sim800C::_smsLine;
+    if (_waitCommand(c)!=CMD_OK)
+    {
+        _sms.open=false;
+        return ERROR;
+    }
+    if (!_sms.open) return GETSMS_NO_SMS;
+    _smsDeliver();
+    return _sms.status;
+}
+
+// Legacy form: the number without its first three characters ("+98"), buffers of SMS_NUMBER_SIZE / SMS_TEXT_SIZE.
+uint8_t Sim800C::readSms(uint8_t index,char * phone_number,char * SMS_text)
+{
+    uint8_t ret_val=readSms(index,phone_number,SMS_NUMBER_SIZE,SMS_text,SMS_TEXT_SIZE);
+    uint8_t len=strlen(phone_number);
+    if (len>3) memmove(phone_number,phone_number+3,len-2);
+    return ret_val;
+}
+
+bool Sim800C::deleteSMS(uint8_t position)
+{
+    return _send(AT_CMGD,position);
+}
+
+bool Sim800C::delAllSms()
+{
+    return _send(AT_CMGDA);
+}
+
+// Position of the n-th (0 based) quoted field of aLine, its length in *aLen.
+static const char *quotedField(const char *aLine,uint8_t n,uint8_t *aLen)
+{
+    const char *end;
+    while ((aLine=strchr(aLine,'"'))!=NULL)
+    {
+        aLine++;
+        end=strchr(aLine,'"');
+        if (end==NULL) return NULL;
+        if (n--==0)
+        {
+            *aLen=end-aLine;
+            return aLine;
+        }
+        aLine=end+1;
+    }
+    return NULL;
+}
+
+static void copyField(char *aDest,uint8_t aSize,const char *aSrc,uint8_t aLen)
+{
+    if (aSize==0) return;
+    if (aLen>=aSize) aLen=aSize-1;
+    memcpy(aDest,aSrc,aLen);
+    aDest[aLen]=0;
+}
+
+/*
+ * Bytes of text after a +CMGR / +CMT header of AT+CSDH=1, whose last field is
+ * the length and whose field dcsField (0 based, commas inside quotes skipped)
+ * the data coding scheme. The length counts octets, an 8 bit or UCS2 body is
+ * sent as two hex digits per octet. 0 when the header has no length.
+ */
+static uint16_t smsTextLength(const char *aLine,uint8_t dcsField)
+{
+    const char *dcs=NULL,*last=NULL;
+    bool quoted=false;
+    uint8_t field=0;
+    uint16_t len;
+    uint8_t alphabet;
+
+    aLine=strchr(aLine,':');
+    if (aLine==NULL) return 0;
+    for (aLine++; *aLine; aLine++)
+    {
+        if (*aLine=='"') quoted=!quoted;
+        if (*aLine!=',' || quoted) continue;
+        last=aLine+1;
+        if (++field==dcsField) dcs=last;
+    }
+    if (last==NULL || *last=='"' || *last==0) return 0;
+    len=atoi(last);
+    if (dcs==NULL || last==dcs) return len;
+    alphabet=atoi(dcs);
+    if ((alphabet&0xC0)==0x00)      alphabet=(alphabet>>2)&0x03;
+    else if ((alphabet&0xF0)==0xF0) alphabet=(alphabet&0x04) ? 1 : 0;
+    else if ((alphabet&0xF0)==0xE0) alphabet=2;
+    else                            alphabet=0;
+    return alphabet ? len*2 : len;
+}
+
+bool Sim800C::setDirectSms(bool enable,sms_callback aCallback,char *phone_number,uint8_t numberSize,char *SMS_text,uint16_t textSize)
+{
+    const char *line;
+    uint8_t used,total;
+
+    _cmt.callback=aCallback;
+    _cmt.number=phone_number;
+    _cmt.numberSize=numberSize;
+    _cmt.text=SMS_text;
+    _cmt.textSize=textSize;
+
+    _smsWatch=false;
+    if (enable && _send(AT_CNMI,2)==OK)
+    {
+        // with +CSMS service 1 the network waits for our acknowledgement
+        _cmtAck=false;
+        if (_send(AT_CSMS_QUERY)==OK && (line=_responseLine("+CSMS:"))!=NULL) _cmtAck=atoi(line+6)==1;
+        return true;
+    }
+
+    _send(AT_CNMI,1);
+    if (smsStorage(&used,&total) && total && used>=total)
+    {
+        // keep receiving into the phone memory while the SIM is full
+        _send(AT_CPMS,"ME","ME","ME");
+    }
+    else _smsWatch=true;
+    return !enable;
+}
+
+// +CPMS: "SM",<used>,<total>,... of the read storage
+static bool cpmsCounts(const char *line,uint8_t *used,uint8_t *total)
+{
+    if (line==NULL || (line=strchr(line,','))==NULL) return false;
+    *used=atoi(line+1);
+    if ((line=strchr(line+1,','))==NULL) return false;
+    *total=atoi(line+1);
+    return true;
+}
+
+bool Sim800C::smsStorage(uint8_t *used,uint8_t *total)
+{
+    if (_send(AT_CPMS_QUERY)!=OK) return false;
+    return cpmsCounts(_responseLine("+CPMS:"),used,total);
+}
+
+// AT+CPMS? queued by a +CMTI: the message that filled the SIM moves reception to the phone memory.
+void Sim800C::_smsStorageChecked(Sim800C &gsm,uint8_t result)
+{
+    uint8_t used,total;
+
+    if (result!=CMD_OK || !gsm._smsWatch) return;
+    if (!cpmsCounts(gsm._responseLine("+CPMS:"),&used,&total) || total==0 || used<total) return;
+    if (gsm._post(AT_CPMS,NULL,"ME","ME","ME")) gsm._smsWatch=false;
+}
+
+/*
+ * +CMT: "<number>","<alpha>","<time>"[,<tooa>,<fo>,<pid>,<dcs>,<sca>,<tosca>,<length>]
+ * The text follows: with the length of AT+CSDH=1 it is streamed as raw
+ * bytes, without it the next line is the text.
+ */
+void Sim800C::_cmtHeader()
+{
+    const char *field;
+    uint8_t len;
+
+    if (_cmtReady) _cmtDeliver();
+    _cmt.open=true;
+    _cmt.index=NoSMS;
+    _cmt.status=GETSMS_UNREAD_SMS;
+    _cmt.textLen=0;
+    _cmt.truncated=false;
+    if (_cmt.numberSize) _cmt.number[0]=0;
+    if (_cmt.textSize)   _cmt.text[0]=0;
+
+    field=quotedField(_rxLine,0,&len);
+    if (field!=NULL)
+    {
+        if (len>=_cmt.numberSize) _cmt.truncated=true;
+        copyField(_cmt.number,_cmt.numberSize,field,len);
+    }
+
+    len=strlen(_rxLine);
+    field=strrchr(_rxLine,',');
+    if (len && _rxLine[len-1]!='"' && field!=NULL)
+    {
+        _rxRaw=smsTextLength(_rxLine,6);
+        _rxCmt=_rxRaw!=0;
+        _cmtReady=_rxRaw==0;
+    }
+    else _rxCmtLine=true;
+}
+
+void Sim800C::_cmtDeliver()
+{
+    at_command *c;
+
+    _cmtReady=false;
+    if (!_cmt.open) return;
+    _cmt.open=false;
+    // the network waits a limited time for it, so it goes ahead of every command not yet written
+    if (_cmtAck && (c=_prepare(AT_CNMA))!=NULL) _promote(c);
+    if (_cmt.callback!=NULL) _cmt.callback(*this,_cmt.index,_cmt.status,_cmt.number,_cmt.text);
+}
+
+void Sim800C::_smsDeliver()
+{
+    if (!_sms.open) return;
+    _sms.open=false;
+    if (_sms.count<SMS_LIST_MAX) _sms.indices[_sms.count]=_sms.index;
+    _sms.count++;
+    if (_sms.callback!=NULL)
+    {
+        _sms.callback(*this,_sms.index,_sms.status,_sms.number,_sms.text);
+    }
+}
+
+void Sim800C::_smsByte(char ch)
+{
+    sms_parse_state *s=_rxCmt ? &_cmt : &_sms;
+    if (s->textLen+1<s->textSize)
+    {
+        s->text[s->textLen++]=ch;
+        s->text[s->textLen]=0;
+    }
+    else s->truncated=true;
+}
+
+/*
+ * Line handler of AT+CMGR and AT+CMGL, each message is a header followed by
+ * its text. With AT+CSDH=1 the header ends with the text length:
+ * +CMGL: 3,"REC UNREAD","+989132383246","","19/01/17,10:06:21+14",145,12
+ * +CMGR: "REC UNREAD","+989132383246","","19/01/17,10:06:21+14",145,4,0,0,"+989120000000",145,12
+ * and that many bytes are streamed into the caller's buffer, twice as many
+ * for the hex body of an 8 bit or UCS2 +CMGR. +CMGL has no DCS: what is left
+ * of such a body arrives as a line that continues the text. Without the
+ * length the text lines are appended one by one. A message is delivered when
+ * the next header or the final OK arrives.
+ */
+void Sim800C::_smsLine()
+{
+    const char *field;
+    uint8_t len;
+
+    if (_lineStartsWith("+CMGL:") || _lineStartsWith("+CMGR:"))
+    {
+        _smsDeliver();
+        _sms.open=true;
+        if (_rxLine[4]=='L') _sms.index=atoi(_rxLine+6);
+        _sms.status=GETSMS_OTHER_SMS;
+        _sms.textLen=0;
+        _sms.truncated=false;
+        if (_sms.numberSize) _sms.number[0]=0;
+        if (_sms.textSize)   _sms.text[0]=0;
+
+        field=quotedField(_rxLine,0,&len);
+        if (field!=NULL && strncmp(field,"REC UNREAD",len)==0)    _sms.status=GETSMS_UNREAD_SMS;
+        else if (field!=NULL && strncmp(field,"REC READ",len)==0) _sms.status=GETSMS_READ_SMS;
+
+        field=quotedField(_rxLine,1,&len);
+        if (field!=NULL)
+        {
+            if (len>=_sms.numberSize) _sms.truncated=true;
+            copyField(_sms.number,_sms.numberSize,field,len);
+        }
+
+        len=strlen(_rxLine);
+        field=strrchr(_rxLine,',');
+        _sms.framed=len && _rxLine[len-1]!='"' && field!=NULL;
+        if (_sms.framed)
+        {
+            _rxRaw=smsTextLength(_rxLine,_rxLine[4]=='R' ? 7 : 0xFF);
+            _rxBody=false;
+        }
+        return;
+    }
+    if (!_sms.open) return;
+
+    // no length in the header: the text lines joined with CR LF
+    if (_sms.textLen && !_rxSplit && !_sms.framed)
+    {
+        _smsByte(cr);
+        _smsByte(lf);
+    }
+    for (field=_rxLine; *field; field++) _smsByte(*field);
+}
+
+void Sim800C::_smsBegin(sms_callback aCallback,char *phone_number,uint8_t numberSize,char *SMS_text,uint16_t textSize)
+{
+    memset(&_sms,0,sizeof(_sms));
+    _sms.callback=aCallback;
+    _sms.number=phone_number;
+    _sms.numberSize=numberSize;
+    _sms.text=SMS_text;
+    _sms.textSize=textSize;
+}
+
+bool Sim800C::smsTruncated()
+{
+    return _sms.truncated;
+}
+
+/*
+ * Read every stored message (or only the unread ones) with one AT+CMGL round
+ * trip. Each message is streamed into phone_number / SMS_text, bounded by
+ * their sizes, and passed to aCallback, smsTruncated() tells if it was cut.
+ * With aDelete the listed messages are then removed with batched AT+CMGD
+ * command lines. Returns the number of messages.
+ */
+uint8_t Sim800C::readAllSms(bool unreadOnly,sms_callback aCallback,char *phone_number,uint8_t numberSize,char *SMS_text,uint16_t textSize,bool aDelete)
+{
+    at_command *c;
+    char cmd[24];
+
+    _smsBegin(aCallback,phone_number,numberSize,SMS_text,textSize);
+
+    c=_prepare(AT_CMGL,cmd,sizeof(cmd),unreadOnly ? "REC UNREAD" : "ALL");
+    if (c==NULL) return 0;
+    c->handler=&Sim800C::_smsLine;
+    _waitCommand(c);
+    _smsDeliver();
+
+    if (aDelete && _sms.count)
+    {
+        deleteSms(_sms.indices,_sms.count<SMS_LIST_MAX ? _sms.count : SMS_LIST_MAX);
+    }
+    return _sms.count;
+}
+
+#ifdef SIM800C_LONG_SMS
+// +CMGR: <stat>,[<alpha>],<length> in PDU mode, the PDU follows on the next line.
+void Sim800C::_pduLine()
+{
+    if (!_lineStartsWith("+CMGR:")) return;
+    _sms.open=true;
+    switch (atoi(_rxLine+6))
+    {
+    case 0:  _sms.status=GETSMS_UNREAD_SMS; break;
+    case 1:  _sms.status=GETSMS_READ_SMS;   break;
+    default: _sms.status=GETSMS_OTHER_SMS;  break;
+    }
+    _rxPdu=true;
+    _rxBody=false;
+}
+
+/*
+ * Read one message in PDU mode. A single part message is returned like
+ * readSms() does. A part of a concatenated message is kept in the reassembly
+ * cache: GETSMS_PART_SMS while parts are missing, the whole text once the
+ * last one arrives. Either way the stored index can be deleted afterwards.
+ */
+uint8_t Sim800C::readLongSms(uint8_t index,char *phone_number,uint8_t numberSize,char *SMS_text,uint16_t textSize)
+{
+    at_command *c;
+    char cmd[16];
+    uint8_t ret_val=ERROR;
+
+    if (_send(AT_CMGF,0)!=OK) return ERROR;
+
+    _smsBegin(NULL,NULL,0,NULL,0);
+    _pdu.begin(phone_number,numberSize,SMS_text,textSize);
+    c=_prepare(AT_CMGR,cmd,sizeof(cmd),index);
+    if (c!=NULL)
+    {
+        c->handler=&Sim800C::_pduLine;
+        if (_waitCommand(c)==CMD_OK) ret_val=_sms.open ? _sms.status : (uint8_t)GETSMS_NO_SMS;
+    }
+    _rxPdu=false;
+    _send(AT_CMGF,1);
+
+    if (!_sms.open) return ret_val;
+    if (!_pdu.done()) return ERROR;
+    _sms.truncated=_pdu.truncated;
+
+    if (_pdu.total>1)
+    {
+        if (!_smsCache.add(phone_number,_pdu.ref,_pdu.total,_pdu.seq,SMS_text,_pdu.textLen,_clock->millis()))
+        {
+            if (SMS_text!=NULL && textSize) SMS_text[0]=0;
+            return GETSMS_PART_SMS;
+        }
+        _smsCache.take(phone_number,_pdu.ref,SMS_text,textSize,&_sms.truncated);
+    }
+    return ret_val;
+}
+
+/*
+ * Send a text of any length. Up to 160 characters it is one text mode
+ * message, longer texts are split into concatenated PDU parts that are
+ * written to the modem as they are encoded, back to back.
+ */
+bool Sim800C::sendLongSms(const char *number,const char *text)
+{
+    uint8_t septets,total=0,seq;
+    const char *p,*end;
+    bool ret=OK;
+
+    if (pduSeptets(text)<=SMS_SINGLE_SEPTETS) return sendSms((char*)number,(char*)text);
+
+    for (p=text; *p; p=end)
+    {
+        end=pduSegment(p,SMS_SEGMENT_SEPTETS,&septets);
+        total++;
+    }
+    if (_send(AT_CMGF,0)!=OK) return ERROR;
+
+    _smsRef++;
+    for (seq=1,p=text; *p && ret==OK; seq++,p=end)
+    {
+        end=pduSegment(p,SMS_SEGMENT_SEPTETS,&septets);
+        if (_send(AT_CMGS_PDU,pduSubmitLength(number,septets,true))!=OK)
+        {
+            ret=ERROR;
+            break;
+        }
+        _timing.bytesSent+=pduWriteSubmit(*_serial,number,p,end,_smsRef,total,seq);
+        _timing.bytesSent+=_serial->print((char)ctrlz);
+        if (_waitReply(RESPON_OK,60000)!=CMD_OK) ret=ERROR;
+    }
+
+    _send(AT_CMGF,1);
+    return ret;
+}
+#endif
+
+/*
+ * Outbound SMS queue. Messages are sent one after the other from poll():
+ * AT+CMGS with the number, the text after the '>' prompt, then the +CMGS
+ * result. A failed message is retried after SMS_RETRY_DELAY, doubled on
+ * every further try, up to SMS_RETRIES tries.
+ */
+bool Sim800C::enqueueSms(const char *number,const char *text,sms_sent_callback aCallback)
+{
+    sms_outgoing *m;
+    if (_outboxCount>=SMS_OUTBOX_SIZE || pduSeptets(text)>SMS_SINGLE_SEPTETS) return false;
+    m=&_outbox[(_outboxHead+_outboxCount)%SMS_OUTBOX_SIZE];
+    m->number=number;
+    m->text=text;
+    m->callback=aCallback;
+    m->tries=0;
+    m->notBefore=_clock->millis();
+    _outboxCount++;
+    return true;
+}
+
+uint8_t Sim800C::outboxPending()
+{
+    return _outboxCount;
+}
+
+const sms_outbox_stats &Sim800C::outboxStats()
+{
+    // close the minute window even when nothing was sent since
+    _outboxRate(0);
+    return _outboxStats;
+}
+
+void Sim800C::_outboxRate(uint8_t sent)
+{
+    uint32_t now=_clock->millis();
+    if (now-_outboxStats.windowStart>=60000)
+    {
+        _outboxStats.perMinute=(now-_outboxStats.windowStart<120000) ? _outboxStats.windowCount : 0;
+        _outboxStats.windowStart=now;
+        _outboxStats.windowCount=0;
+    }
+    _outboxStats.windowCount+=sent;
+}
+
+// Start the next message when the line is free and its retry time has come.
+void Sim800C::_outboxStep()
+{
+    sms_outgoing *m;
+
+    if (_outboxBusy || _outboxCount==0) return;
+    m=&_outbox[_outboxHead];
+    if ((int32_t)(_clock->millis()-m->notBefore)<0) return;
+
+    // the queue is empty here, only a number too long for the command fails
+    if (m->tries>0) _retryNext();
+    if (_post(AT_CMGS,&Sim800C::_outboxPrompt,m->number)) _outboxBusy=true;
+    else _outboxDone(ERROR);
+}
+
+void Sim800C::_outboxPrompt(Sim800C &gsm,uint8_t result)
+{
+    sms_outgoing *m=&gsm._outbox[gsm._outboxHead];
+    at_command *c;
+
+    if (result!=CMD_OK)
+    {
+        gsm._serial->write((uint8_t)0x1B);		// ESC leaves a prompt that came too late
+        gsm._outboxFailed();
+        return;
+    }
+    gsm._timing.bytesSent+=gsm._serial->print(m->text);
+    gsm._timing.bytesSent+=gsm._serial->print((char)ctrlz);
+
+    c=gsm._enqueue(RESPON_OK,60000,&Sim800C::_outboxResult,true);
+    if (c==NULL)
+    {
+        gsm._outboxFailed();
+        return;
+    }
+    c->cmd=NULL;
+}
+
+void Sim800C::_outboxResult(Sim800C &gsm,uint8_t result)
+{
+    if (result==CMD_OK) gsm._outboxDone(OK);
+    else                gsm._outboxFailed();
+}
+
+void Sim800C::_outboxFailed()
+{
+    sms_outgoing *m=&_outbox[_outboxHead];
+    _outboxBusy=false;
+    m->tries++;
+    if (m->tries>=SMS_RETRIES)
+    {
+        _outboxDone(ERROR);
+        return;
+    }
+    _outboxStats.retries++;
+    m->notBefore=_clock->millis()+((uint32_t)SMS_RETRY_DELAY<<(m->tries-1));
+}
+
+void Sim800C::_outboxDone(uint8_t result)
+{
+    sms_outgoing m=_outbox[_outboxHead];
+    const char *line;
+    uint8_t reference=0;
+
+    _outboxBusy=false;
+    _outboxHead=(_outboxHead+1)%SMS_OUTBOX_SIZE;
+    _outboxCount--;
+
+    if (result==OK)
+    {
+        _outboxStats.sent++;
+        _outboxRate(1);
+        line=_responseLine("+CMGS:");
+        if (line!=NULL) reference=atoi(line+6);
+    }
+    else _outboxStats.failed++;
+
+    if (m.callback!=NULL) m.callback(*this,m.number,m.text,result,reference);
+}
+
+/*
+ * Delete several messages with as few round trips as possible: the AT+CMGD
+ * commands are chained on one command line, AT+CMGD=1;+CMGD=4;+CMGD=7
+ */
+bool Sim800C::deleteSms(const uint8_t *indices,uint8_t count)
+{
+    char line[SMS_DELETE_LINE];
+    uint8_t len=0,i;
+    bool ret=OK;
+
+    for (i=0; i<count; i++)
+    {
+        if (len==0) len=sprintf(line,"AT+CMGD=%u",indices[i]);
+        else        len+=sprintf(line+len,";+CMGD=%u",indices[i]);
+
+        if (i+1==count || len+sizeof(";+CMGD=255\r\n")>sizeof(line))
+        {
+            strcpy(line+len,"\r\n");
+            if (send_cmd_wait_reply(line,RESPON_OK,25000)!=OK) ret=ERROR;
+            len=0;
+        }
+    }
+    return ret;
+}
+
+/*
+ * URC prefix table, matched against the start of every framed line. Order
+ * matters where one prefix is the start of another. The URC_FIFO_ROWS rows
+ * that check_receive_command() reports come first.
+ */
+static const char urcCmti[] PROGMEM      = "+CMTI:";		//+CMTI: "SM",i        i=INDEX
+static const char urcClip[] PROGMEM      = "+CLIP:";		//+CLIP: "+983152401442",145,"",,"",0
+static const char urcCusd[] PROGMEM      = "+CUSD:";
+static const char urcNoCarrier[] PROGMEM = "NO CARRIER";
+static const char urcNoDial[] PROGMEM    = "NO DIALTONE";
+static const char urcNoAnswer[] PROGMEM  = "NO ANSWER";
+static const char urcBusy[] PROGMEM      = "BUSY";
+static const char urcMoRing[] PROGMEM    = "MO RING";
+static const char urcMoConn[] PROGMEM    = "MO CONNECTED";
+static const char urcRing[] PROGMEM      = "RING";
+static const char urcRdy[] PROGMEM       = "RDY";
+static const char urcCallReady[] PROGMEM = "Call Ready";
+static const char urcSmsReady[] PROGMEM  = "SMS Ready";
+static const char urcClcc[] PROGMEM      = "+CLCC:";		//+CLCC: 1,0,3,0,0,"09132383246",129,""
+static const char urcCreg[] PROGMEM      = "+CREG:";		//+CREG: 1,"1A2B","3C4D"
+static const char urcReceive[] PROGMEM   = "+RECEIVE,";	//+RECEIVE,0,5:
+static const char urcIpd[] PROGMEM       = "+IPD,";		//+IPD,0,5:hello
+static const char urcPdpDeact[] PROGMEM  = "+PDP: DEACT";
+static const char urcHttpAction[] PROGMEM = "+HTTPACTION:";
+static const char urcCmt[] PROGMEM       = "+CMT:";		//+CMT: "+989132383246","","19/01/17,10:06:21+14",145,4,0,0,"+989350001500",145,5
+
+struct urc_entry
+{
+    const char *prefix;
+    uint8_t type;
+};
+
+static const urc_entry urcTable[URC_TABLE_SIZE] PROGMEM =
+{
+    { urcCmti,      Sms_received },
+    { urcClip,      Calling_with_number },
+    { urcCusd,      CUSD },
+    { urcNoCarrier, NO_CARRIER },
+    { urcNoDial,    NO_DIALTONE },
+    { urcNoAnswer,  NO_ANSWER },
+    { urcBusy,      BUSY },
+    { urcMoRing,    MO_RING },
+    { urcMoConn,    MO_CONNECTED },
+    { urcRing,      RING },
+    { urcRdy,       MODEM_READY },
+    { urcCallReady, CALL_READY },
+    { urcSmsReady,  SMS_READY },
+    { urcClcc,      CALL_LIST },
+    { urcCreg,      NETWORK_REG },
+    { urcCmt,       SMS_DIRECT },
+    { urcReceive,   SOCKET_DATA },
+    { urcIpd,       SOCKET_DATA },
+    { urcPdpDeact,  GPRS_DEACT },
+    { urcHttpAction, HTTP_DONE }
+};
+
+static uint8_t urcRow(uint8_t type)
+{
+    uint8_t row;
+    for (row=0; row<URC_TABLE_SIZE; row++)
+    {
+        if (pgm_read_byte(&urcTable[row].type)==type) break;
+    }
+    return row;
+}
+
+// Every row of the type, SOCKET_DATA has two prefixes.
+bool Sim800C::onUrc(uint8_t type,urc_callback aCallback)
+{
+    bool found=false;
+    for (uint8_t row=0; row<URC_TABLE_SIZE; row++)
+    {
+        if (pgm_read_byte(&urcTable[row].type)!=type) continue;
+        _urcHandlers[row]=aCallback;
+        found=true;
+    }
+    return found;
+}
+
+/*
+ * Route the line in _rxLine if it is a URC: parse its fields in place, hand
+ * it to the registered handler or queue it for check_receive_command().
+ * Returns false for anything else, which then belongs to the running command.
+ */
+bool Sim800C::_dispatchUrc()
+{
+    uint8_t row;
+    const char *prefix;
+    char *start,*end;
+    urc_event event;
+
+    if (_rxSplit) return false;
+#ifdef SIM800C_SOCKETS
+    if (_socketLine()) return true;
+#endif
+    for (row=0; row<URC_TABLE_SIZE; row++)
+    {
+        prefix=(const char *)pgm_read_ptr(&urcTable[row].prefix);
+        if (_rxLine[0]==(char)pgm_read_byte(prefix) && strncmp_P(_rxLine,prefix,strlen_P(prefix))==0) break;
+    }
+    if (row>=URC_TABLE_SIZE) return false;
+
+    event.type=pgm_read_byte(&urcTable[row].type);
+    event.index=0;
+    event.text=_rxLine;
+    event.authorized=false;
+
+    switch (event.type)
+    {
+    case MODEM_READY:
+        _boot.modemReady=_clock->millis()-_bootStart;
+        break;
+
+    case CALL_READY:
+        _boot.callReady=_clock->millis()-_bootStart;
+        break;
+
+    case SMS_READY:
+        _boot.smsReady=_clock->millis()-_bootStart;
+        break;
+
+    case Sms_received:
+        if (_smsWatch) _post(AT_CPMS_QUERY,&Sim800C::_smsStorageChecked);
+        break;
+
+    case CALL_LIST:
+        // +CLCC: <id>,<dir>,<stat>,... of our own (dir 0) call: 3 alerting, 0 active, 6 disconnected
+        start=strchr(_rxLine,',');
+        if (start!=NULL && start[1]=='0' && start[2]==',' && _call.state!=CALL_IDLE)
+        {
+            switch (atoi(start+3))
+            {
+            case 3: _callEvent(MO_RING);      break;
+            case 0: _callEvent(MO_CONNECTED); break;
+            case 6: _callEvent(NO_CARRIER);   break;
+            }
+        }
+        break;
+
+    case NETWORK_REG:
+        _netCreg();
+        break;
+
+    case SMS_DIRECT:
+        _cmtHeader();
+        break;
+
+#ifdef SIM800C_SOCKETS
+    case SOCKET_DATA:
+        _socketData();
+        break;
+
+    case GPRS_DEACT:
+        _socketsClosed();
+        break;
+#endif
+
+#ifdef SIM800C_HTTP
+    case HTTP_DONE:
+        if (_http.step==HTTP_WAIT) _httpAction();
+        break;
+#endif
+
+    case MO_RING:
+    case MO_CONNECTED:
+    case NO_ANSWER:
+    case BUSY:
+    case NO_CARRIER:
+    case NO_DIALTONE:
+        if (_call.state!=CALL_IDLE) _callEvent(event.type);
+        break;
+    }
+
+    // boot notices, call lists, registration reports, direct messages and socket data or HTTP reports only reach a registered handler, never the legacy FIFO
+    if (event.type>=MODEM_READY && _urcHandlers[row]==NULL) return true;
+
+    switch (event.type)
+    {
+    case Sms_received:
+        start=strchr(_rxLine,',');
+        if (start!=NULL) event.index=atoi(start+1);
+        if (event.index==0) return true;
+        break;
+
+    case Calling_with_number:
+        start=strchr(_rxLine,'"');
+        if (start!=NULL && strlen(start)>=4)
+        {
+            start+=4;
+            end=strchr(start,'"');
+            if (end!=NULL) *end=0;
+            event.text=start;
+        }
+#ifdef SIM800C_WHITELIST_MIRROR
+        event.authorized=isAuthorized(event.text);
+#endif
+        break;
+
+    case CUSD:
+        start=strchr(_rxLine,'"');
+        if (start!=NULL)
+        {
+            start++;
+            end=strrchr(start,'"');
+            if (end!=NULL) *end=0;
+            event.text=start;
+        }
+        break;
+    }
+
+    if (_urcHandlers[row]==NULL)  _queueUrc(event.type,event.index,event.text);
+    else if (_waitDepth>0)        _queueUrc(event.type,event.index,event.text,true);
+    else                          _urcHandlers[row](*this,event);
+    return true;
+}
+
+/*
+ * Append an event. When the queue is full an unrecognised line is dropped,
+ * and an event takes the place of the newest unrecognised line queued; with
+ * none the oldest events are kept and _urcDropped counts the lost one.
+ */
+void Sim800C::_queueUrc(uint8_t type,uint8_t index,const char *text,bool aHandler)
+{
+    urc_pending *e;
+    size_t len;
+    uint8_t i;
+
+    if (_urcCount>=URC_QUEUE_SIZE)
+    {
+        if (type==NOT_Recog_Data) return;
+        for (i=_urcCount; i>0; i--)
+        {
+            if (_urcQueue[(_urcHead+i-1)%URC_QUEUE_SIZE].type==NOT_Recog_Data) break;
+        }
+        if (i==0)
+        {
+            _urcDropped++;
+            return;
+        }
+        for (; i<_urcCount; i++) _urcQueue[(_urcHead+i-1)%URC_QUEUE_SIZE]=_urcQueue[(_urcHead+i)%URC_QUEUE_SIZE];
+        _urcCount--;
+    }
+    e=&_urcQueue[(_urcHead+_urcCount)%URC_QUEUE_SIZE];
+    e->type=type;
+    e->index=index;
+    e->handler=aHandler;
+    len=strlen(text);
+    copyField(e->text,URC_TEXT_SIZE,text,len<URC_TEXT_SIZE ? len : URC_TEXT_SIZE-1);
+    _urcCount++;
+}
+
+uint16_t Sim800C::urcDropped()
+{
+    return _urcDropped;
+}
+
+// Hand the events held back during a blocking call to their handlers, in order.
+void Sim800C::_deferredUrcs()
+{
+    urc_pending e;
+    urc_event event;
+    uint8_t row;
+
+    while (_urcCount && _urcQueue[_urcHead].handler)
+    {
+        e=_urcQueue[_urcHead];
+        _urcHead=(_urcHead+1)%URC_QUEUE_SIZE;
+        _urcCount--;
+        event.type=e.type;
+        event.index=e.index;
+        event.text=e.text;
+#ifdef SIM800C_WHITELIST_MIRROR
+        event.authorized=e.type==Calling_with_number && isAuthorized(e.text);
+#else
+        event.authorized=false;
+#endif
+        row=urcRow(e.type);
+        if (row<URC_TABLE_SIZE && _urcHandlers[row]!=NULL) _urcHandlers[row](*this,event);
+    }
+}
+
+/*
+ * Polling interface to the URC dispatcher: return the oldest event that no
+ * handler took, one per call. The caller number of Calling_with_number and
+ * the text of CUSD are copied into SimBuffer, the index of Sms_received into
+ * sms_index. Events wait while a command is running so its reply is kept.
+ */
+uint8_t Sim800C::check_receive_command(void)
+{
+    urc_pending *e;
+    poll();
+    if (_cmdCount || _urcCount==0 || _urcQueue[_urcHead].handler) return No_data;
+
+    e=&_urcQueue[_urcHead];
+    _urcHead=(_urcHead+1)%URC_QUEUE_SIZE;
+    _urcCount--;
+
+    if (e->type==Sms_received) sms_index=e->index;
+    _arenaClear();
+    strcpy(SimBuffer,e->text);
+    return e->type;
+}
+
+/*
+ * Blocking form of ringAndDrop(): OK once the callee phone rang, ERROR after
+ * NumOfTry attempts without ringing.
+ */
+bool Sim800C::miss_call(String aSenderNumber,uint8_t NumOfTry) //NumOfTry 1-255
+{
+    if (!ringAndDrop(aSenderNumber.c_str(),NumOfTry)) return ERROR;
+    while (_call.state!=CALL_IDLE)
+    {
+        poll();
+        if (_pool!=NULL) _pool->_pollOthers(this);
+        if (_call.state!=CALL_IDLE) _clock->idle(IDLE_TICK);
+    }
+    return (_call.result==MO_RING || _call.result==NO_ANSWER || _call.result==MO_CONNECTED) ? OK : ERROR;
+}
+
+bool Sim800C::ringAndDrop(const char *number,uint8_t tries,uint16_t ringTime,call_callback aCallback)
+{
+    if (_call.state!=CALL_IDLE || tries==0 || strlen(number)>=CALL_NUMBER_SIZE) return false;
+    strcpy(_call.number,number);
+    _call.tries=tries;
+    _call.ringTime=ringTime;
+    _call.callback=aCallback;
+    _call.result=ERROR;
+    _call.since=_clock->millis();
+    _call.sent=false;
+    _call.retry=false;
+    _call.state=CALL_DIALING;
+    return true;
+}
+
+uint8_t Sim800C::callState()
+{
+    return _call.state;
+}
+
+void Sim800C::cancelCall()
+{
+    if (_call.state==CALL_IDLE) return;
+    _call.tries=1;
+    if (_call.state!=CALL_RELEASING) _callRelease(_call.result);
+}
+
+/*
+ * Timers and queued commands of the call, from poll(). The URCs and the +CLCC
+ * reports move it between the states through _callEvent().
+ *   DIALING    ATD once since has come, ERROR after CALL_DIAL_TIMEOUT
+ *   ALERTING   dropped after the ring time
+ *   CONNECTED  dropped at once
+ *   RELEASING  ATH, then the next try or the callback
+ */
+void Sim800C::_callStep()
+{
+    uint32_t now=_clock->millis();
+
+    switch (_call.state)
+    {
+    case CALL_DIALING:
+        if ((int32_t)(now-_call.since)<0) return;
+        if (!_call.sent)
+        {
+            if (_call.retry) _retryNext();
+            if (_post(AT_DIAL,&Sim800C::_callDialed,_call.number))
+            {
+                _call.sent=true;
+                _call.since=now;
+            }
+        }
+        else if (now-_call.since>=CALL_DIAL_TIMEOUT) _callRelease(ERROR);
+        break;
+
+    case CALL_ALERTING:
+        if (now-_call.since>=_call.ringTime) _callRelease(MO_RING);
+        break;
+
+    case CALL_CONNECTED:
+        _callRelease(MO_CONNECTED);
+        break;
+
+    case CALL_RELEASING:
+        if (!_call.sent && _post(AT_HANGUP,&Sim800C::_callReleased)) _call.sent=true;
+        break;
+    }
+}
+
+void Sim800C::_callEvent(uint8_t type)
+{
+    switch (type)
+    {
+    case MO_RING:
+        if (_call.state!=CALL_DIALING) return;
+        _call.state=CALL_ALERTING;
+        _call.since=_clock->millis();
+        break;
+
+    case MO_CONNECTED:
+        if (_call.state==CALL_DIALING || _call.state==CALL_ALERTING) _call.state=CALL_CONNECTED;
+        break;
+
+    case NO_ANSWER:
+    case BUSY:
+    case NO_CARRIER:
+    case NO_DIALTONE:
+        if (_call.state==CALL_DIALING || _call.state==CALL_ALERTING)
+        {
+            // a call that rang and then ended still reached the callee
+            _callRelease(_call.state==CALL_ALERTING ? (uint8_t)NO_ANSWER : type);
+        }
+        break;
+    }
+}
+
+void Sim800C::_callRelease(uint8_t result)
+{
+    _call.result=result;
+    _call.state=CALL_RELEASING;
+    _call.sent=false;
+}
+
+void Sim800C::_callDialed(Sim800C &gsm,uint8_t result)
+{
+    if (result!=CMD_OK && gsm._call.state==CALL_DIALING) gsm._callRelease(ERROR);
+}
+
+void Sim800C::_callReleased(Sim800C &gsm,uint8_t /*result*/)
+{
+    call_control *call=&gsm._call;
+    bool rang=call->result==MO_RING || call->result==NO_ANSWER || call->result==MO_CONNECTED;
+
+    if (!rang && --call->tries>0)
+    {
+        call->state=CALL_DIALING;
+        call->sent=false;
+        call->retry=true;
+        call->since=gsm._clock->millis()+CALL_RETRY_DELAY;
+        return;
+    }
+    call->state=CALL_IDLE;
+    if (call->callback!=NULL) call->callback(gsm,call->number,call->result);
+}
+
+static int twoDigits(const char *p)
+{
+    return (p[0]-'0')*10+(p[1]-'0');
+}
+
+void Sim800C::RTCtime(int *day,int *month, int *year,int *hour,int *minute, int *second)
+{
+    const char *line;
+    // if respond with ERROR try one more time, a timeout would only repeat
+    if (_send(AT_CCLK)!=OK && _result.type!=RESULT_TIMEOUT)
+    {
+        _send(AT_CCLK);
+    }
+    line=_responseLine("+CCLK:");
+    if (_lastResult==CMD_OK && line!=NULL && (line=strchr(line,'"'))!=NULL && strlen(line)>=18)
+    {
+        line++;     //yy/MM/dd,hh:mm:ss+zz
+        *year=twoDigits(line);
+        *month=twoDigits(line+3);
+        *day=twoDigits(line+6);
+        *hour=twoDigits(line+9);
+        *minute=twoDigits(line+12);
+        *second=twoDigits(line+15);
+    }
+}
+
+//Get the time  of the base of GSM
+String Sim800C::dateNet()
+{
+    const char *line;
+    if (_send(AT_GSMLOC)==OK)
+    {
+        line=_responseLine("+CIPGSMLOC:");
+        if (line!=NULL) return String(line+12);
+    }
+    return "0";
+}
+
+#ifdef SIM800C_SOCKETS
+/*
+ * GPRS bring-up for AT+CIPMUX=1: the APN, the context, then AT+CIFSR, which
+ * the modem requires before the first AT+CIPSTART.
+ */
+bool Sim800C::gprsAttach(const char *apn,const char *user,const char *password)
+{
+    char cmd[SOCKET_CMD_SIZE];
+    const char *ip;
+    at_command *c;
+
+    _send(AT_CIPSHUT);
+    if (_send(AT_CIPMUX)!=OK) return false;
+    c=_prepare(AT_CSTT,cmd,sizeof(cmd),apn,user,password);
+    if (c==NULL || _waitCommand(c)!=CMD_OK) return false;
+    if (_send(AT_CIICR)!=OK || _send(AT_CIFSR)!=OK) return false;
+    ip=_firstLine();
+    return ip!=NULL && strchr(ip,'.')!=NULL;
+}
+
+bool Sim800C::gprsDetach()
+{
+    _socketsClosed();
+    return _send(AT_CIPSHUT)==OK;
+}
+
+// The first free connection, -1 when none is free or the connection failed.
+int8_t Sim800C::socketOpen(const char *host,uint16_t port,bool udp)
+{
+    char cmd[SOCKET_CMD_SIZE];
+    at_command *c;
+    uint8_t n;
+
+    for (n=0; n<SOCKET_COUNT && _sockets[n].state!=SOCKET_CLOSED; n++);
+    if (n>=SOCKET_COUNT) return -1;
+
+    _sockets[n].rx.clear();
+    _sockets[n].dropped=0;
+    _sockets[n].state=SOCKET_CONNECTING;
+    c=_prepare(AT_CIPSTART,cmd,sizeof(cmd),n,udp ? "UDP" : "TCP",host,port);
+    if (c==NULL || _waitCommand(c)!=CMD_OK || !_socketWait(n,SOCKET_CONNECTING))
+    {
+        _sockets[n].state=SOCKET_CLOSED;
+        return -1;
+    }
+    return _sockets[n].state==SOCKET_CONNECTED ? (int8_t)n : -1;
+}
+
+bool Sim800C::socketConnected(uint8_t n)
+{
+    poll();
+    return n<SOCKET_COUNT && _sockets[n].state==SOCKET_CONNECTED;
+}
+
+/*
+ * The data goes from the caller's buffer to the modem in SOCKET_CHUNK pieces,
+ * each one AT+CIPSEND, the '>' prompt, the bytes and the SEND OK.
+ */
+bool Sim800C::socketSend(uint8_t n,const uint8_t *data,uint16_t len)
+{
+    socket_state *s;
+    uint16_t chunk;
+
+    if (n>=SOCKET_COUNT || _sockets[n].state!=SOCKET_CONNECTED) return false;
+    s=&_sockets[n];
+    while (len)
+    {
+        chunk=len<SOCKET_CHUNK ? len : SOCKET_CHUNK;
+        if (_send(AT_CIPSEND,n,chunk)!=OK) return false;
+        s->sending=true;
+        s->sendOk=false;
+        _timing.bytesSent+=_serial->write(data,chunk);
+        if (!_socketWait(n,SOCKET_CONNECTED) || !s->sendOk) return false;
+        data+=chunk;
+        len-=chunk;
+    }
+    return true;
+}
+
+uint16_t Sim800C::socketAvailable(uint8_t n)
+{
+    poll();
+    if (n>=SOCKET_COUNT) return 0;
+    return _sockets[n].rx.available();
+}
+
+uint16_t Sim800C::socketRead(uint8_t n,uint8_t *data,uint16_t size)
+{
+    uint16_t len=0;
+
+    poll();
+    if (n>=SOCKET_COUNT) return 0;
+    while (len<size && _sockets[n].rx.available()) data[len++]=_sockets[n].rx.get();
+    return len;
+}
+
+bool Sim800C::socketClose(uint8_t n)
+{
+    const char *line;
+
+    if (n>=SOCKET_COUNT) return false;
+    if (_sockets[n].state==SOCKET_CLOSED) return true;
+    // the connection stays open until the modem confirms, a retry sends AT+CIPCLOSE again
+    if (_send(AT_CIPCLOSE,n)!=OK) return false;
+    line=_firstLine();
+    if (line==NULL || strstr(line,"CLOSE OK")==NULL) return false;
+    _sockets[n].state=SOCKET_CLOSED;
+    return true;
+}
+
+// Poll until the connection leaves state (CONNECTING) or its send ends (CONNECTED).
+bool Sim800C::_socketWait(uint8_t n,uint8_t state)
+{
+    socket_state *s=&_sockets[n];
+    uint32_t start=_clock->millis();
+
+    while (s->state==state && (state!=SOCKET_CONNECTED || s->sending))
+    {
+        if (_clock->millis()-start>=SOCKET_TIMEOUT) return false;
+        _clock->idle(IDLE_TICK);
+        poll();
+        if (_pool!=NULL) _pool->_pollOthers(this);
+    }
+    return true;
+}
+
+/*
+ * "<n>, CONNECT OK", "<n>, CONNECT FAIL", "<n>, ALREADY CONNECT",
+ * "<n>, SEND OK", "<n>, SEND FAIL", "<n>, CLOSED" and "<n>, CLOSE OK".
+ * CLOSE OK is left to AT+CIPCLOSE, which ends with that line.
+ */
+bool Sim800C::_socketLine()
+{
+    socket_state *s;
+    const char *text;
+    uint8_t n;
+
+    if (_rxLine[0]<'0' || _rxLine[0]>'5' || _rxLine[1]!=',' || _rxLine[2]!=' ') return false;
+    n=_rxLine[0]-'0';
+    text=_rxLine+3;
+    if (strcmp(text,"CLOSE OK")==0) return false;
+    if (n>=SOCKET_COUNT) return true;
+
+    s=&_sockets[n];
+    if (strcmp(text,"CONNECT OK")==0 || strcmp(text,"ALREADY CONNECT")==0) s->state=SOCKET_CONNECTED;
+    else if (strcmp(text,"SEND OK")==0)
+    {
+        s->sending=false;
+        s->sendOk=true;
+    }
+    else if (strcmp(text,"SEND FAIL")==0) s->sending=false;
+    else if (strcmp(text,"CONNECT FAIL")==0 || strcmp(text,"CLOSED")==0)
+    {
+        s->state=SOCKET_CLOSED;
+        s->sending=false;
+    }
+    else return false;
+    return true;
+}
+
+/*
+ * +RECEIVE,<n>,<length>:	the data follows the line
+ * +IPD,<n>,<length>:		the data follows the colon, AT+CIPHEAD=1
+ * +IPD,<length>:			the same on a single connection, taken as connection 0
+ * The data is streamed into the ring of the connection, or taken out of the
+ * stream and dropped for a connection the library does not keep.
+ */
+void Sim800C::_socketData()
+{
+    const char *p=_rxLine[1]=='I' ? _rxLine+5 : _rxLine+9;
+    const char *comma=strchr(p,',');
+    uint8_t n=0;
+
+    if (comma!=NULL)
+    {
+        n=atoi(p);
+        p=comma+1;
+    }
+    else if (_rxLine[1]!='I') return;
+    _rxRaw=atoi(p);
+    if (_rxRaw==0) return;
+    if (n<SOCKET_COUNT) _rxSock=n+1;
+    else                _rxDrop=true;
+}
+
+void Sim800C::_socketsClosed()
+{
+    uint8_t n;
+    for (n=0; n<SOCKET_COUNT; n++)
+    {
+        _sockets[n].state=SOCKET_CLOSED;
+        _sockets[n].sending=false;
+    }
+}
+#endif
+
+#ifdef SIM800C_HTTP
+// Bearer profile 1 of AT+HTTP*, true when it is open, also when it already was.
+bool Sim800C::httpBearer(const char *apn)
+{
+    if (_send(AT_SAPBR_GPRS)!=OK || _send(AT_SAPBR_APN,apn)!=OK) return false;
+    if (_send(AT_SAPBR_OPEN)==OK) return true;
+    return _send(AT_SAPBR_QUERY)==OK && _responseLine("+SAPBR: 1,1")!=NULL;
+}
+
+bool Sim800C::httpGet(const char *url,http_body_callback aBody,http_done_callback aDone,bool conditional)
+{
+    if (!_httpStart(url,aBody,aDone)) return false;
+    _http.conditional=conditional;
+    return true;
+}
+
+bool Sim800C::httpPost(const char *url,const char *contentType,const uint8_t *data,uint16_t len,http_body_callback aBody,http_done_callback aDone)
+{
+    if (!_httpStart(url,aBody,aDone)) return false;
+    _http.post=true;
+    _http.contentType=contentType;
+    _http.data=data;
+    _http.dataLen=len;
+    return true;
+}
+
+bool Sim800C::httpBusy()
+{
+    return _http.step!=HTTP_IDLE;
+}
+
+// The next conditional GET downloads the resource whatever it holds.
+void Sim800C::httpForget()
+{
+    _http.etag[0]=0;
+    _http.modified[0]=0;
+}
+
+bool Sim800C::_httpStart(const char *url,http_body_callback aBody,http_done_callback aDone)
+{
+    if (_http.step!=HTTP_IDLE) return false;
+    _http.url=url;
+    _http.body=aBody;
+    _http.done=aDone;
+    _http.post=false;
+    _http.conditional=false;
+    _http.status=0;
+    _http.length=0;
+    _http.offset=0;
+    if (!_post(AT_HTTPINIT,&Sim800C::_httpNext)) return false;
+    _http.step=HTTP_INIT;
+    return true;
+}
+
+/*
+ * Each step of the request is one queued command, _httpNext() queues the one
+ * after it when it finished. Only the wait for +HTTPACTION is timed here.
+ */
+void Sim800C::_httpStep()
+{
+    if (_http.step==HTTP_WAIT && _clock->millis()-_http.since>=HTTP_TIMEOUT) _httpFail();
+}
+
+void Sim800C::_httpNext(Sim800C &gsm,uint8_t result)
+{
+    http_control *h=&gsm._http;
+    at_command *c=NULL;
+
+    // an open session refuses AT+HTTPINIT and is used as is, a failed AT+HTTPTERM changes nothing
+    if (result!=CMD_OK && h->step!=HTTP_INIT && h->step!=HTTP_TERM && h->step!=HTTP_HEAD)
+    {
+        gsm._httpFail();
+        return;
+    }
+    switch (h->step)
+    {
+    case HTTP_INIT:
+        h->step=HTTP_CID;
+        c=gsm._prepare(AT_HTTPCID);
+        break;
+
+    case HTTP_CID:
+        h->step=HTTP_URL;
+        c=gsm._prepare(AT_HTTPURL,h->cmd,sizeof(h->cmd),h->url);
+        break;
+
+    case HTTP_URL:
+        h->step=HTTP_HEADER;
+        if (h->conditional && h->etag[0])          c=gsm._prepare(AT_HTTPNONEMATCH,h->cmd,sizeof(h->cmd),at_quoted{h->etag});
+        else if (h->conditional && h->modified[0]) c=gsm._prepare(AT_HTTPMODIFIED,h->cmd,sizeof(h->cmd),at_quoted{h->modified});
+        else                                       c=gsm._prepare(AT_HTTPNOUSERDATA);
+        break;
+
+    case HTTP_HEADER:
+        if (!h->post)
+        {
+            h->step=HTTP_ACTION;
+            c=gsm._prepare(AT_HTTPACTION,h->cmd,sizeof(h->cmd),0);
+            break;
+        }
+        h->step=HTTP_CONTENT;
+        c=gsm._prepare(AT_HTTPCONTENT,h->cmd,sizeof(h->cmd),h->contentType);
+        break;
+
+    case HTTP_CONTENT:
+        h->step=HTTP_DATA;
+        c=gsm._prepare(AT_HTTPDATA,h->cmd,sizeof(h->cmd),h->dataLen);
+        if (c!=NULL) c->callback=&Sim800C::_httpDownload;
+        break;
+
+    case HTTP_DATA:
+        h->step=HTTP_ACTION;
+        c=gsm._prepare(AT_HTTPACTION,h->cmd,sizeof(h->cmd),1);
+        break;
+
+    case HTTP_ACTION:
+        h->step=HTTP_WAIT;
+        h->since=gsm._clock->millis();
+        return;
+
+    case HTTP_HEAD:
+    case HTTP_READ:
+        if (h->step==HTTP_READ)
+        {
+            if (h->fill && h->body!=NULL) h->body(gsm,h->window,h->fill,h->offset);
+            h->offset+=h->fill;
+            // a window shorter than asked for means the modem has no more
+            if (h->fill<HTTP_WINDOW && h->offset<h->length) h->length=h->offset;
+        }
+        if (h->offset>=h->length || h->body==NULL)
+        {
+            h->step=HTTP_TERM;
+            c=gsm._prepare(AT_HTTPTERM);
+            break;
+        }
+        h->step=HTTP_READ;
+        h->fill=0;
+        c=gsm._prepare(AT_HTTPREAD,h->cmd,sizeof(h->cmd),h->offset,(uint32_t)HTTP_WINDOW);
+        if (c!=NULL) c->handler=&Sim800C::_httpReadLine;
+        break;
+
+    case HTTP_TERM:
+        h->step=HTTP_IDLE;
+        if (h->done!=NULL) h->done(gsm,h->status,h->length);
+        return;
+    }
+    if (c==NULL) gsm._httpFail();
+    else if (c->callback==NULL) c->callback=&Sim800C::_httpNext;
+}
+
+// The DOWNLOAD prompt: the body goes from the caller's buffer, then the OK is awaited.
+void Sim800C::_httpDownload(Sim800C &gsm,uint8_t result)
+{
+    at_command *c;
+
+    if (result!=CMD_OK)
+    {
+        gsm._httpFail();
+        return;
+    }
+    gsm._timing.bytesSent+=gsm._serial->write(gsm._http.data,gsm._http.dataLen);
+    c=gsm._enqueue(RESPON_OK,15000,&Sim800C::_httpNext,true);
+    if (c==NULL)
+    {
+        gsm._httpFail();
+        return;
+    }
+    c->cmd=NULL;
+}
+
+// +HTTPACTION: <method>,<status>,<length>
+void Sim800C::_httpAction()
+{
+    const char *field=strchr(_rxLine,',');
+    at_command *c;
+
+    if (field==NULL) return;
+    _http.status=atoi(field+1);
+    field=strchr(field+1,',');
+    _http.length=field!=NULL ? strtoul(field+1,NULL,10) : 0;
+    if (_http.status==304) _http.length=0;
+
+    _http.step=HTTP_HEAD;
+    if (_http.conditional && _http.status>=200 && _http.status<300)
+    {
+        _http.etag[0]=0;
+        _http.modified[0]=0;
+        c=_prepare(AT_HTTPHEAD,&Sim800C::_httpNext);
+        if (c==NULL) _httpFail();
+        else         c->handler=&Sim800C::_httpHeadLine;
+        return;
+    }
+    // straight to the body, or to AT+HTTPTERM when there is none
+    _httpNext(*this,CMD_OK);
+}
+
+// Validators out of the response header lines of AT+HTTPHEAD.
+void Sim800C::_httpHeadLine()
+{
+    char *target=NULL;
+    const char *value;
+
+    if (_rxSplit) return;
+    if (strncasecmp(_rxLine,"ETag:",5)==0)               target=_http.etag;
+    else if (strncasecmp(_rxLine,"Last-Modified:",14)==0) target=_http.modified;
+    if (target==NULL) return;
+    value=strchr(_rxLine,':')+1;
+    while (*value==' ') value++;
+    if (strlen(value)>=HTTP_TAG_SIZE) return;
+    strcpy(target,value);
+}
+
+// +HTTPREAD: <length>, that many body bytes follow the line.
+void Sim800C::_httpReadLine()
+{
+    if (!_lineStartsWith("+HTTPREAD:")) return;
+    _rxRaw=atoi(_rxLine+10);
+    _rxHttp=_rxRaw!=0;
+}
+
+// The session is closed and the caller told, status stays what +HTTPACTION reported.
+void Sim800C::_httpFail()
+{
+    _http.length=_http.offset;
+    _http.step=HTTP_TERM;
+    if (_post(AT_HTTPTERM,&Sim800C::_httpNext)) return;
+    _http.step=HTTP_IDLE;
+    if (_http.done!=NULL) _http.done(*this,_http.status,_http.length);
+}
+#endif
+
+Sim800CPool::Sim800CPool()
+{
+    _count = 0;
+    _next = 0;
+    _polling = false;
+}
+
+bool Sim800CPool::add(Sim800C &gsm)
+{
+    if (_count>=POOL_SIZE || gsm._pool!=NULL) return false;
+    gsm._pool=this;
+    _modems[_count++]=&gsm;
+    return true;
+}
+
+uint8_t Sim800CPool::count()
+{
+    return _count;
+}
+
+Sim800C *Sim800CPool::modem(uint8_t i)
+{
+    if (i>=_count) return NULL;
+    return _modems[i];
+}
+
+void Sim800CPool::poll()
+{
+    _pollOthers(NULL);
+}
+
+/*
+ * Called from the blocking waits of self. Not reentrant: a callback of another
+ * modem that blocks in turn only polls its own modem until it returns.
+ */
+void Sim800CPool::_pollOthers(Sim800C *self)
+{
+    uint8_t i;
+
+    if (_polling) return;
+    _polling=true;
+    for (i=0; i<_count; i++)
+    {
+        if (_modems[i]!=self) _modems[i]->poll();
+    }
+    _polling=false;
+}
+
+// Fewest queued messages, ties go round robin so equal modems share the load.
+Sim800C *Sim800CPool::leastBusy()
+{
+    Sim800C *best=NULL;
+    uint8_t bestLoad=0xFF;
+    uint8_t i,n,load;
+
+    for (i=0; i<_count; i++)
+    {
+        n=(_next+i)%_count;
+        load=_modems[n]->outboxPending();
+        if (_modems[n]->busy()) load++;
+        if (load<bestLoad && _modems[n]->outboxPending()<SMS_OUTBOX_SIZE)
+        {
+            best=_modems[n];
+            bestLoad=load;
+        }
+    }
+    return best;
+}
+
+Sim800C *Sim800CPool::enqueueSms(const char *number,const char *text,sms_sent_callback aCallback)
+{
+    Sim800C *gsm=leastBusy();
+    uint8_t i;
+
+    if (gsm==NULL || !gsm->enqueueSms(number,text,aCallback)) return NULL;
+    for (i=0; i<_count; i++)
+    {
+        if (_modems[i]==gsm) _next=(i+1)%_count;
+    }
+    return gsm;
+}
+
+sms_outbox_stats Sim800CPool::stats()
+{
+    sms_outbox_stats total;
+    uint8_t i;
+
+    memset(&total,0,sizeof(total));
+    for (i=0; i<_count; i++)
+    {
+        const sms_outbox_stats &s=_modems[i]->outboxStats();
+        total.sent+=s.sent;
+        total.failed+=s.failed;
+        total.retries+=s.retries;
+        total.perMinute+=s.perMinute;
+    }
+    return total;
+}
+
+/*
+ * One line per modem and the total:
+ * modem=0 sent=120 failed=1 retries=3 per_minute=14 pending=2
+ * total sent=240 failed=1 retries=5 per_minute=29
+ */
+void Sim800CPool::printStats(Print &out)
+{
+    sms_outbox_stats total=stats();
+    uint8_t i;
+
+    for (i=0; i<_count; i++)
+    {
+        const sms_outbox_stats &s=_modems[i]->outboxStats();
+        out.print(F("modem="));
+        out.print(i);
+        out.print(F(" sent="));
+        out.print(s.sent);
+        out.print(F(" failed="));
+        out.print(s.failed);
+        out.print(F(" retries="));
+        out.print(s.retries);
+        out.print(F(" per_minute="));
+        out.print(s.perMinute);
+        out.print(F(" pending="));
+        out.println(_modems[i]->outboxPending());
+    }
+    out.print(F("total sent="));
+    out.print(total.sent);
+    out.print(F(" failed="));
+    out.print(total.failed);
+    out.print(F(" retries="));
+    out.print(total.retries);
+    out.print(F(" per_minute="));
+    out.println(total.perMinute);
+}
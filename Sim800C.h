@@ -15,20 +15,91 @@
 
 #ifndef Sim800C_h
 #define Sim800C_h
-#include <SoftwareSerial.h>
 #include "Arduino.h"
+#include "Sim800CPdu.h"
 
+// The default port exists only on an Arduino core, a host build passes its Stream to begin().
+#ifdef ARDUINO
 #define SwSerial  SoftwareSerial
 //#define HwSerial  Serial
+#endif
+
+#ifdef SwSerial
+#include <SoftwareSerial.h>
+#endif
+
+//#define SIM800C_STATS				// per-command counters and latency histograms, see getStats()
+//#define SIM800C_LONG_SMS			// sendLongSms() / readLongSms() in PDU mode, with a SMS_CACHE_SIZE reassembly pool
+//#define SIM800C_SOCKETS			// gprsAttach() and the socket*() TCP/UDP connections, with their SOCKET_RX_SIZE rings
+//#define SIM800C_HTTP				// httpGet() / httpPost() over AT+HTTP*, with their HTTP_WINDOW and request state
+//#define SIM800C_WHITELIST_MIRROR	// whiteListSync() and isAuthorized() from a RAM copy of the AT+CWHITELIST slots
 
 #define DEFAULT_RX_PIN      10
 #define DEFAULT_TX_PIN 		11
 #define DEFAULT_POWER_PIN 	2		// pin to the reset pin Sim800C
+#define NO_POWER_PIN		0xFF	// begin(Stream&) without a PWRKEY line, the sketch powers the modem
 
 
-#define BUFFER_RESERVE_MEMORY	255
+#define BUFFER_RESERVE_MEMORY	255		// size of the static response line arena (SimBuffer)
 #define DEFAULT_BAUD_RATE		9600
 #define TIME_OUT_READ_SERIAL	5000
+#define BOOT_TIMEOUT			20000	// ms for the modem to answer and accept its configuration
+#define IDLE_TICK				10		// longest Sim800CClock::idle() of a blocking call, bounds the timeouts of a pool
+#define CONFIG_RETRY_PAUSE		100		// ms between configuration tries after "SMS Ready", doubled up to 1 s
+#define POWER_PULSE				1000	// ms PWRKEY is held low to switch the modem on or off
+#define POWER_OFF_SETTLE		1700	// ms after the off pulse before the modem may be pulsed again
+#define RESET_OFF_PAUSE			500		// ms reset() keeps the modem off on top of POWER_OFF_SETTLE
+#define CONFIG_EEPROM_ADDR		0		// EEPROM offset of the saved configuration descriptor
+#define CONFIG_MAGIC			0x5C80
+
+#ifdef SwSerial
+#define BAUD_MAX				57600	// fastest rate SoftwareSerial receives reliably
+#else
+#define BAUD_MAX				460800
+#endif
+#define BAUD_BURST				4		// identity queries that validate a new rate
+#define POOL_SIZE				16		// modems one Sim800CPool services
+
+#ifdef SIM800C_STATS
+#define STATS_COMMANDS			8		// commands with a row of their own, the others share the last row
+#define STATS_BUCKETS			8		// latency histogram: <16 ms, <32 ms ... <1024 ms, longer
+#define STATS_NAME_SIZE			10		// "AT+CMGS" and the like, up to the first '=', '?' or ';', "ATD" for calls
+#endif
+
+#define CMD_QUEUE_SIZE			4		// pending commands of the asynchronous engine
+#define CMD_MAX_LENGTH			48		// RAM commands are copied into the queue slot
+#define RX_LINE_SIZE			170		// longest line framed by the receive tokenizer
+#define RX_RING_SIZE			64		// receive ring between the serial port and the tokenizer
+#define URC_TABLE_SIZE			20		// rows of the URC prefix table
+#define URC_FIFO_ROWS			10		// leading rows of the table whose events check_receive_command() returns
+#define URC_QUEUE_SIZE			URC_FIFO_ROWS	// one pending event per row, unrecognised lines only in free slots
+#define URC_TEXT_SIZE			40		// caller number / USSD text kept per queued event
+#define SMS_LIST_MAX			50		// messages of one AT+CMGL listing that can be deleted afterwards
+#define SMS_DELETE_LINE			128		// longest chained AT+CMGD command line
+#define SMS_OUTBOX_SIZE			8		// messages waiting in the outbound queue
+#define SMS_RETRIES				3		// tries of a queued message before it fails
+#define SMS_RETRY_DELAY			2000	// ms before the first retry, doubled on each further one
+#define SMS_NUMBER_SIZE			15		// buffer sizes assumed by the legacy readSms()
+#define SMS_TEXT_SIZE			161
+#define CALL_NUMBER_SIZE		20		// number of a ring-and-drop call, kept by the call machine
+#define CALL_RING_TIME			3000	// ms the callee phone rings before the call is dropped
+#define CALL_DIAL_TIMEOUT		10000	// ms from ATD to ringing before the attempt is given up
+#define CALL_RETRY_DELAY		1000	// ms between an attempt and the next one
+#define NET_CSQ_INTERVAL		30000	// ms between the AT+CSQ refreshes of the network cache
+#define SOCKET_COUNT			2		// connections of AT+CIPMUX=1 the library keeps, up to 6
+#define SOCKET_RX_SIZE			64		// receive ring of each connection
+#define SOCKET_CHUNK			512		// bytes per AT+CIPSEND, the modem takes up to 1460
+#define SOCKET_CMD_SIZE			96		// AT+CSTT / AT+CIPSTART lines with their host, APN and credentials
+#define SOCKET_TIMEOUT			20000	// ms for CONNECT OK and SEND OK
+#define HTTP_WINDOW				64		// body bytes per AT+HTTPREAD, handed to the body callback at once, up to 255
+#define HTTP_CMD_SIZE			120		// AT+HTTPPARA lines with the URL or a validator
+#define HTTP_TAG_SIZE			40		// ETag / Last-Modified kept for the next conditional GET
+#define HTTP_TIMEOUT			60000	// ms from AT+HTTPACTION to its +HTTPACTION report
+#define WHITELIST_SIZE			30		// slots of AT+CWHITELIST
+#define WHITELIST_INDEX			64		// buckets of the number index, a power of two above twice the slots
+#define WHITELIST_DIGITS		10		// trailing digits compared, "+98913..." and "0913..." are the same number
+#define WHITELIST_NUMBER_SIZE	20		// longest number of a slot
+#define WHITELIST_KEY_SIZE		((WHITELIST_DIGITS+1)/2)	// bytes of the BCD digits a slot keeps
 
 #define ERROR   0
 #define OK      1
@@ -37,6 +108,8 @@
 
 #define RESPON_ERROR	"ERROR\r\n"
 
+#define RESPON_LINE		""		// the first reply line ends the command, whatever it is
+
 #define ctrlz 26 //Ascii character for ctr+z. End of a SMS.
 #define cr    13 //Ascii character for carriage return.
 #define lf    10 //Ascii character for line feed.
@@ -51,9 +124,553 @@
 #define NOT_Recog_Data        4
 #define RING                  5
 #define CUSD				  6
+#define MODEM_READY           14	// "RDY", the modem finished booting
+#define CALL_READY            15
+#define SMS_READY             16
+#define CALL_LIST             17	// "+CLCC:" call state report of AT+CLCC=1
+#define NETWORK_REG           18	// "+CREG:" registration report of AT+CREG=2
+#define SMS_DIRECT            19	// "+CMT:" message delivered inline, AT+CNMI=2,2
+#define SOCKET_DATA           20	// "+RECEIVE,<n>,<length>:" data of a connection follows
+#define GPRS_DEACT            21	// "+PDP: DEACT", the GPRS context and every connection are gone
+#define HTTP_DONE             22	// "+HTTPACTION: <method>,<status>,<length>" request finished
 
 #define NoSMS                 255
 
+enum cmd_state_enum
+{
+	CMD_IDLE    = 0,
+	CMD_PENDING = 1,		// queued, not yet written to the modem
+	CMD_WAITING = 2		// written, waiting for the expected reply
+};
+
+enum cmd_result_enum
+{
+	CMD_ERROR   = ERROR,
+	CMD_OK      = OK,
+	CMD_TIMEOUT = 2
+};
+
+/*
+ * Fixed-capacity byte ring, N is the capacity in bytes. Nothing is allocated
+ * at run time: put() refuses a byte when full, get() returns -1 when empty.
+ */
+template <uint16_t N>
+class Sim800CRing
+{
+private:
+
+    uint8_t _data[N];
+    uint16_t _head;
+    uint16_t _count;
+
+public:
+
+    Sim800CRing() : _head(0), _count(0) {}
+
+    uint16_t available() const { return _count; }
+    uint16_t space() const     { return N-_count; }
+    void clear()               { _head=0; _count=0; }
+
+    bool put(uint8_t b)
+    {
+        if (_count>=N) return false;
+        _data[(_head+_count)%N]=b;
+        _count++;
+        return true;
+    }
+
+    int peek() const
+    {
+        if (_count==0) return -1;
+        return _data[_head];
+    }
+
+    int get()
+    {
+        if (_count==0) return -1;
+        uint8_t b=_data[_head];
+        _head=(_head+1)%N;
+        _count--;
+        return b;
+    }
+};
+
+/*
+ * Time source of the library. The default one uses the Arduino millis() and
+ * delay(), derive from it to run the library on another platform or clock.
+ * idle() is called between the polls of a blocking call: a clock that can
+ * wait for input on the transports (epoll on Linux) sleeps there for at most
+ * ms, the default returns at once and the call keeps polling.
+ */
+class Sim800CClock
+{
+public:
+
+    virtual ~Sim800CClock() {}
+    virtual uint32_t millis();
+    virtual void delay(uint32_t ms);
+    virtual void idle(uint32_t ms);
+};
+
+/*
+ * Descriptor of the configuration Setup() last wrote to the modem: a hash of
+ * the configuration command line and baud rate, and how long writing it took.
+ */
+struct config_descriptor
+{
+    uint16_t magic;
+    uint32_t hash;
+    uint16_t configMs;
+};
+
+/*
+ * Where the descriptor survives an MCU reset, used only once handed to
+ * setConfigStore(): without one every Setup() sends the whole configuration
+ * and nothing is written. This base class keeps it in EEPROM at
+ * CONFIG_EEPROM_ADDR and writes it after each cold Setup(). On ESP8266 /
+ * ESP32 cores call EEPROM.begin() first and EEPROM.commit() after Setup().
+ * Derive from it to keep it in a file or elsewhere; without an Arduino core
+ * this one never finds a descriptor.
+ */
+class Sim800CConfigStore
+{
+public:
+
+    virtual ~Sim800CConfigStore() {}
+    virtual bool load(config_descriptor &aDesc);
+    virtual void save(const config_descriptor &aDesc);
+};
+
+enum result_type_enum
+{
+	RESULT_OK      = 0,
+	RESULT_ERROR   = 1,		// plain ERROR
+	RESULT_CME     = 2,		// +CME ERROR, equipment / network
+	RESULT_CMS     = 3,		// +CMS ERROR, SMS service
+	RESULT_TIMEOUT = 4
+};
+
+#define RESULT_CODE_UNKNOWN		0xFFFF	// verbose +CME / +CMS text without a known number
+
+/*
+ * Final result of the last finished command. code is the number of a +CME or
+ * +CMS ERROR, in numeric (AT+CMEE=1) or verbose (AT+CMEE=2) form.
+ */
+struct at_result
+{
+    uint8_t type;
+    uint16_t code;
+};
+
+#ifdef SIM800C_STATS
+enum stats_class_enum
+{
+	STATS_OK      = 0,
+	STATS_ERROR   = 1,
+	STATS_CME     = 2,		// +CME ERROR or +CMS ERROR
+	STATS_TIMEOUT = 3,
+	STATS_CLASSES
+};
+
+/*
+ * Aggregates of one command. retries counts the times the library sent it
+ * again because the previous try failed (AT probes, the configuration, SMS
+ * and call attempts), histogram[i] the replies that took less than 16<<i ms.
+ */
+struct command_stats
+{
+    char name[STATS_NAME_SIZE];
+    uint32_t count;
+    uint32_t results[STATS_CLASSES];
+    uint16_t retries;
+    uint32_t bytesSent;
+    uint32_t bytesReceived;
+    uint16_t urcs;
+    uint32_t firstByteMax;
+    uint32_t latencyMax;
+    uint32_t latencySum;
+    uint16_t histogram[STATS_BUCKETS];
+};
+#endif
+
+/*
+ * Commands of the library, rows of the flash resident command table. A row
+ * holds the command line with '%' where the next argument goes, its final
+ * result and its timeout.
+ */
+enum at_id_enum
+{
+	AT_PING = 0,
+	AT_PROBE,				// short timeout, for probing rates and a running modem
+	AT_ECHO_IPR,			// %=baud
+	AT_ECHO,				// a Stream of the sketch, its rate is left alone
+	AT_IPR,					// %=baud
+	AT_CONFIG,
+	AT_CONFIG_CHECK,
+	AT_IDENTITY,
+	AT_CREG,
+	AT_CSCLK,				// %=0/1
+	AT_CFUN,				// %=0/1/4
+	AT_CPIN,				// %=pin
+	AT_INFO,
+	AT_COPS_LIST,
+	AT_COPS,
+	AT_CSQ,
+	AT_ANSWER,
+	AT_DIAL,				// %=number
+	AT_CPAS,
+	AT_HANGUP,
+	AT_WHITELIST_OFF,
+	AT_WHITELIST,			// %=mode, %=index, %=number
+	AT_WHITELIST_LIST,
+	AT_CMGS,				// %=number, ends with the '>' prompt
+	AT_CMGS_PDU,			// %=TPDU length
+	AT_CMGR,				// %=index
+	AT_CMGL,				// %="ALL" or "REC UNREAD"
+	AT_CMGD,				// %=index
+	AT_CMGDA,
+	AT_CMGF,				// %=0 PDU, 1 text
+	AT_CCLK,
+	AT_GSMLOC,
+	AT_CNMI,				// %=1 stored (+CMTI), 2 direct (+CMT)
+	AT_CSMS_QUERY,
+	AT_CNMA,
+	AT_CPMS_QUERY,
+	AT_CPMS,				// %=storage for reading, writing and receiving
+	AT_CIPMUX,
+	AT_CSTT,				// %=APN, %=user, %=password
+	AT_CIICR,
+	AT_CIFSR,				// replies with the local IP address alone
+	AT_CIPSTART,			// %=connection, %="TCP"/"UDP", %=host, %=port
+	AT_CIPSEND,				// %=connection, %=length, ends with the '>' prompt
+	AT_CIPCLOSE,			// %=connection, replies "<n>, CLOSE OK"
+	AT_CIPSHUT,
+	AT_SAPBR_GPRS,
+	AT_SAPBR_APN,			// %=APN
+	AT_SAPBR_OPEN,
+	AT_SAPBR_QUERY,
+	AT_HTTPINIT,
+	AT_HTTPCID,
+	AT_HTTPURL,				// %=URL
+	AT_HTTPNONEMATCH,		// %=ETag
+	AT_HTTPMODIFIED,		// %=Last-Modified date
+	AT_HTTPNOUSERDATA,
+	AT_HTTPCONTENT,			// %=Content-Type
+	AT_HTTPDATA,			// %=length, ends with the DOWNLOAD prompt
+	AT_HTTPACTION,			// %=0 GET, 1 POST, answered later by +HTTPACTION
+	AT_HTTPHEAD,
+	AT_HTTPREAD,			// %=offset, %=length
+	AT_HTTPTERM,
+
+	AT_COMMANDS
+};
+
+struct at_spec
+{
+    const char *format;		// flash
+    const char *respon;
+    uint16_t timeout;
+};
+
+/*
+ * Argument of a format that lands inside a quoted string parameter: '"' and
+ * '\' go out as the V.250 escapes \22 and \5C, an ETag keeps its quotes.
+ */
+struct at_quoted
+{
+    const char *text;
+};
+
+class Sim800C;
+class Sim800CPool;
+
+typedef void (*command_callback)(Sim800C &gsm, uint8_t result);
+
+/*
+ * Measurements of the last finished command. queued, firstByte and latency
+ * are in ms, firstByte and latency run from writing the command to its first
+ * received byte and to its final reply. urcs counts the unsolicited lines
+ * that arrived meanwhile. slept is the running total of deliberate waits of
+ * the library (power pulses, retries), ring_peak and arena_peak are the
+ * high-water marks of the receive buffers.
+ */
+struct command_timing
+{
+    uint8_t result;
+    uint32_t queued;
+    uint32_t firstByte;
+    uint32_t latency;
+    uint8_t urcs;
+    uint16_t bytesSent;
+    uint16_t bytesReceived;
+    uint32_t slept;
+    uint16_t ringPeak;
+    uint16_t arenaPeak;
+};
+
+/*
+ * One unsolicited result code. type is one of the check_receive_command()
+ * values, index is the storage index of +CMTI, text is the caller number of
+ * +CLIP, the message of +CUSD or the raw line. text is only valid during the
+ * handler call.
+ */
+struct urc_event
+{
+    uint8_t type;
+    uint8_t index;
+    const char *text;
+    bool authorized;			// isAuthorized() of the +CLIP number, false without the whitelist mirror
+};
+
+typedef void (*urc_callback)(Sim800C &gsm, const urc_event &event);
+
+struct urc_pending
+{
+    uint8_t type;
+    uint8_t index;
+    bool handler;				// for the registered handler, held back while a blocking call waits
+    char text[URC_TEXT_SIZE];
+};
+
+typedef void (*sms_callback)(Sim800C &gsm, uint8_t index, uint8_t status, const char *phone_number, const char *SMS_text);
+
+struct sms_parse_state
+{
+    sms_callback callback;
+    char *number;
+    uint8_t numberSize;
+    char *text;
+    uint16_t textSize;
+    uint16_t textLen;
+    uint8_t index;
+    uint8_t status;
+    bool open;
+    bool truncated;
+    bool framed;			// the header gave the text length
+    uint8_t count;
+    uint8_t indices[SMS_LIST_MAX];
+};
+
+// result is OK or ERROR, reference is the message reference of +CMGS.
+typedef void (*sms_sent_callback)(Sim800C &gsm, const char *number, const char *text, uint8_t result, uint8_t reference);
+
+/*
+ * Network state kept from the +CREG reports and the periodic AT+CSQ.
+ * registration is the <stat> of +CREG (1 home, 5 roaming, 0xFF before the
+ * first report), rssi and ber are 99 when unknown. regTime and csqTime are the
+ * millis() of the last updates, 0 for never.
+ */
+struct network_status
+{
+    uint8_t registration;
+    uint16_t lac;
+    uint16_t ci;
+    uint8_t rssi;
+    uint8_t ber;
+    uint32_t regTime;
+    uint32_t csqTime;
+};
+
+typedef void (*network_callback)(Sim800C &gsm, const network_status &status);
+
+enum socket_state_enum
+{
+	SOCKET_CLOSED     = 0,
+	SOCKET_CONNECTING = 1,
+	SOCKET_CONNECTED  = 2
+};
+
+/*
+ * One connection of AT+CIPMUX=1. Received data waits in rx, what does not
+ * fit is counted in dropped. sending is set from the data of AT+CIPSEND to
+ * its SEND OK / SEND FAIL, sendOk tells which one came.
+ */
+struct socket_state
+{
+    uint8_t state;
+    bool sending;
+    bool sendOk;
+    uint16_t dropped;
+    Sim800CRing<SOCKET_RX_SIZE> rx;
+};
+
+enum http_step_enum
+{
+	HTTP_IDLE    = 0,
+	HTTP_INIT    = 1,		// AT+HTTPINIT, an open session answers ERROR and is used as is
+	HTTP_CID     = 2,
+	HTTP_URL     = 3,
+	HTTP_HEADER  = 4,		// If-None-Match / If-Modified-Since, or none
+	HTTP_CONTENT = 5,		// POST only
+	HTTP_DATA    = 6,		// POST only, the body is written at the DOWNLOAD prompt
+	HTTP_ACTION  = 7,
+	HTTP_WAIT    = 8,		// for +HTTPACTION
+	HTTP_HEAD    = 9,		// validators of a conditional GET
+	HTTP_READ    = 10,
+	HTTP_TERM    = 11
+};
+
+/*
+ * offset is the position of data in the body, len at most HTTP_WINDOW.
+ * status is the HTTP status, 304 when a conditional GET found the resource
+ * unchanged, the 6xx codes of the modem for network errors, 0 when a command
+ * of the request failed.
+ */
+typedef void (*http_body_callback)(Sim800C &gsm, const uint8_t *data, uint16_t len, uint32_t offset);
+typedef void (*http_done_callback)(Sim800C &gsm, uint16_t status, uint32_t length);
+
+// url, contentType and data stay owned by the caller until the done callback ran.
+struct http_control
+{
+    uint8_t step;
+    bool post;
+    bool conditional;
+    const char *url;
+    const char *contentType;
+    const uint8_t *data;
+    uint16_t dataLen;
+    uint32_t since;
+    uint16_t status;
+    uint32_t length;
+    uint32_t offset;
+    uint8_t fill;
+    uint8_t window[HTTP_WINDOW];
+    char cmd[HTTP_CMD_SIZE];
+    char etag[HTTP_TAG_SIZE];
+    char modified[HTTP_TAG_SIZE];
+    http_body_callback body;
+    http_done_callback done;
+};
+
+/*
+ * The mode and the state of parsing the AT+CWHITELIST? reply. With
+ * SIM800C_WHITELIST_MIRROR also a RAM mirror of the modem whitelist: a slot
+ * keeps the trailing WHITELIST_DIGITS digits of its number in BCD, and index
+ * maps their hash to slots by open addressing so a lookup never asks the
+ * modem. The digits, not the hash, decide a match.
+ */
+struct whitelist_mirror
+{
+    uint8_t mode;
+#ifdef SIM800C_WHITELIST_MIRROR
+    bool loaded;
+    uint8_t digits[WHITELIST_SIZE][WHITELIST_KEY_SIZE];	// right aligned after 0xF nibbles, all 0xFF when empty
+    uint8_t index[WHITELIST_INDEX];		// slot+1, 0 for an empty bucket
+#endif
+
+    bool parsing;
+    uint8_t field;
+    uint8_t len;
+    char number[WHITELIST_NUMBER_SIZE];
+    char *out;
+    uint16_t outSize;
+    uint16_t outLen;
+};
+
+enum call_state_enum
+{
+	CALL_IDLE      = 0,
+	CALL_DIALING   = 1,		// ATD sent or due, the callee is not ringing yet
+	CALL_ALERTING  = 2,		// ringing at the callee, dropped after the ring time
+	CALL_CONNECTED = 3,		// answered, dropped at once
+	CALL_RELEASING = 4		// ATH sent or due
+};
+
+/*
+ * result is the call_status of the last attempt: MO_RING, NO_ANSWER and
+ * MO_CONNECTED mean the callee phone rang, BUSY, NO_CARRIER, NO_DIALTONE or
+ * ERROR (no answer to ATD, no ringing in time) that it did not.
+ */
+typedef void (*call_callback)(Sim800C &gsm, const char *number, uint8_t result);
+
+struct call_control
+{
+    uint8_t state;
+    char number[CALL_NUMBER_SIZE];
+    uint8_t tries;
+    uint16_t ringTime;
+    uint32_t since;			// entry into the state, or the start of the next try
+    bool sent;				// the command of the state is queued
+    bool retry;				// the next ATD follows an attempt that did not ring
+    uint8_t result;
+    call_callback callback;
+};
+
+// number and text stay owned by the caller until the callback ran.
+struct sms_outgoing
+{
+    const char *number;
+    const char *text;
+    sms_sent_callback callback;
+    uint8_t tries;
+    uint32_t notBefore;
+};
+
+/*
+ * Outbound queue counters. perMinute is the number of messages sent during
+ * the last full minute.
+ */
+struct sms_outbox_stats
+{
+    uint32_t sent;
+    uint32_t failed;
+    uint32_t retries;
+    uint16_t perMinute;
+    uint16_t windowCount;
+    uint32_t windowStart;
+};
+
+typedef void (Sim800C::*line_handler)();
+
+enum power_step_enum
+{
+	POWER_IDLE      = 0,
+	POWER_PULSE_LOW = 1,	// PWRKEY low, raised by poll() after POWER_PULSE
+	POWER_SETTLE    = 2		// pulse over, the modem switches off
+};
+
+// A PWRKEY sequence run from poll(), no call waits for it.
+struct power_control
+{
+    uint8_t step;
+    uint32_t since;			// entry into the step
+    uint16_t settle;		// ms of POWER_SETTLE after the pulse, 0 for none
+};
+
+
+/*
+ * Boot phases of the last Setup(), in ms from its start. powerOn is 0 when
+ * the modem was already running, the ready fields are 0 when not seen.
+ */
+struct boot_timing
+{
+    uint32_t powerOn;
+    uint32_t firstAt;
+    uint32_t modemReady;
+    uint32_t callReady;
+    uint32_t smsReady;
+    uint32_t configured;
+    uint32_t saved;			// configuration time skipped because the modem kept its settings
+};
+
+struct at_command
+{
+    const char *cmd;
+    bool flash;						// cmd points to program memory
+    const char *respon;
+    uint32_t timeout;
+    uint32_t queued;
+    uint32_t start;
+    command_callback callback;
+    line_handler handler;			// takes the reply lines instead of the arena
+    uint8_t state;
+    uint16_t ticket;
+#ifdef SIM800C_STATS
+    bool retry;						// sent again after the previous try failed
+#endif
+    char text[CMD_MAX_LENGTH];
+};
+
 enum registration_ret_val_enum
 {
 	REG_NOT_REGISTERED = 0,
@@ -91,6 +708,7 @@ enum getsms_ret_val_enum
 	GETSMS_OTHER_SMS    = 5,
 	GETSMS_NOT_AUTH_SMS = 6,
 	GETSMS_AUTH_SMS     = 7,
+	GETSMS_PART_SMS     = 8,		// part of a concatenated message kept until the rest arrives
 
 	GETSMS_LAST_ITEM
 };
@@ -99,34 +717,342 @@ class Sim800C
 {
 private:
 
+    Stream *_serial;
+    Sim800CClock *_clock;
     uint32_t _baud;
     int _timeout;
     bool _sleepMode;
     uint8_t _functionalityMode;
 
-    String _readSerial();
-    String _readSerial(uint32_t timeout);
+    Sim800CRing<RX_RING_SIZE> _rx;
+    char _rxLine[RX_LINE_SIZE];
+    uint8_t _rxLen;
+    bool _rxFull;
+    bool _rxSplit;
+    bool _rxPrompt;
+    bool _rxBody;
+    uint16_t _rxRaw;
+#ifdef SIM800C_LONG_SMS
+    bool _rxPdu;
+#endif
+    bool _rxCmt;				// the raw bytes are the text of a +CMT
+    bool _rxCmtLine;			// the next line is the text of a +CMT without length
+#ifdef SIM800C_SOCKETS
+    uint8_t _rxSock;			// connection+1 the raw bytes belong to, 0 for SMS text
+#endif
+#ifdef SIM800C_HTTP
+    bool _rxHttp;				// the raw bytes are HTTP body for the window
+#endif
+    bool _rxDrop;				// the raw bytes are taken out of the stream and dropped
+
+    urc_callback _urcHandlers[URC_TABLE_SIZE];
+    urc_pending _urcQueue[URC_QUEUE_SIZE];
+    uint8_t _urcHead;
+    uint8_t _urcCount;
+    uint16_t _urcDropped;
+
+    bool _dispatchUrc();
+    void _queueUrc(uint8_t type,uint8_t index,const char *text,bool aHandler=false);
+    void _deferredUrcs();
+
+    sms_parse_state _sms;
+
+    void _smsBegin(sms_callback aCallback,char *phone_number,uint8_t numberSize,char *SMS_text,uint16_t textSize);
+    void _smsLine();
+    void _smsByte(char ch);
+    void _smsDeliver();
+
+    sms_parse_state _cmt;
+    bool _cmtReady;
+    bool _cmtAck;				// +CSMS service 1, each +CMT is confirmed with AT+CNMA
+    bool _smsWatch;				// storage mode on the SIM, each +CMTI checks whether it filled up
+
+    void _cmtHeader();
+    void _cmtDeliver();
+    static void _smsStorageChecked(Sim800C &gsm,uint8_t result);
+
+#ifdef SIM800C_LONG_SMS
+    Sim800CPduDecoder _pdu;
+    Sim800CSmsCache _smsCache;
+    uint8_t _smsRef;
+
+    void _pduLine();
+#endif
+
+    sms_outgoing _outbox[SMS_OUTBOX_SIZE];
+    uint8_t _outboxHead;
+    uint8_t _outboxCount;
+    bool _outboxBusy;
+    sms_outbox_stats _outboxStats;
+
+    network_status _net;
+    network_callback _netCallback;
+
+    void _netStep();
+    void _netCreg();
+    void _netCsq();
+    void _netChanged(bool changed);
+    static void _netCsqDone(Sim800C &gsm,uint8_t result);
+
+#ifdef SIM800C_SOCKETS
+    socket_state _sockets[SOCKET_COUNT];
+
+    bool _socketLine();
+    void _socketData();
+    void _socketsClosed();
+    bool _socketWait(uint8_t n,uint8_t state);
+#endif
+
+    whitelist_mirror _wl;
+
+#ifdef SIM800C_WHITELIST_MIRROR
+    static bool _whiteKey(const char *number,uint8_t *key);
+    static uint8_t _whiteBucket(const uint8_t *key);
+    void _whiteIndex();
+    void _whiteSlot(uint8_t slot,const uint8_t *key);
+#endif
+    void _whiteLine();
+    void _whiteField();
+    bool _whiteRead(char *PhoneNumbers,uint16_t size);
+
+#ifdef SIM800C_HTTP
+    http_control _http;
 
-    bool send_cmd_wait_reply(String aCmd,const char*aResponExit,uint32_t aTimeoutMax);
+    bool _httpStart(const char *url,http_body_callback aBody,http_done_callback aDone);
+    void _httpStep();
+    void _httpAction();
+    void _httpFail();
+    void _httpHeadLine();
+    void _httpReadLine();
+    static void _httpNext(Sim800C &gsm,uint8_t result);
+    static void _httpDownload(Sim800C &gsm,uint8_t result);
+#endif
+
+    call_control _call;
+
+    void _callStep();
+    void _callEvent(uint8_t type);
+    void _callRelease(uint8_t result);
+    static void _callDialed(Sim800C &gsm,uint8_t result);
+    static void _callReleased(Sim800C &gsm,uint8_t result);
+
+    void _outboxStep();
+    void _outboxFailed();
+    void _outboxDone(uint8_t result);
+    void _outboxRate(uint8_t sent);
+    static void _outboxPrompt(Sim800C &gsm,uint8_t result);
+    static void _outboxResult(Sim800C &gsm,uint8_t result);
+
+    uint32_t _rxBytes;
+    uint32_t _rxMark;
+    command_timing _timing;
+    bool _rxFirst;				// no byte received yet for the running command
+    at_result _result;
+    void _classify();
+#ifdef SIM800C_STATS
+    command_stats _stats[STATS_COMMANDS];
+    bool _statsRetry;			// the next command queued repeats one that failed
+    void _statsRecord(at_command *c,uint8_t result);
+#endif
+    void _retryNext();
+
+    power_control _power;
+
+    void _powerPulse(uint16_t settle);
+    void _powerStep();
+    void _powerWait();
+
+    uint16_t _arenaLen;
+    uint8_t _arenaLines;
+
+    void _pump();
+    bool _readLine();
+    bool _lineStartsWith(const char *aPrefix);
+    bool _lineIs(const char *aText);
+
+    void _arenaClear();
+    void _arenaAppend(const char *aLine,bool aContinue);
+    const char *_firstLine();
+    const char *_nextLine(const char *aLine);
+    const char *_responseLine(const char *aPrefix);
+    String _responseString();
+
+    at_command _cmdQueue[CMD_QUEUE_SIZE];
+    uint8_t _cmdHead;
+    uint8_t _cmdCount;
+    uint8_t _lastResult;
+
+    boot_timing _boot;
+    uint32_t _bootStart;
+
+    Sim800CConfigStore *_config;
+    Sim800CPool *_pool;
+    uint8_t _powerPin;
+
+    bool _waitReady(uint32_t timeout);
+    void _configParts();
+    uint32_t _configHash();
+    bool _configValid();
+
+    bool _ownPort();
+    bool _probeBaud(uint32_t baud);
+    bool _switchBaud(uint32_t baud);
+    uint32_t _burst(uint32_t *bytes,uint32_t *ms);
+
+    // Completions by ticket, a blocking call finds its own result even when a
+    // handler or callback ran another blocking call while it waited.
+    struct command_done
+    {
+        uint16_t ticket;
+        uint8_t result;
+    };
+
+    uint16_t _cmdIssued;
+    command_done _done[CMD_QUEUE_SIZE];
+    uint8_t _doneNext;
+    uint16_t _waitTicket;			// of the innermost blocking call waiting
+    uint8_t _waitDepth;
+
+    bool _finished(uint16_t ticket,uint8_t *result);
+    bool _started(uint16_t ticket);
+    at_command *_promote(at_command *c);
+    void _dropCommand(at_command *c);
+
+    at_command *_enqueue(const char*aResponExit,uint32_t aTimeoutMax,command_callback aCallback,bool aFront=false);
+    void _finishCommand(at_command *c,uint8_t result);
+    uint8_t _waitCommand(at_command *c);
+    uint8_t _waitReply(const char*aResponExit,uint32_t aTimeoutMax);
+
+    bool send_cmd_wait_reply(const char *aCmd,const char*aResponExit,uint32_t aTimeoutMax);
     bool send_cmd_wait_reply(const __FlashStringHelper *aCmd,const char*aResponExit,uint32_t aTimeoutMax);
 
+    /*
+     * Command table. The arguments are formatted by type into the line, whole
+     * numbers in decimal and strings as they are, never past the buffer:
+     *   _send(AT_CMGD,index)                            blocking, OK or ERROR
+     *   _prepare(AT_CMGR,cmd,sizeof(cmd),index)         queued, cmd must outlive it
+     *   _post(AT_CMGS,callback,number)                  queued, copied into the slot
+     * Rows without arguments are sent straight from flash.
+     */
+    void _spec(uint8_t id,at_spec *aSpec);
+    bool _formatText(char *&out,const char *end,const char *&spec);
+    bool _formatArg(char *&out,const char *end,uint32_t value);
+    bool _formatArg(char *&out,const char *end,const char *text);
+    bool _formatArg(char *&out,const char *end,at_quoted quoted);
+    bool _format(char *out,const char *end,const char *spec);
+
+    template<typename T,typename... A>
+    bool _format(char *out,const char *end,const char *spec,T arg,A... rest)
+    {
+        return _formatText(out,end,spec) && _formatArg(out,end,arg) && _format(out,end,spec,rest...);
+    }
+
+    at_command *_prepare(uint8_t id,command_callback aCallback=NULL);
+
+    template<typename... A>
+    at_command *_prepare(uint8_t id,char *cmd,uint8_t size,A... args)
+    {
+        at_spec spec;
+        at_command *c;
+        _spec(id,&spec);
+        if (!_format(cmd,cmd+size,spec.format,args...)) return NULL;
+        c=_enqueue(spec.respon,spec.timeout,NULL);
+        if (c==NULL) return NULL;
+        c->cmd=cmd;
+        c->flash=false;
+        return c;
+    }
+
+    uint8_t _send(uint8_t id);
+
+    template<typename... A>
+    uint8_t _send(uint8_t id,A... args)
+    {
+        char cmd[CMD_MAX_LENGTH];
+        at_command *c=_prepare(id,cmd,sizeof(cmd),args...);
+        if (c==NULL) return ERROR;
+        return _waitCommand(c)==CMD_OK ? OK : ERROR;
+    }
+
+    template<typename... A>
+    bool _post(uint8_t id,command_callback aCallback,A... args)
+    {
+        char cmd[CMD_MAX_LENGTH];
+        at_spec spec;
+        at_command *c;
+        _spec(id,&spec);
+        if (!_format(cmd,cmd+sizeof(cmd),spec.format,args...)) return false;
+        c=_enqueue(spec.respon,spec.timeout,aCallback);
+        if (c==NULL) return false;
+        strcpy(c->text,cmd);
+        c->cmd=c->text;
+        c->flash=false;
+        return true;
+    }
+
 public:
 
     uint8_t sms_index=NoSMS;
-    String SimBuffer;
+    // Static line arena: the reply lines of the last command, each one NUL
+    // terminated, or the caller number / USSD text of the last URC.
+    char SimBuffer[BUFFER_RESERVE_MEMORY];
 
     Sim800C(void);
 
+#ifdef ARDUINO
     void begin();					//Default baud 9600
     void begin(uint32_t baud);
+#endif
+    void begin(Stream &serial,uint32_t baud=DEFAULT_BAUD_RATE,uint8_t powerPin=NO_POWER_PIN);	// any transport, already opened
+    void setClock(Sim800CClock &clock);
+    // PWRKEY pulses: return at once, poll() raises the pin when the time is up.
     void PowerOn();
     void PowerOff();
-    void reset();
+    // A pulse, or the pause after switching off, is still running.
+    bool powerBusy();
+    uint8_t reset();
 
     uint8_t Setup(void);
+    const boot_timing &bootTiming();
+    // Opt-in warm start, NULL (the default) always sends the whole configuration
+    void setConfigStore(Sim800CConfigStore *store);
 
+    // Baud rate negotiation, HwSwSerial only: a Stream passed to begin() keeps its rate.
+    // detectBaud() finds the rate the modem runs at, any rate of AT+IPR, 0 when it does not answer.
+    // negotiateBaud() locks the modem to the fastest rate up to maxBaud that passes
+    // a burst of identity queries, and returns it.
+    uint32_t detectBaud();
+    uint32_t negotiateBaud(uint32_t maxBaud=BAUD_MAX);
+    // Bulk read throughput at each rate up to maxBaud, then negotiateBaud(maxBaud).
+    void benchmarkBaud(Print &out,uint32_t maxBaud=BAUD_MAX);
+
+    // Asynchronous command engine: queue a command and call poll() from loop().
+    // The callback receives CMD_OK, CMD_ERROR or CMD_TIMEOUT, reply lines are in SimBuffer.
+    // A blocking call made from a callback runs ahead of the commands not yet
+    // written; while another blocking call already waits for its reply it
+    // fails with ERROR instead, make it from loop() then.
+    bool submit(const __FlashStringHelper *aCmd,const char*aResponExit,uint32_t aTimeoutMax,command_callback aCallback=NULL);
+    bool submit(const char *aCmd,const char*aResponExit,uint32_t aTimeoutMax,command_callback aCallback=NULL);
+    void poll();
+    bool busy();
+
+    const command_timing &lastTiming();
+    const at_result &lastResult();
+    void printTiming(Print &out);
+#ifdef SIM800C_STATS
+    // STATS_COMMANDS rows, unused ones have an empty name.
+    const command_stats *getStats();
+    void printStats(Print &out);
+    void clearStats();
+#endif
+
+    // From the network cache, queried only before the first +CREG report.
     uint8_t is_network_registered();
+    const network_status &networkStatus();
+    // Called when the registration, the cell or the signal level changes.
+    void onNetworkChange(network_callback aCallback);
 
+    // true on success
     bool setSleepMode(bool state);
     bool getSleepMode();
     bool setFunctionalityMode(uint8_t fun);
@@ -145,14 +1071,105 @@ public:
 
     bool sendSms(char* number,char* text);
     uint8_t readSms(uint8_t index, char * phone_number, char * SMS_text);
+    uint8_t readSms(uint8_t index, char * phone_number, uint8_t numberSize, char * SMS_text, uint16_t textSize);
+    bool smsTruncated();
+
+    /*
+     * Direct delivery: incoming messages arrive inline as +CMT and go to
+     * aCallback (index NoSMS) through phone_number / SMS_text, without being
+     * stored on the SIM. When the modem refuses it the library stays with
+     * +CMTI and SIM storage, moved to the phone memory once the SIM is full
+     * (checked now and on each +CMTI), and false is returned. enable false
+     * goes back to storage mode.
+     */
+    bool setDirectSms(bool enable,sms_callback aCallback=NULL,char *phone_number=NULL,uint8_t numberSize=0,char *SMS_text=NULL,uint16_t textSize=0);
+    // Messages stored and room of the receive storage, from AT+CPMS?.
+    bool smsStorage(uint8_t *used,uint8_t *total);
+#ifdef SIM800C_LONG_SMS
+    bool sendLongSms(const char *number,const char *text);
+    uint8_t readLongSms(uint8_t index, char * phone_number, uint8_t numberSize, char * SMS_text, uint16_t textSize);
+#endif
+
+    // Non-blocking send: queued, driven by poll(), retried, reported through the callback.
+    // false for a text of more than SMS_SINGLE_SEPTETS septets, which takes several messages.
+    bool enqueueSms(const char *number,const char *text,sms_sent_callback aCallback=NULL);
+    uint8_t outboxPending();
+    const sms_outbox_stats &outboxStats();
     bool deleteSMS(uint8_t position);
     bool delAllSms();
+    uint8_t readAllSms(bool unreadOnly,sms_callback aCallback,char *phone_number,uint8_t numberSize,char *SMS_text,uint16_t textSize,bool aDelete=true);
+    bool deleteSms(const uint8_t *indices,uint8_t count);
 
     bool AddToWhiteList(uint8_t Command,uint8_t index,char * PhoneNumber); //index=1-30
+    // The list as the modem reports it, numbers separated by commas, PhoneNumbers must hold it whole.
     uint8_t whiteListStatus(char * PhoneNumbers);
+    uint8_t whiteListStatus(char * PhoneNumbers,uint16_t size);
+
+#ifdef SIM800C_WHITELIST_MIRROR
+    /*
+     * Whitelist mirror. whiteListLoad() reads the modem list once,
+     * AddToWhiteList() and whiteListSync() keep the mirror up to date.
+     * whiteListSync() makes the modem list numbers[0..count-1] in slots 1 on
+     * and writes only the slots whose number changed, -1 when a write failed.
+     * isAuthorized() answers from the mirror in constant time: true for
+     * every number once the list is known to be Disable, else true for the
+     * listed numbers only. Before whiteListLoad() the mode is unknown and
+     * only the numbers AddToWhiteList() wrote are authorized.
+     */
+    bool whiteListLoad();
+    int8_t whiteListSync(uint8_t mode,const char * const *numbers,uint8_t count);
+    bool isAuthorized(const char *number);
+#endif
     bool miss_call(String aSenderNumber,uint8_t NumOfTry);
 
+    // Non-blocking ring-and-drop driven from poll(), tries attempts until the
+    // callee phone rings. SMS traffic goes on meanwhile. false when a call is
+    // already running or the number is too long.
+    bool ringAndDrop(const char *number,uint8_t tries=1,uint16_t ringTime=CALL_RING_TIME,call_callback aCallback=NULL);
+    uint8_t callState();
+    void cancelCall();
+
+#ifdef SIM800C_SOCKETS
+    /*
+     * GPRS and TCP/UDP connections (AT+CIPMUX=1), numbered 0 to SOCKET_COUNT-1.
+     * socketSend() writes the caller's buffer to the modem in SOCKET_CHUNK
+     * pieces straight from where it is. Received data is kept per connection
+     * until read.
+     */
+    bool gprsAttach(const char *apn,const char *user="",const char *password="");
+    bool gprsDetach();
+    int8_t socketOpen(const char *host,uint16_t port,bool udp=false);
+    bool socketConnected(uint8_t n);
+    bool socketSend(uint8_t n,const uint8_t *data,uint16_t len);
+    uint16_t socketAvailable(uint8_t n);
+    uint16_t socketRead(uint8_t n,uint8_t *data,uint16_t size);
+    bool socketClose(uint8_t n);
+#endif
+
+#ifdef SIM800C_HTTP
+    /*
+     * HTTP over the modem's own stack (AT+HTTP*), on the bearer httpBearer()
+     * opened. A request runs from poll() and returns at once: the body is read
+     * HTTP_WINDOW bytes at a time with AT+HTTPREAD and handed to aBody, then
+     * aDone gets the status. A conditional GET sends the ETag or Last-Modified
+     * of the previous successful one and reports 304 without a body when the
+     * resource did not change.
+     */
+    bool httpBearer(const char *apn);
+    bool httpGet(const char *url,http_body_callback aBody,http_done_callback aDone=NULL,bool conditional=false);
+    bool httpPost(const char *url,const char *contentType,const uint8_t *data,uint16_t len,http_body_callback aBody=NULL,http_done_callback aDone=NULL);
+    bool httpBusy();
+    void httpForget();
+#endif
+
+    // URCs go to the handler registered for their type, the others are
+    // returned one per call by check_receive_command(). A URC that arrives
+    // during a blocking call reaches its handler from the next poll() after
+    // it, so the handler may make blocking calls of its own.
+    bool onUrc(uint8_t type,urc_callback aCallback);
     uint8_t check_receive_command(void);
+    // Events lost because the queue was full, unrecognised lines not counted.
+    uint16_t urcDropped();
 
     String signalQuality();
     void setPhoneFunctionality();
@@ -160,6 +1177,46 @@ public:
     void RTCtime(int *day,int *month, int *year,int *hour,int *minute, int *second);
     String dateNet();
 
+    friend class Sim800CPool;
+};
+
+/*
+ * Several modems, each on its own transport and power pin, serviced
+ * cooperatively: poll() gives every modem one poll(), and while one of them
+ * waits for a reply or sleeps inside a blocking call the others keep being
+ * polled. Add the modems before their begin() so that a slow boot does not
+ * stall the others. Only one SoftwareSerial port receives at a time, use
+ * hardware UARTs (or other Streams) for more than one modem.
+ */
+class Sim800CPool
+{
+private:
+
+    Sim800C *_modems[POOL_SIZE];
+    uint8_t _count;
+    uint8_t _next;
+    bool _polling;
+
+    void _pollOthers(Sim800C *self);
+
+public:
+
+    Sim800CPool();
+
+    bool add(Sim800C &gsm);
+    uint8_t count();
+    Sim800C *modem(uint8_t i);
+    void poll();
+
+    // Queue on the modem with the fewest pending messages, NULL when all outboxes are full.
+    Sim800C *leastBusy();
+    Sim800C *enqueueSms(const char *number,const char *text,sms_sent_callback aCallback=NULL);
+
+    // Counters of all outboxes together, perMinute is their sum.
+    sms_outbox_stats stats();
+    void printStats(Print &out);
+
+    friend class Sim800C;
 };
 
 #endif
@@ -0,0 +1,485 @@
+#include "Sim800CLinux.h"
+#if defined(__linux__) && !defined(ARDUINO)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+// B0 for a rate the tty cannot be set to.
+static speed_t ttySpeed(uint32_t baud)
+{
+    switch (baud)
+    {
+    case 1200:   return B1200;
+    case 2400:   return B2400;
+    case 4800:   return B4800;
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    default:     return B0;
+    }
+}
+
+Sim800CTty::Sim800CTty()
+{
+    _fd = -1;
+    _peek = -1;
+}
+
+Sim800CTty::~Sim800CTty()
+{
+    close();
+}
+
+bool Sim800CTty::open(const char *path,uint32_t baud)
+{
+    struct termios tio;
+    speed_t speed=ttySpeed(baud);
+
+    close();
+    if (speed==B0)
+    {
+        errno=EINVAL;
+        return false;
+    }
+    _fd=::open(path,O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC);
+    if (_fd<0) return false;
+    if (tcgetattr(_fd,&tio)!=0)
+    {
+        close();
+        return false;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag|=CLOCAL|CREAD;
+    tio.c_cflag&=~CRTSCTS;
+    cfsetispeed(&tio,speed);
+    cfsetospeed(&tio,speed);
+    if (tcsetattr(_fd,TCSANOW,&tio)!=0)
+    {
+        close();
+        return false;
+    }
+    tcflush(_fd,TCIOFLUSH);
+    return true;
+}
+
+void Sim800CTty::close()
+{
+    if (_fd>=0) ::close(_fd);
+    _fd=-1;
+    _peek=-1;
+}
+
+int Sim800CTty::fd()
+{
+    return _fd;
+}
+
+int Sim800CTty::available()
+{
+    int n=0;
+    if (_fd<0 || ioctl(_fd,FIONREAD,&n)!=0) n=0;
+    return n+(_peek>=0 ? 1 : 0);
+}
+
+int Sim800CTty::read()
+{
+    uint8_t b;
+    int c=_peek;
+
+    if (c>=0)
+    {
+        _peek=-1;
+        return c;
+    }
+    if (_fd<0 || ::read(_fd,&b,1)!=1) return -1;
+    return b;
+}
+
+int Sim800CTty::peek()
+{
+    if (_peek<0) _peek=read();
+    return _peek;
+}
+
+size_t Sim800CTty::write(uint8_t b)
+{
+    return write(&b,1);
+}
+
+// The port is non-blocking, a full output queue is waited out here.
+size_t Sim800CTty::write(const uint8_t *buffer,size_t size)
+{
+    size_t done=0;
+    ssize_t n;
+
+    while (_fd>=0 && done<size)
+    {
+        n=::write(_fd,buffer+done,size-done);
+        if (n>0) done+=n;
+        else if (n<0 && errno!=EAGAIN && errno!=EINTR) break;
+        else tcdrain(_fd);
+    }
+    return done;
+}
+
+uint32_t Sim800CLinuxClock::millis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint32_t)(ts.tv_sec*1000UL+ts.tv_nsec/1000000UL);
+}
+
+void Sim800CLinuxClock::delay(uint32_t ms)
+{
+    struct timespec ts;
+    ts.tv_sec=ms/1000;
+    ts.tv_nsec=(ms%1000)*1000000L;
+    while (nanosleep(&ts,&ts)!=0 && errno==EINTR);
+}
+
+Sim800CEpoll::Sim800CEpoll(Sim800CPool &pool)
+{
+    _ep = epoll_create1(EPOLL_CLOEXEC);
+    _pool = &pool;
+}
+
+Sim800CEpoll::~Sim800CEpoll()
+{
+    if (_ep>=0) ::close(_ep);
+}
+
+bool Sim800CEpoll::add(Sim800CTty &tty)
+{
+    struct epoll_event ev;
+
+    if (_ep<0 || tty.fd()<0) return false;
+    ev.events=EPOLLIN;
+    ev.data.ptr=&tty;
+    return epoll_ctl(_ep,EPOLL_CTL_ADD,tty.fd(),&ev)==0;
+}
+
+bool Sim800CEpoll::run(uint32_t timeout)
+{
+    struct epoll_event ev[POOL_SIZE];
+
+    if (_ep<0) return false;
+    if (epoll_wait(_ep,ev,POOL_SIZE,timeout)<0 && errno!=EINTR) return false;
+    // the modems drain their own ports, deadlines are checked on every round
+    _pool->poll();
+    return true;
+}
+
+// The blocking call polls the pool itself, only wait for one of its ports.
+void Sim800CEpoll::idle(uint32_t ms)
+{
+    struct epoll_event ev[POOL_SIZE];
+
+    if (_ep>=0) epoll_wait(_ep,ev,POOL_SIZE,ms);
+}
+
+static const uint8_t gatewayUrcs[] = { Calling_with_number, Sms_received, RING, CUSD };
+
+thread_local Sim800CGateway::worker *Sim800CGateway::_worker = NULL;
+
+Sim800CGateway::Sim800CGateway()
+{
+    _count = 0;
+    _threads = 0;
+    _nextEvent = 0;
+    _running = false;
+    for (uint8_t i=0; i<GATEWAY_WORKERS; i++)
+    {
+        _workers[i].gateway = this;
+        _workers[i].count = 0;
+        _workers[i].dropped = 0;
+    }
+}
+
+Sim800CGateway::~Sim800CGateway()
+{
+    stop();
+    for (uint8_t i=0; i<_count; i++) delete _modems[i];
+}
+
+int8_t Sim800CGateway::addModem(const char *path,uint32_t baud)
+{
+    modem_slot *m;
+
+    if (_running || _count>=GATEWAY_MODEMS || strlen(path)>=sizeof(m->path)) return -1;
+    m=new modem_slot;
+    strcpy(m->path,path);
+    m->baud=baud;
+    m->tagHead=0;
+    m->tagCount=0;
+    for (uint8_t i=0; i<SMS_OUTBOX_SIZE; i++) m->outbox[i].used=false;
+    _modems[_count]=m;
+    return _count++;
+}
+
+uint8_t Sim800CGateway::count()
+{
+    return _count;
+}
+
+bool Sim800CGateway::start(uint8_t threads)
+{
+    uint8_t i;
+    worker *w;
+
+    if (_running || _count==0 || threads==0) return false;
+    if (threads>GATEWAY_WORKERS) threads=GATEWAY_WORKERS;
+    if (threads>_count) threads=_count;
+    if ((_count+threads-1)/threads>POOL_SIZE) return false;
+
+    for (i=0; i<_count; i++)
+    {
+        if (!_modems[i]->tty.open(_modems[i]->path,_modems[i]->baud)) break;
+    }
+    if (i<_count)
+    {
+        while (i--) _modems[i]->tty.close();
+        return false;
+    }
+
+    _threads=threads;
+    for (i=0; i<_count; i++)
+    {
+        w=&_workers[i%threads];
+        w->modems[w->count++]=i;
+    }
+    _running=true;
+    for (i=0; i<threads; i++)
+    {
+        w=&_workers[i];
+        w->thread=std::thread(&Sim800CGateway::_run,this,std::ref(*w));
+    }
+    return true;
+}
+
+void Sim800CGateway::stop()
+{
+    uint8_t i;
+
+    if (!_running) return;
+    _running=false;
+    for (i=0; i<_threads; i++) _workers[i].thread.join();
+    for (i=0; i<_count; i++) _modems[i]->tty.close();
+}
+
+bool Sim800CGateway::sendSms(uint8_t modem,const char *number,const char *text,uint32_t tag)
+{
+    gateway_request r;
+
+    if (modem>=_count || _threads==0 || strlen(number)>=sizeof(r.number) || strlen(text)>=sizeof(r.text)) return false;
+    r.kind=GATEWAY_SMS;
+    r.modem=modem;
+    r.tag=tag;
+    r.timeout=0;
+    strcpy(r.number,number);
+    strcpy(r.text,text);
+    return _workers[modem%_threads].requests.push(r);
+}
+
+bool Sim800CGateway::command(uint8_t modem,const char *cmd,uint32_t timeout,uint32_t tag)
+{
+    gateway_request r;
+
+    if (modem>=_count || _threads==0 || strlen(cmd)+2>=CMD_MAX_LENGTH) return false;
+    r.kind=GATEWAY_COMMAND;
+    r.modem=modem;
+    r.tag=tag;
+    r.timeout=timeout;
+    r.number[0]=0;
+    strcpy(r.text,cmd);
+    strcat(r.text,"\r\n");
+    return _workers[modem%_threads].requests.push(r);
+}
+
+// Round-robin over the workers so that a busy one does not starve the others.
+bool Sim800CGateway::event(gateway_event &e)
+{
+    uint8_t i;
+
+    for (i=0; i<_threads; i++)
+    {
+        worker &w=_workers[(_nextEvent+i)%_threads];
+        if (w.events.pop(e))
+        {
+            _nextEvent=(_nextEvent+i+1)%_threads;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t Sim800CGateway::dropped()
+{
+    uint32_t n=0;
+    for (uint8_t i=0; i<GATEWAY_WORKERS; i++) n+=_workers[i].dropped;
+    return n;
+}
+
+/*
+ * Worker thread: boots its modems in turn, each joins the pool and the epoll
+ * set before its Setup() so that the modems already up keep being serviced,
+ * and the boot waits in epoll rather than spinning. Then it sleeps in epoll
+ * and takes requests between rounds.
+ */
+void Sim800CGateway::_run(worker &w)
+{
+    Sim800CEpoll epoll(w.pool);
+    gateway_request r;
+    modem_slot *m;
+    uint8_t i,t;
+
+    _worker=&w;
+    for (i=0; i<w.count && _running; i++)
+    {
+        m=_modems[w.modems[i]];
+        for (t=0; t<sizeof(gatewayUrcs); t++) m->gsm.onUrc(gatewayUrcs[t],&Sim800CGateway::_urc);
+        m->gsm.setClock(epoll);
+        w.pool.add(m->gsm);
+        epoll.add(m->tty);
+        m->gsm.begin(m->tty,m->baud);
+        _event(w,GATEWAY_READY,w.modems[i],0,m->gsm.bootTiming().configured!=0 ? OK : ERROR);
+    }
+    while (_running)
+    {
+        while (w.requests.pop(r)) _request(w,r);
+        if (!epoll.run()) break;
+    }
+    // the epoll set goes with this thread
+    for (i=0; i<w.count; i++) _modems[w.modems[i]]->gsm.setClock(_clock);
+    _worker=NULL;
+}
+
+void Sim800CGateway::_request(worker &w,const gateway_request &r)
+{
+    modem_slot *m=_modems[r.modem];
+    sms_slot *s=NULL;
+    uint8_t i;
+
+    if (r.kind==GATEWAY_COMMAND)
+    {
+        if (m->tagCount>=CMD_QUEUE_SIZE || !m->gsm.submit(r.text,RESPON_OK,r.timeout,&Sim800CGateway::_commandDone))
+        {
+            _event(w,GATEWAY_COMMAND,r.modem,r.tag,CMD_ERROR);
+            return;
+        }
+        m->tags[(m->tagHead+m->tagCount)%CMD_QUEUE_SIZE]=r.tag;
+        m->tagCount++;
+        return;
+    }
+
+    for (i=0; i<SMS_OUTBOX_SIZE && s==NULL; i++)
+    {
+        if (!m->outbox[i].used) s=&m->outbox[i];
+    }
+    if (s==NULL)
+    {
+        _event(w,GATEWAY_SMS,r.modem,r.tag,ERROR);
+        return;
+    }
+    strcpy(s->number,r.number);
+    strcpy(s->text,r.text);
+    s->tag=r.tag;
+    if (!m->gsm.enqueueSms(s->number,s->text,&Sim800CGateway::_smsDone))
+    {
+        _event(w,GATEWAY_SMS,r.modem,r.tag,ERROR);
+        return;
+    }
+    s->used=true;
+}
+
+void Sim800CGateway::_event(worker &w,uint8_t kind,uint8_t modem,uint32_t tag,uint8_t result)
+{
+    gateway_event e;
+
+    e.kind=kind;
+    e.modem=modem;
+    e.tag=tag;
+    e.result=result;
+    e.type=0;
+    e.index=0;
+    e.text[0]=0;
+    if (!w.events.push(e)) w.dropped++;
+}
+
+uint8_t Sim800CGateway::_modemOf(Sim800C &gsm)
+{
+    worker *w=_worker;
+    uint8_t i;
+
+    for (i=0; i<w->count; i++)
+    {
+        if (&w->gateway->_modems[w->modems[i]]->gsm==&gsm) return w->modems[i];
+    }
+    return 0;
+}
+
+void Sim800CGateway::_urc(Sim800C &gsm,const urc_event &event)
+{
+    worker *w=_worker;
+    gateway_event e;
+
+    e.kind=GATEWAY_URC;
+    e.modem=_modemOf(gsm);
+    e.tag=0;
+    e.result=OK;
+    e.type=event.type;
+    e.index=event.index;
+    strncpy(e.text,event.text!=NULL ? event.text : "",URC_TEXT_SIZE-1);
+    e.text[URC_TEXT_SIZE-1]=0;
+    if (!w->events.push(e)) w->dropped++;
+}
+
+void Sim800CGateway::_commandDone(Sim800C &gsm,uint8_t result)
+{
+    worker *w=_worker;
+    uint8_t n=_modemOf(gsm);
+    modem_slot *m=w->gateway->_modems[n];
+    uint32_t tag=0;
+
+    if (m->tagCount)
+    {
+        tag=m->tags[m->tagHead];
+        m->tagHead=(m->tagHead+1)%CMD_QUEUE_SIZE;
+        m->tagCount--;
+    }
+    w->gateway->_event(*w,GATEWAY_COMMAND,n,tag,result);
+}
+
+void Sim800CGateway::_smsDone(Sim800C &gsm,const char * /*number*/,const char *text,uint8_t result,uint8_t reference)
+{
+    worker *w=_worker;
+    uint8_t n=_modemOf(gsm);
+    modem_slot *m=w->gateway->_modems[n];
+    gateway_event e;
+    uint8_t i;
+
+    for (i=0; i<SMS_OUTBOX_SIZE; i++)
+    {
+        if (!m->outbox[i].used || m->outbox[i].text!=text) continue;
+        m->outbox[i].used=false;
+        e.kind=GATEWAY_SMS;
+        e.modem=n;
+        e.tag=m->outbox[i].tag;
+        e.result=result;
+        e.type=0;
+        e.index=reference;
+        e.text[0]=0;
+        if (!w->events.push(e)) w->dropped++;
+        return;
+    }
+}
+
+#endif
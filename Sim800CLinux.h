@@ -0,0 +1,241 @@
+/*
+ *	LINUX HOST BUILD
+ *
+ *		Transport and clock for running the library against SIM800C modems on
+ *		/dev/ttyUSB* ports of a Linux gateway, and an epoll loop that services
+ *		a Sim800CPool only when one of its ports has data or a timeout is due.
+ *		Sim800CGateway spreads a bank of modems over a few worker threads, the
+ *		application talks to them through lock-free single producer / single
+ *		consumer queues.
+ *
+ *		Compiled only on Linux without the Arduino core, the host build
+ *		supplies its own Arduino.h (Stream, Print, String).
+*/
+
+#ifndef Sim800CLinux_h
+#define Sim800CLinux_h
+#if defined(__linux__) && !defined(ARDUINO)
+#include "Sim800C.h"
+#include <atomic>
+#include <thread>
+
+#define EPOLL_TICK				10		// ms between polls while no port has data, bounds command timeouts
+#define GATEWAY_MODEMS			64		// modems of one gateway
+#define GATEWAY_WORKERS			8		// worker threads, each with its own pool of up to POOL_SIZE modems
+#define GATEWAY_QUEUE_SIZE		64		// requests and events between the application and one worker, a power of two
+
+/*
+ * Bounded lock-free queue between exactly one producer thread and one
+ * consumer thread, N a power of two. Each side only writes its own index,
+ * the release store publishes the item, the acquire load on the other side
+ * makes it visible. push() refuses an item when full, pop() when empty.
+ */
+template <typename T,uint16_t N>
+class Sim800CSpsc
+{
+private:
+
+    T _items[N];
+    std::atomic<uint32_t> _head;		// next item to pop, written by the consumer
+    std::atomic<uint32_t> _tail;		// next free slot, written by the producer
+
+public:
+
+    Sim800CSpsc() : _head(0), _tail(0) {}
+
+    bool push(const T &item)
+    {
+        uint32_t tail=_tail.load(std::memory_order_relaxed);
+        if (tail-_head.load(std::memory_order_acquire)>=N) return false;
+        _items[tail&(N-1)]=item;
+        _tail.store(tail+1,std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        uint32_t head=_head.load(std::memory_order_relaxed);
+        if (head==_tail.load(std::memory_order_acquire)) return false;
+        item=_items[head&(N-1)];
+        _head.store(head+1,std::memory_order_release);
+        return true;
+    }
+
+    uint32_t size() const
+    {
+        return _tail.load(std::memory_order_acquire)-_head.load(std::memory_order_acquire);
+    }
+};
+
+// Serial port in raw mode with a non-blocking descriptor.
+class Sim800CTty : public Stream
+{
+private:
+
+    int _fd;
+    int _peek;				// byte read ahead by peek(), -1 when none
+
+public:
+
+    Sim800CTty();
+    ~Sim800CTty();
+
+    // path is a tty or the slave side of a pseudo terminal. false with errno EINVAL for a rate termios has no constant for.
+    bool open(const char *path,uint32_t baud);
+    void close();
+    int fd();
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buffer,size_t size);
+    using Print::write;
+};
+
+// CLOCK_MONOTONIC, unaffected by changes of the wall clock.
+class Sim800CLinuxClock : public Sim800CClock
+{
+public:
+
+    uint32_t millis();
+    void delay(uint32_t ms);
+};
+
+/*
+ * Sleeps in epoll_wait() until a port of the pool is readable, then polls the
+ * pool. One instance per thread, each with its own pool, spreads many modems
+ * over a few cores. It is also the clock of the pool's modems: their blocking
+ * calls, Setup() among them, idle in epoll_wait() instead of spinning.
+ */
+class Sim800CEpoll : public Sim800CLinuxClock
+{
+private:
+
+    int _ep;
+    Sim800CPool *_pool;
+
+public:
+
+    Sim800CEpoll(Sim800CPool &pool);
+    ~Sim800CEpoll();
+
+    bool add(Sim800CTty &tty);
+    // One wait of at most timeout ms and one round of polls, false on an epoll error.
+    bool run(uint32_t timeout=EPOLL_TICK);
+    void idle(uint32_t ms);
+};
+
+enum gateway_kind_enum
+{
+	GATEWAY_READY   = 0,		// event: Setup() of the modem finished, result OK or ERROR
+	GATEWAY_COMMAND = 1,		// request: submit() text, event: its result
+	GATEWAY_SMS     = 2,		// request: enqueueSms() number and text, event: its result and reference
+	GATEWAY_URC     = 3			// event: a URC, type / index / text as urc_event
+};
+
+struct gateway_request
+{
+    uint8_t kind;
+    uint8_t modem;
+    uint32_t tag;						// handed back in the event
+    uint32_t timeout;					// GATEWAY_COMMAND, ms
+    char number[SMS_NUMBER_SIZE+5];
+    char text[SMS_TEXT_SIZE];			// the message, or the command line of GATEWAY_COMMAND
+};
+
+struct gateway_event
+{
+    uint8_t kind;
+    uint8_t modem;
+    uint32_t tag;
+    uint8_t result;
+    uint8_t type;						// GATEWAY_URC
+    uint8_t index;
+    char text[URC_TEXT_SIZE];
+};
+
+/*
+ * A bank of modems on tty ports, each Setup() and serviced on a worker
+ * thread that sleeps in its Sim800CEpoll. Modems are spread round-robin over
+ * the workers; a modem and its Sim800C are only ever touched by its worker.
+ * One application thread submits requests and collects events: every worker
+ * has a request queue and an event queue, so each queue keeps one producer
+ * and one consumer. The library's callbacks carry no context, the worker
+ * finds itself through a thread local pointer.
+ */
+class Sim800CGateway
+{
+private:
+
+    struct sms_slot
+    {
+        bool used;
+        uint32_t tag;
+        char number[SMS_NUMBER_SIZE+5];
+        char text[SMS_TEXT_SIZE];
+    };
+
+    struct modem_slot
+    {
+        char path[64];
+        uint32_t baud;
+        Sim800CTty tty;
+        Sim800C gsm;
+        uint32_t tags[CMD_QUEUE_SIZE];	// of the GATEWAY_COMMANDs queued, the library finishes them in order
+        uint8_t tagHead;
+        uint8_t tagCount;
+        sms_slot outbox[SMS_OUTBOX_SIZE];	// the library keeps pointers to the text until it is sent
+    };
+
+    struct worker
+    {
+        Sim800CGateway *gateway;
+        std::thread thread;
+        Sim800CPool pool;
+        uint8_t modems[POOL_SIZE];
+        uint8_t count;
+        Sim800CSpsc<gateway_request,GATEWAY_QUEUE_SIZE> requests;
+        Sim800CSpsc<gateway_event,GATEWAY_QUEUE_SIZE> events;
+        std::atomic<uint32_t> dropped;	// events lost to a full queue
+    };
+
+    modem_slot *_modems[GATEWAY_MODEMS];
+    uint8_t _count;
+    worker _workers[GATEWAY_WORKERS];
+    uint8_t _threads;
+    uint8_t _nextEvent;
+    std::atomic<bool> _running;
+    Sim800CLinuxClock _clock;
+
+    void _run(worker &w);
+    void _request(worker &w,const gateway_request &r);
+    void _event(worker &w,uint8_t kind,uint8_t modem,uint32_t tag,uint8_t result);
+    static thread_local worker *_worker;	// of the calling thread, NULL outside the workers
+    static uint8_t _modemOf(Sim800C &gsm);
+    static void _urc(Sim800C &gsm,const urc_event &event);
+    static void _commandDone(Sim800C &gsm,uint8_t result);
+    static void _smsDone(Sim800C &gsm,const char *number,const char *text,uint8_t result,uint8_t reference);
+
+public:
+
+    Sim800CGateway();
+    ~Sim800CGateway();
+
+    // Before start(): the index of the modem, -1 when the bank is full.
+    int8_t addModem(const char *path,uint32_t baud=115200);
+    uint8_t count();
+    // Opens the ports and starts threads workers, a GATEWAY_READY event follows per modem.
+    bool start(uint8_t threads);
+    void stop();
+
+    // Application thread: false when the worker's request queue is full. cmd without its CR.
+    bool sendSms(uint8_t modem,const char *number,const char *text,uint32_t tag=0);
+    bool command(uint8_t modem,const char *cmd,uint32_t timeout,uint32_t tag=0);
+    // Application thread: the next event of any worker, false when there is none.
+    bool event(gateway_event &e);
+    uint32_t dropped();
+};
+
+#endif
+#endif
@@ -0,0 +1,350 @@
+#include "Sim800CMux.h"
+
+#define MUX_FLAG		0xF9
+#define MUX_EA			0x01
+#define MUX_CR			0x02
+#define MUX_PF			0x10
+
+// frame types, without the P/F bit
+#define MUX_SABM		0x2F
+#define MUX_UA			0x63
+#define MUX_DM			0x0F
+#define MUX_DISC		0x43
+#define MUX_UIH			0xEF
+
+// control channel message types, with EA, C/R set for a command
+#define MUX_MSC			0xE1
+#define MUX_CLD			0xC1
+#define MUX_SIGNALS		0x8D			// DV, RTR, RTC, EA of the modem status command
+
+enum mux_state_enum
+{
+	MUX_HUNT    = 0,		// for the opening flag
+	MUX_ADDRESS = 1,
+	MUX_CONTROL = 2,
+	MUX_LENGTH  = 3,
+	MUX_LENGTH2 = 4,
+	MUX_INFO    = 5,
+	MUX_FCS     = 6,
+	MUX_END     = 7
+};
+
+static Sim800CClock muxClock;
+
+// Reversed CRC-8 of TS 27.010, x^8+x^2+x+1, one byte at a time.
+static uint8_t muxFcs(uint8_t fcs,uint8_t b)
+{
+    uint8_t i;
+    fcs^=b;
+    for (i=0; i<8; i++) fcs=(fcs&1) ? (fcs>>1)^0xE0 : fcs>>1;
+    return fcs;
+}
+
+Sim800CMuxChannel::Sim800CMuxChannel()
+{
+    _mux = NULL;
+    _dlci = 0;
+    _open = false;
+    _txLen = 0;
+    dropped = 0;
+}
+
+bool Sim800CMuxChannel::isOpen()
+{
+    return _open;
+}
+
+int Sim800CMuxChannel::available()
+{
+    flush();
+    _mux->poll();
+    return _rx.available();
+}
+
+int Sim800CMuxChannel::read()
+{
+    if (_rx.available()==0) available();
+    return _rx.get();
+}
+
+int Sim800CMuxChannel::peek()
+{
+    if (_rx.available()==0) available();
+    return _rx.peek();
+}
+
+size_t Sim800CMuxChannel::write(uint8_t b)
+{
+    if (!_open) return 0;
+    _tx[_txLen++]=b;
+    if (_txLen>=MUX_TX_SIZE || b=='\n' || b==0x1A) flush();
+    return 1;
+}
+
+// Bulk data goes out in frames of MUX_FRAME_SIZE straight from the buffer.
+size_t Sim800CMuxChannel::write(const uint8_t *buffer,size_t size)
+{
+    size_t left=size;
+    uint16_t len;
+
+    if (!_open) return 0;
+    flush();
+    while (left)
+    {
+        len=left<MUX_FRAME_SIZE ? left : MUX_FRAME_SIZE;
+        _mux->_frame(_dlci,MUX_UIH,buffer,len);
+        buffer+=len;
+        left-=len;
+    }
+    return size;
+}
+
+void Sim800CMuxChannel::flush()
+{
+    if (_txLen==0) return;
+    _mux->_frame(_dlci,MUX_UIH,_tx,_txLen);
+    _txLen=0;
+}
+
+Sim800CMux::Sim800CMux()
+{
+    uint8_t i;
+    _serial = NULL;
+    _clock = &muxClock;
+    _control = false;
+    _state = MUX_HUNT;
+    badFrames = 0;
+    for (i=0; i<MUX_CHANNELS; i++)
+    {
+        _channels[i]._mux = this;
+        _channels[i]._dlci = i+1;
+    }
+}
+
+void Sim800CMux::begin(Stream &serial)
+{
+    _serial = &serial;
+}
+
+void Sim800CMux::setClock(Sim800CClock &clock)
+{
+    _clock = &clock;
+}
+
+bool Sim800CMux::start(uint8_t channels)
+{
+    static const char ok[]="OK\r\n";
+    uint8_t matched=0;
+    uint32_t start;
+    int ch;
+
+    while (_serial->available()) _serial->read();
+    _serial->print(F("AT+CMUX=0\r\n"));
+    start=_clock->millis();
+    while (ok[matched])
+    {
+        if (_clock->millis()-start>=MUX_TIMEOUT) return false;
+        ch=_serial->read();
+        if (ch<0) continue;
+        if (ch==ok[matched])  matched++;
+        else if (ch==ok[0])   matched=1;
+        else                  matched=0;
+    }
+    return open(channels);
+}
+
+bool Sim800CMux::open(uint8_t channels)
+{
+    uint8_t i;
+
+    _state=MUX_HUNT;
+    if (!_establish(0,&_control)) return false;
+    if (channels>MUX_CHANNELS) channels=MUX_CHANNELS;
+    for (i=0; i<channels; i++)
+    {
+        if (!_establish(i+1,&_channels[i]._open)) return false;
+        _msc(i+1);
+    }
+    return true;
+}
+
+void Sim800CMux::close()
+{
+    static const uint8_t cld[]={ MUX_CLD|MUX_CR, MUX_EA };
+    uint8_t i;
+
+    if (!_control) return;
+    for (i=0; i<MUX_CHANNELS; i++)
+    {
+        _channels[i].flush();
+        _channels[i]._open=false;
+    }
+    _frame(0,MUX_UIH,cld,sizeof(cld));
+    _control=false;
+}
+
+Sim800CMuxChannel &Sim800CMux::channel(uint8_t n)
+{
+    return _channels[n<MUX_CHANNELS ? n : MUX_CHANNELS-1];
+}
+
+void Sim800CMux::poll()
+{
+    while (_serial->available()) _byte((uint8_t)_serial->read());
+}
+
+// SABM and wait for its UA, *open is set by _received().
+bool Sim800CMux::_establish(uint8_t dlci,bool *open)
+{
+    uint32_t start=_clock->millis();
+
+    _frame(dlci,MUX_SABM|MUX_PF,NULL,0);
+    while (!*open)
+    {
+        if (_clock->millis()-start>=MUX_TIMEOUT) return false;
+        poll();
+    }
+    return true;
+}
+
+// Modem status of the channel: ready to send and receive.
+void Sim800CMux::_msc(uint8_t dlci)
+{
+    uint8_t msg[4];
+    msg[0]=MUX_MSC|MUX_CR;
+    msg[1]=(2<<1)|MUX_EA;
+    msg[2]=(dlci<<2)|MUX_CR|MUX_EA;
+    msg[3]=MUX_SIGNALS;
+    _frame(0,MUX_UIH,msg,sizeof(msg));
+}
+
+// Write one frame of ours, a command: C/R set. The FCS of UIH leaves out the information.
+void Sim800CMux::_frame(uint8_t dlci,uint8_t ctrl,const uint8_t *data,uint16_t len)
+{
+    uint8_t head[5];
+    uint8_t fcs=0xFF;
+    uint8_t n=0,i;
+
+    head[n++]=MUX_FLAG;
+    head[n++]=(dlci<<2)|MUX_CR|MUX_EA;
+    head[n++]=ctrl;
+    if (len<=127) head[n++]=(len<<1)|MUX_EA;
+    else
+    {
+        head[n++]=len<<1;
+        head[n++]=len>>7;
+    }
+    for (i=1; i<n; i++) fcs=muxFcs(fcs,head[i]);
+    _serial->write(head,n);
+    if (len) _serial->write(data,len);
+    _serial->write((uint8_t)(0xFF-fcs));
+    _serial->write((uint8_t)MUX_FLAG);
+}
+
+/*
+ * Receive state machine. Information of a channel goes straight into its
+ * ring, the ring is not rolled back when the FCS turns out wrong since UIH
+ * leaves the information out of it. Repeated flags between frames are skipped.
+ */
+void Sim800CMux::_byte(uint8_t b)
+{
+    uint8_t dlci;
+
+    switch (_state)
+    {
+    case MUX_HUNT:
+        if (b==MUX_FLAG) _state=MUX_ADDRESS;
+        break;
+
+    case MUX_ADDRESS:
+        if (b==MUX_FLAG) break;
+        _address=b;
+        _fcs=muxFcs(0xFF,b);
+        _state=MUX_CONTROL;
+        break;
+
+    case MUX_CONTROL:
+        _ctrl=b;
+        _fcs=muxFcs(_fcs,b);
+        _state=MUX_LENGTH;
+        break;
+
+    case MUX_LENGTH:
+        _fcs=muxFcs(_fcs,b);
+        _len=b>>1;
+        _pos=0;
+        if (!(b&MUX_EA))   _state=MUX_LENGTH2;
+        else if (_len)     _state=MUX_INFO;
+        else               _state=MUX_FCS;
+        break;
+
+    case MUX_LENGTH2:
+        _fcs=muxFcs(_fcs,b);
+        _len|=(uint16_t)b<<7;
+        _state=_len ? MUX_INFO : MUX_FCS;
+        break;
+
+    case MUX_INFO:
+        dlci=_address>>2;
+        if (_pos<sizeof(_info)) _info[_pos]=b;
+        if (dlci>=1 && dlci<=MUX_CHANNELS)
+        {
+            Sim800CMuxChannel *c=&_channels[dlci-1];
+            if (!c->_rx.put(b)) c->dropped++;
+        }
+        if (++_pos>=_len) _state=MUX_FCS;
+        break;
+
+    case MUX_FCS:
+        _state=MUX_END;
+        if (muxFcs(_fcs,b)==0xCF) _received();
+        else                      badFrames++;
+        break;
+
+    case MUX_END:
+        // the closing flag, which may also open the next frame
+        _state=(b==MUX_FLAG) ? MUX_ADDRESS : MUX_HUNT;
+        break;
+    }
+}
+
+void Sim800CMux::_received()
+{
+    uint8_t dlci=_address>>2;
+    bool *open=NULL;
+
+    if (dlci==0)                 open=&_control;
+    else if (dlci<=MUX_CHANNELS) open=&_channels[dlci-1]._open;
+    if (open==NULL) return;
+
+    switch (_ctrl & ~MUX_PF)
+    {
+    case MUX_UA:
+        *open=true;
+        break;
+
+    case MUX_DM:
+    case MUX_DISC:
+        *open=false;
+        break;
+
+    case MUX_UIH:
+        if (dlci==0) _controlMessage();
+        break;
+    }
+}
+
+// Control channel commands of the modem get their response, the same message with C/R clear.
+void Sim800CMux::_controlMessage()
+{
+    uint8_t len=_len<sizeof(_info) ? _len : sizeof(_info);
+
+    if (len<2 || !(_info[0]&MUX_CR)) return;
+    if ((_info[0]&~MUX_CR)==MUX_CLD)
+    {
+        _control=false;
+        for (uint8_t i=0; i<MUX_CHANNELS; i++) _channels[i]._open=false;
+    }
+    _info[0]&=~MUX_CR;
+    _frame(0,MUX_UIH,_info,len);
+}
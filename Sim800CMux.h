@@ -0,0 +1,111 @@
+/*
+ *	GSM 07.10 MULTIPLEXER
+ *
+ *		Basic mode framer of AT+CMUX: the one serial link to the modem carries
+ *		MUX_CHANNELS virtual channels, each of them a Stream of its own. A
+ *		Sim800C begun on each channel keeps its own parser and command queue,
+ *		so URCs on one channel are seen while another one waits 60 s for a
+ *		message to go out or streams data.
+ *
+ *		Sim800C gsm,sms;
+ *		Sim800CMux mux;
+ *		Serial1.begin(115200);
+ *		mux.begin(Serial1);
+ *		mux.start();					// AT+CMUX=0, then the channels are opened
+ *		gsm.begin(mux.channel(0),115200);	// the rate of the link, no AT+IPR
+ *		sms.begin(mux.channel(1),115200);
+*/
+
+#ifndef Sim800CMux_h
+#define Sim800CMux_h
+#include "Sim800C.h"
+
+#define MUX_CHANNELS			3		// virtual channels, DLCI 1 to 3, the SIM800 has up to 4
+#define MUX_FRAME_SIZE			127		// N1, information bytes per frame, the SIM800 default
+#define MUX_RX_SIZE				128		// receive ring of each channel
+#define MUX_TX_SIZE				32		// bytes of a channel sent together, flushed at a line end
+#define MUX_TIMEOUT				3000	// ms for the UA of a SABM or DISC
+
+class Sim800CMux;
+
+/*
+ * One DLCI. Writes are collected and sent in one UIH frame at a line end,
+ * Ctrl-Z, a full buffer, flush() or the next read. Reading services the
+ * multiplexer, bytes that do not fit the ring are counted in dropped.
+ */
+class Sim800CMuxChannel : public Stream
+{
+private:
+
+    friend class Sim800CMux;
+
+    Sim800CMux *_mux;
+    uint8_t _dlci;
+    bool _open;
+    Sim800CRing<MUX_RX_SIZE> _rx;
+    uint8_t _tx[MUX_TX_SIZE];
+    uint8_t _txLen;
+
+public:
+
+    uint16_t dropped;
+
+    Sim800CMuxChannel();
+
+    bool isOpen();
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buffer,size_t size);
+    void flush();
+    using Print::write;
+};
+
+class Sim800CMux
+{
+private:
+
+    friend class Sim800CMuxChannel;
+
+    Stream *_serial;
+    Sim800CClock *_clock;
+    Sim800CMuxChannel _channels[MUX_CHANNELS];
+    bool _control;				// DLCI 0 is open
+
+    // receive state of the frame being parsed
+    uint8_t _state;
+    uint8_t _address;
+    uint8_t _ctrl;
+    uint16_t _len;
+    uint16_t _pos;
+    uint8_t _fcs;
+    uint8_t _info[8];			// start of a control channel message
+
+    void _frame(uint8_t dlci,uint8_t ctrl,const uint8_t *data,uint16_t len);
+    void _byte(uint8_t b);
+    void _received();
+    void _controlMessage();
+    void _msc(uint8_t dlci);
+    bool _establish(uint8_t dlci,bool *open);
+
+public:
+
+    uint16_t badFrames;
+
+    Sim800CMux();
+
+    void begin(Stream &serial);
+    void setClock(Sim800CClock &clock);
+    // AT+CMUX=0 on the link, then open(), false when the modem refused it.
+    bool start(uint8_t channels=MUX_CHANNELS);
+    // DLCI 0 and then the channels, on a link already in multiplexer mode.
+    bool open(uint8_t channels=MUX_CHANNELS);
+    // Close down, the link returns to AT commands.
+    void close();
+    Sim800CMuxChannel &channel(uint8_t n);
+    // Demultiplex what the link holds into the channels, reading a channel does it too.
+    void poll();
+};
+
+#endif
@@ -0,0 +1,643 @@
+/*
+ *	PDU MODE SMS
+ *
+ *		Encoder and streaming decoder of SMS-SUBMIT / SMS-DELIVER PDUs (3GPP TS 23.040)
+ *		with the concatenation user data header, and the RAM cache that
+ *		reassembles the parts of a long message.
+*/
+
+#include "Arduino.h"
+#include "Sim800CPdu.h"
+
+#define GSM_ESCAPE		0x1B
+#define PDU_VALIDITY	167		// relative validity period, same as AT+CSMP=17,167,0,0
+
+enum pdu_state_enum
+{
+	PDU_SMSC_LEN = 0,
+	PDU_SMSC,
+	PDU_FO,
+	PDU_OA_LEN,
+	PDU_OA_TYPE,
+	PDU_OA,
+	PDU_PID,
+	PDU_DCS,
+	PDU_SCTS,
+	PDU_UDL,
+	PDU_UD,
+	PDU_DONE
+};
+
+enum pdu_alphabet_enum
+{
+	ALPHABET_GSM7 = 0,
+	ALPHABET_8BIT = 1,
+	ALPHABET_UCS2 = 2
+};
+
+/*
+ * ASCII to the GSM 7 bit default alphabet. Most printable characters share
+ * their code, the others are remapped, escaped or replaced by '?'.
+ */
+static uint8_t asciiToGsm(char c,bool *escape)
+{
+    *escape=false;
+    switch (c)
+    {
+    case '@':  return 0x00;
+    case '$':  return 0x02;
+    case '_':  return 0x11;
+    case '`':  return '?';
+    case '^':  *escape=true; return 0x14;
+    case '{':  *escape=true; return 0x28;
+    case '}':  *escape=true; return 0x29;
+    case '\\': *escape=true; return 0x2F;
+    case '[':  *escape=true; return 0x3C;
+    case '~':  *escape=true; return 0x3D;
+    case ']':  *escape=true; return 0x3E;
+    case '|':  *escape=true; return 0x40;
+    }
+    if (c=='\n' || c=='\r') return c;
+    if (c<0x20 || c>0x7E)   return '?';
+    return c;
+}
+
+static char gsmToAscii(uint8_t c,bool escape)
+{
+    if (escape)
+    {
+        switch (c)
+        {
+        case 0x14: return '^';
+        case 0x28: return '{';
+        case 0x29: return '}';
+        case 0x2F: return '\\';
+        case 0x3C: return '[';
+        case 0x3D: return '~';
+        case 0x3E: return ']';
+        case 0x40: return '|';
+        }
+        return '?';
+    }
+    switch (c)
+    {
+    case 0x00: return '@';
+    case 0x02: return '$';
+    case 0x11: return '_';
+    case 0x0A: return '\n';
+    case 0x0D: return '\r';
+    case 0x24: case 0x40: case 0x60:
+        return '?';
+    }
+    if (c<0x20 || (c>=0x5B && c<=0x5F) || c>=0x7B) return '?';
+    return c;
+}
+
+static uint8_t septetsOf(char c)
+{
+    bool escape;
+    asciiToGsm(c,&escape);
+    return escape ? 2 : 1;
+}
+
+uint16_t pduSeptets(const char *text)
+{
+    uint16_t n=0;
+    while (*text) n+=septetsOf(*text++);
+    return n;
+}
+
+const char *pduSegment(const char *text,uint8_t maxSeptets,uint8_t *septets)
+{
+    uint8_t n=0,w;
+    while (*text)
+    {
+        w=septetsOf(*text);
+        if (n+w>maxSeptets) break;		// an escape pair is never split
+        n+=w;
+        text++;
+    }
+    *septets=n;
+    return text;
+}
+
+static uint8_t numberDigits(const char *number)
+{
+    uint8_t n=0;
+    for (; *number; number++)
+    {
+        if (*number>='0' && *number<='9') n++;
+    }
+    return n;
+}
+
+uint8_t pduSubmitLength(const char *number,uint8_t septets,bool concatenated)
+{
+    uint16_t udl=septets+(concatenated ? 7 : 0);
+    // fo, mr, address length, type of address, digits, pid, dcs, vp, udl, user data
+    return 4+(numberDigits(number)+1)/2+4+(udl*7+7)/8;
+}
+
+static const char hexDigits[] PROGMEM = "0123456789ABCDEF";
+
+static void hexOctet(Print &out,uint8_t o)
+{
+    out.write(pgm_read_byte(&hexDigits[o>>4]));
+    out.write(pgm_read_byte(&hexDigits[o&0x0F]));
+}
+
+/*
+ * The PDU is written to out as it is built, nothing is buffered besides the
+ * septet packer's few bits.
+ */
+uint16_t pduWriteSubmit(Print &out,const char *number,const char *text,const char *end,uint8_t ref,uint8_t total,uint8_t seq)
+{
+    uint8_t digits[2],n=0,v,septets=0;
+    uint16_t acc=0,written;
+    uint8_t bits=0;
+    bool escape;
+    const char *p;
+
+    for (p=text; p<end; p++) septets+=septetsOf(*p);
+
+    hexOctet(out,0x00);							// SMSC from the SIM
+    hexOctet(out,total ? 0x51 : 0x11);			// SMS-SUBMIT, relative VP, UDHI
+    hexOctet(out,0x00);							// message reference set by the modem
+    hexOctet(out,numberDigits(number));
+    hexOctet(out,number[0]=='+' ? 0x91 : 0x81);
+    for (p=number; *p; p++)
+    {
+        if (*p<'0' || *p>'9') continue;
+        digits[n++]=*p-'0';
+        if (n==2)
+        {
+            hexOctet(out,(digits[1]<<4)|digits[0]);
+            n=0;
+        }
+    }
+    if (n) hexOctet(out,0xF0|digits[0]);
+    hexOctet(out,0x00);							// PID
+    hexOctet(out,0x00);							// DCS, GSM 7 bit
+    hexOctet(out,PDU_VALIDITY);
+    hexOctet(out,septets+(total ? 7 : 0));
+    written=2*(9+(numberDigits(number)+1)/2);
+
+    if (total)
+    {
+        hexOctet(out,0x05);						// UDHL
+        hexOctet(out,0x00);						// IEI concatenated, 8 bit reference
+        hexOctet(out,0x03);
+        hexOctet(out,ref);
+        hexOctet(out,total);
+        hexOctet(out,seq);
+        written+=12;
+        bits=1;									// fill bit, text starts on a septet boundary
+    }
+
+    for (p=text; p<end; p++)
+    {
+        v=asciiToGsm(*p,&escape);
+        if (escape)
+        {
+            acc|=(uint16_t)GSM_ESCAPE<<bits;
+            bits+=7;
+            if (bits>=8) { hexOctet(out,acc&0xFF); acc>>=8; bits-=8; written+=2; }
+        }
+        acc|=(uint16_t)v<<bits;
+        bits+=7;
+        if (bits>=8) { hexOctet(out,acc&0xFF); acc>>=8; bits-=8; written+=2; }
+    }
+    if (bits)
+    {
+        hexOctet(out,acc&0xFF);
+        written+=2;
+    }
+    return written;
+}
+
+void Sim800CPduDecoder::begin(char *number,uint8_t numberSize,char *text,uint16_t textSize)
+{
+    _number=number;
+    _numberSize=numberSize;
+    _numberLen=0;
+    _text=text;
+    _textSize=textSize;
+    if (_numberSize) _number[0]=0;
+    if (_textSize)   _text[0]=0;
+
+    _state=PDU_SMSC_LEN;
+    _hi=0xFF;
+    _escape=false;
+    _ucs2High=false;
+    textLen=0;
+    truncated=false;
+    ref=0;
+    total=0;
+    seq=0;
+}
+
+bool Sim800CPduDecoder::done()
+{
+    return _state==PDU_DONE;
+}
+
+void Sim800CPduDecoder::put(char hex)
+{
+    uint8_t n;
+    if      (hex>='0' && hex<='9') n=hex-'0';
+    else if (hex>='A' && hex<='F') n=hex-'A'+10;
+    else if (hex>='a' && hex<='f') n=hex-'a'+10;
+    else return;
+
+    if (_hi==0xFF)
+    {
+        _hi=n;
+        return;
+    }
+    n|=_hi<<4;
+    _hi=0xFF;
+    if (_state!=PDU_DONE) _octet(n);
+}
+
+void Sim800CPduDecoder::_putNumber(char c)
+{
+    if (_numberLen+1<_numberSize)
+    {
+        _number[_numberLen++]=c;
+        _number[_numberLen]=0;
+    }
+    else truncated=true;
+}
+
+void Sim800CPduDecoder::_putText(char c)
+{
+    if (textLen+1<_textSize)
+    {
+        _text[textLen++]=c;
+        _text[textLen]=0;
+    }
+    else truncated=true;
+}
+
+void Sim800CPduDecoder::_octet(uint8_t o)
+{
+    switch (_state)
+    {
+    case PDU_SMSC_LEN:
+        _count=o;
+        _state=o ? PDU_SMSC : PDU_FO;
+        break;
+
+    case PDU_SMSC:
+        if (--_count==0) _state=PDU_FO;
+        break;
+
+    case PDU_FO:
+        _fo=o;
+        _state=PDU_OA_LEN;
+        break;
+
+    case PDU_OA_LEN:
+        _oaLen=o;
+        _state=PDU_OA_TYPE;
+        break;
+
+    case PDU_OA_TYPE:
+        _oaType=o;
+        _count=(_oaLen+1)/2;
+        _acc=0;
+        _bits=0;
+        _septet=0;
+        if ((_oaType&0x70)==0x10) _putNumber('+');
+        _state=_count ? PDU_OA : PDU_PID;
+        break;
+
+    case PDU_OA:
+        _sender(o);
+        if (--_count==0) _state=PDU_PID;
+        break;
+
+    case PDU_PID:
+        _state=PDU_DCS;
+        break;
+
+    case PDU_DCS:
+        _dcs=o;
+        _count=7;
+        _state=PDU_SCTS;
+        break;
+
+    case PDU_SCTS:
+        if (--_count==0) _state=PDU_UDL;
+        break;
+
+    case PDU_UDL:
+        _udl=o;
+        if ((_dcs&0xC0)==0x00)      _dcs=(_dcs>>2)&0x03;
+        else if ((_dcs&0xF0)==0xE0) _dcs=ALPHABET_UCS2;	// message waiting, UCS2 text
+        else if ((_dcs&0xF0)==0xF0) _dcs=(_dcs&0x04) ? ALPHABET_8BIT : ALPHABET_GSM7;
+        else                        _dcs=ALPHABET_GSM7;
+        _udOctets=(_dcs==ALPHABET_GSM7) ? (_udl*7+7)/8 : _udl;
+        _udPos=0;
+        _udhLen=0;
+        _udhPos=0;
+        _skip=0;
+        _septet=0;
+        _acc=0;
+        _bits=0;
+        _state=_udOctets ? PDU_UD : PDU_DONE;
+        break;
+
+    case PDU_UD:
+        _userData(o);
+        if (--_udOctets==0) _state=PDU_DONE;
+        break;
+    }
+}
+
+// Originating address: BCD semi-octets, or packed GSM 7 bit for an alphanumeric sender.
+void Sim800CPduDecoder::_sender(uint8_t o)
+{
+    if ((_oaType&0x70)==0x50)
+    {
+        _acc|=(uint16_t)o<<_bits;
+        _bits+=8;
+        while (_bits>=7)
+        {
+            if (_septet<_oaLen*4/7) _putNumber(gsmToAscii(_acc&0x7F,false));
+            _septet++;
+            _acc>>=7;
+            _bits-=7;
+        }
+        return;
+    }
+    if ((o&0x0F)<10) _putNumber('0'+(o&0x0F));
+    if ((o>>4)<10)   _putNumber('0'+(o>>4));
+}
+
+void Sim800CPduDecoder::_userData(uint8_t o)
+{
+    uint8_t pos=_udPos++;
+    uint16_t u;
+
+    if ((_fo&0x40) && pos==0)
+    {
+        _udhLen=o;
+        if (_dcs==ALPHABET_GSM7) _skip=((_udhLen+1)*8+6)/7;
+    }
+    else if ((_fo&0x40) && pos<=_udhLen)
+    {
+        // information elements, only the concatenation ones are kept
+        if (_udhPos<sizeof(_udh)) _udh[_udhPos]=o;
+        _udhPos++;
+        if (_udhPos>=2 && _udhPos==_udh[1]+2)
+        {
+            if (_udh[0]==0x00 && _udh[1]==3)
+            {
+                ref=_udh[2];
+                total=_udh[3];
+                seq=_udh[4];
+            }
+            else if (_udh[0]==0x08 && _udh[1]==4)
+            {
+                ref=((uint16_t)_udh[2]<<8)|_udh[3];
+                total=_udh[4];
+                seq=_udh[5];
+            }
+            _udhPos=0;
+        }
+    }
+
+    if (_dcs==ALPHABET_GSM7)
+    {
+        // every octet, header included, feeds the septet stream
+        _acc|=(uint16_t)o<<_bits;
+        _bits+=8;
+        while (_bits>=7)
+        {
+            if (_septet>=_skip && _septet<_udl) _gsmChar(_acc&0x7F);
+            _septet++;
+            _acc>>=7;
+            _bits-=7;
+        }
+        return;
+    }
+    if ((_fo&0x40) && pos<=_udhLen) return;
+
+    if (_dcs==ALPHABET_8BIT)
+    {
+        _putText(o);
+        return;
+    }
+
+    // UCS2 to UTF-8
+    if (!_ucs2High)
+    {
+        _ucs2=(uint16_t)o<<8;
+        _ucs2High=true;
+        return;
+    }
+    _ucs2High=false;
+    u=_ucs2|o;
+    if (u<0x80)
+    {
+        _putText(u);
+    }
+    else if (u<0x800)
+    {
+        _putText(0xC0|(u>>6));
+        _putText(0x80|(u&0x3F));
+    }
+    else
+    {
+        _putText(0xE0|(u>>12));
+        _putText(0x80|((u>>6)&0x3F));
+        _putText(0x80|(u&0x3F));
+    }
+}
+
+void Sim800CPduDecoder::_gsmChar(uint8_t c)
+{
+    if (!_escape && c==GSM_ESCAPE)
+    {
+        _escape=true;
+        return;
+    }
+    _putText(gsmToAscii(c,_escape));
+    _escape=false;
+}
+
+/*
+ * The pool holds the parts back to back, each one a sms_part header followed
+ * by senderLen bytes of sender and len bytes of text. The key only filters,
+ * parts belong to the same message when the sender itself matches.
+ */
+struct sms_part
+{
+    uint16_t key;
+    uint16_t ref;
+    uint8_t total;
+    uint8_t seq;
+    uint8_t senderLen;
+    uint8_t len;
+    uint32_t stamp;
+};
+
+static uint16_t senderKey(const char *sender)
+{
+    uint16_t h=5381;
+    while (*sender) h=h*33+(uint8_t)*sender++;
+    return h;
+}
+
+static uint8_t senderLength(const char *sender)
+{
+    size_t n=strlen(sender);
+    return n>SMS_SENDER_SIZE ? SMS_SENDER_SIZE : (uint8_t)n;
+}
+
+Sim800CSmsCache::Sim800CSmsCache()
+{
+    _used=0;
+}
+
+void Sim800CSmsCache::clear()
+{
+    _used=0;
+}
+
+bool Sim800CSmsCache::_same(uint16_t pos,const char *sender,uint16_t key,uint16_t ref)
+{
+    sms_part part;
+    memcpy(&part,_pool+pos,sizeof(part));
+    return part.key==key && part.ref==ref && part.senderLen==senderLength(sender) &&
+           memcmp(_pool+pos+sizeof(part),sender,part.senderLen)==0;
+}
+
+// Position of a part, any part of the message when seq is 0. 0xFFFF when missing.
+uint16_t Sim800CSmsCache::_find(const char *sender,uint16_t key,uint16_t ref,uint8_t seq)
+{
+    sms_part part;
+    uint16_t pos=0;
+    while (pos<_used)
+    {
+        memcpy(&part,_pool+pos,sizeof(part));
+        if ((seq==0 || part.seq==seq) && _same(pos,sender,key,ref)) return pos;
+        pos+=sizeof(part)+part.senderLen+part.len;
+    }
+    return 0xFFFF;
+}
+
+void Sim800CSmsCache::_remove(const char *sender,uint16_t key,uint16_t ref)
+{
+    sms_part part;
+    uint16_t pos=0,size;
+    while (pos<_used)
+    {
+        memcpy(&part,_pool+pos,sizeof(part));
+        size=sizeof(part)+part.senderLen+part.len;
+        if (_same(pos,sender,key,ref))
+        {
+            memmove(_pool+pos,_pool+pos+size,_used-pos-size);
+            _used-=size;
+        }
+        else pos+=size;
+    }
+}
+
+bool Sim800CSmsCache::_evictOldest()
+{
+    sms_part part,oldest;
+    char sender[SMS_SENDER_SIZE+1];
+    uint16_t pos=0,at=0;
+    if (_used==0) return false;
+    memcpy(&oldest,_pool,sizeof(oldest));
+    while (pos<_used)
+    {
+        memcpy(&part,_pool+pos,sizeof(part));
+        if ((int32_t)(part.stamp-oldest.stamp)<0)
+        {
+            oldest=part;
+            at=pos;
+        }
+        pos+=sizeof(part)+part.senderLen+part.len;
+    }
+    memcpy(sender,_pool+at+sizeof(oldest),oldest.senderLen);
+    sender[oldest.senderLen]=0;
+    _remove(sender,oldest.key,oldest.ref);
+    return true;
+}
+
+bool Sim800CSmsCache::add(const char *sender,uint16_t ref,uint8_t total,uint8_t seq,const char *text,uint16_t len,uint32_t now)
+{
+    sms_part part;
+    uint16_t pos,key=senderKey(sender);
+    uint8_t parts=0,senderLen=senderLength(sender);
+
+    if (len>255) len=255;
+    if (sizeof(part)+senderLen+len>SMS_CACHE_SIZE) return false;
+
+    if (_find(sender,key,ref,seq)==0xFFFF)		// a repeated part is stored once
+    {
+        while (_used+sizeof(part)+senderLen+len>SMS_CACHE_SIZE)
+        {
+            if (!_evictOldest()) return false;
+        }
+        part.key=key;
+        part.ref=ref;
+        part.total=total;
+        part.seq=seq;
+        part.senderLen=senderLen;
+        part.len=len;
+        part.stamp=now;
+        memcpy(_pool+_used,&part,sizeof(part));
+        memcpy(_pool+_used+sizeof(part),sender,senderLen);
+        memcpy(_pool+_used+sizeof(part)+senderLen,text,len);
+        _used+=sizeof(part)+senderLen+len;
+    }
+
+    // refresh the whole message and count its parts
+    for (pos=0; pos<_used; pos+=sizeof(part)+part.senderLen+part.len)
+    {
+        memcpy(&part,_pool+pos,sizeof(part));
+        if (!_same(pos,sender,key,ref)) continue;
+        part.stamp=now;
+        memcpy(_pool+pos,&part,sizeof(part));
+        parts++;
+    }
+    return parts>=total;
+}
+
+uint16_t Sim800CSmsCache::take(const char *sender,uint16_t ref,char *text,uint16_t textSize,bool *truncated)
+{
+    sms_part part;
+    uint16_t pos,len=0,n,key=senderKey(sender);
+    uint8_t seq;
+
+    *truncated=false;
+    if (textSize==0) return 0;
+    pos=_find(sender,key,ref,0);
+    if (pos==0xFFFF)
+    {
+        text[0]=0;
+        return 0;
+    }
+    memcpy(&part,_pool+pos,sizeof(part));
+    for (seq=1; seq<=part.total; seq++)
+    {
+        pos=_find(sender,key,ref,seq);
+        if (pos==0xFFFF) continue;
+        memcpy(&part,_pool+pos,sizeof(part));
+        n=part.len;
+        if (len+n+1>textSize)
+        {
+            n=textSize-1-len;
+            *truncated=true;
+        }
+        memcpy(text+len,_pool+pos+sizeof(part)+part.senderLen,n);
+        len+=n;
+    }
+    text[len]=0;
+    _remove(sender,key,ref);
+    return len;
+}
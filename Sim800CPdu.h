@@ -0,0 +1,117 @@
+/*
+ *	PDU MODE SMS
+ *
+ *		Encoder and streaming decoder of SMS-SUBMIT / SMS-DELIVER PDUs (3GPP TS 23.040)
+ *		with the concatenation user data header, and the RAM cache that
+ *		reassembles the parts of a long message.
+ *
+ *		Only the GSM 7 bit default alphabet is encoded. The decoder also handles
+ *		8 bit data and UCS2, which is converted to UTF-8.
+*/
+
+#ifndef Sim800CPdu_h
+#define Sim800CPdu_h
+#include "Arduino.h"
+
+#define SMS_SEGMENT_SEPTETS		153		// text septets of one part of a concatenated message
+#define SMS_SINGLE_SEPTETS		160		// text septets of a message sent in one piece
+#define SMS_CACHE_SIZE			480		// bytes of RAM for parts waiting for the rest of their message
+#define SMS_SENDER_SIZE			21		// sender characters kept with each cached part
+
+// GSM 7 bit septets needed by text, escaped characters take two.
+uint16_t pduSeptets(const char *text);
+
+// End of the part of text that starts at text and fits in maxSeptets, *septets gets its size.
+const char *pduSegment(const char *text,uint8_t maxSeptets,uint8_t *septets);
+
+// TPDU length of an SMS-SUBMIT, the value of AT+CMGS=<length> in PDU mode.
+uint8_t pduSubmitLength(const char *number,uint8_t septets,bool concatenated);
+
+// Write the SMS-SUBMIT of [text,end) as hex digits, total 0 for a single part message.
+uint16_t pduWriteSubmit(Print &out,const char *number,const char *text,const char *end,uint8_t ref,uint8_t total,uint8_t seq);
+
+/*
+ * Decoder of one SMS-DELIVER fed with the hex digits of the +CMGR line, one at
+ * a time. The sender and the text are written straight into the caller's
+ * buffers, never more than their sizes. total is 0 for a single part message.
+ */
+class Sim800CPduDecoder
+{
+private:
+
+    char *_number;
+    uint8_t _numberSize;
+    uint8_t _numberLen;
+    char *_text;
+    uint16_t _textSize;
+
+    uint8_t _state;
+    uint8_t _count;				// octets left in the current field
+    uint8_t _hi;				// first hex digit of the octet, 0xFF when none
+    uint8_t _fo;
+    uint8_t _oaLen;
+    uint8_t _oaType;
+    uint8_t _dcs;
+    uint8_t _udl;
+    uint8_t _udOctets;
+    uint8_t _udPos;
+    uint8_t _udhLen;
+    uint8_t _udhPos;
+    uint8_t _udh[6];
+    uint8_t _skip;				// septets taken by the user data header
+    uint8_t _septet;
+    uint16_t _acc;
+    uint8_t _bits;
+    bool _escape;
+    uint16_t _ucs2;
+    bool _ucs2High;
+
+    void _octet(uint8_t o);
+    void _sender(uint8_t o);
+    void _userData(uint8_t o);
+    void _gsmChar(uint8_t c);
+    void _putNumber(char c);
+    void _putText(char c);
+
+public:
+
+    uint16_t textLen;
+    bool truncated;
+    uint16_t ref;
+    uint8_t total;
+    uint8_t seq;
+
+    void begin(char *number,uint8_t numberSize,char *text,uint16_t textSize);
+    void put(char hex);
+    bool done();
+};
+
+/*
+ * Parts of concatenated messages, keyed by (sender, reference), in a fixed
+ * SMS_CACHE_SIZE byte pool. When a part does not fit, the message that was
+ * least recently added to is evicted.
+ */
+class Sim800CSmsCache
+{
+private:
+
+    uint8_t _pool[SMS_CACHE_SIZE];
+    uint16_t _used;
+
+    bool _same(uint16_t pos,const char *sender,uint16_t key,uint16_t ref);
+    uint16_t _find(const char *sender,uint16_t key,uint16_t ref,uint8_t seq);
+    void _remove(const char *sender,uint16_t key,uint16_t ref);
+    bool _evictOldest();
+
+public:
+
+    Sim800CSmsCache();
+
+    // Store one part, true when it completes its message.
+    bool add(const char *sender,uint16_t ref,uint8_t total,uint8_t seq,const char *text,uint16_t len,uint32_t now);
+    // Concatenate the parts of a complete message into text and forget them.
+    uint16_t take(const char *sender,uint16_t ref,char *text,uint16_t textSize,bool *truncated);
+    void clear();
+};
+
+#endif
@@ -0,0 +1,744 @@
+#include "ModemEmulator.h"
+
+static const char smsDate[]="19/01/17,10:06:21+14";
+
+static bool startsWith(const std::string &s,const char *prefix)
+{
+    return s.compare(0,strlen(prefix),prefix)==0;
+}
+
+static uint8_t muxFcs(const std::string &bytes)
+{
+    uint8_t fcs=0xFF;
+    for (size_t n=0; n<bytes.size(); n++)
+    {
+        fcs^=(uint8_t)bytes[n];
+        for (int i=0; i<8; i++) fcs=(fcs&1) ? (fcs>>1)^0xE0 : fcs>>1;
+    }
+    return 0xFF-fcs;
+}
+
+bool atString(const char *&p,std::string &out)
+{
+    out.clear();
+    if (*p!='"') return false;
+    for (p++; *p && *p!='"'; p++)
+    {
+        if (*p=='\\')
+        {
+            if (!isxdigit(p[1]) || !isxdigit(p[2])) return false;
+            out+=(char)strtol(std::string(p+1,2).c_str(),NULL,16);
+            p+=2;
+        }
+        else out+=*p;
+    }
+    if (*p!='"') return false;
+    p++;
+    // a string parameter ends the command or is followed by the next one
+    return *p==0 || *p==',';
+}
+
+ModemEmulator::ModemEmulator(VirtualClock *clock)
+{
+    _clock=clock;
+    _current=0;
+    _answering=false;
+    _lastDue=0;
+    _inFrame=false;
+    for (int i=0; i<4; i++)
+    {
+        _channels[i].dataLeft=0;
+        _channels[i].dataCtrlZ=false;
+        _channels[i].skipLf=false;
+        _channels[i].open=i==0;
+    }
+    baud=115200;
+    latency=20;
+    echo=false;
+    muxed=false;
+    ipr=0;
+    hostBaud=NULL;
+    _iprSet=false;
+    bytesIn=0;
+    bytesOut=0;
+    storageSize=30;
+    whiteMode=0;
+    configured=false;
+    callStatus=0;
+    rtc="19/01/17,10:06:21+14";
+}
+
+// A modem locked to a rate neither hears nor is heard at another one.
+bool ModemEmulator::_rateLost()
+{
+    return ipr!=0 && hostBaud!=NULL && *hostBaud!=ipr;
+}
+
+uint64_t ModemEmulator::_now()
+{
+    if (_clock!=NULL) return _clock->micros();
+    return micros();
+}
+
+void ModemEmulator::on(const char *prefix,const std::string &reply,int times)
+{
+    on(prefix,[reply](ModemEmulator &,const std::string &) { return reply; },times);
+}
+
+void ModemEmulator::on(const char *prefix,handler reply,int times)
+{
+    rule r;
+    r.prefix=prefix;
+    r.reply=reply;
+    r.times=times;
+    // the newest rule wins
+    _rules.insert(_rules.begin(),r);
+}
+
+void ModemEmulator::clearRules()
+{
+    _rules.clear();
+}
+
+void ModemEmulator::urc(const std::string &text,uint32_t delay,int ch)
+{
+    if (ch<0) ch=_current;
+    if (muxed && ch==0) ch=1;
+    // raised by a built-in reply: the modem reports it after the final result code
+    if (_answering && ch==_current)
+    {
+        _after.push_back(std::make_pair(text,delay));
+        return;
+    }
+    _emit(ch,text,delay);
+}
+
+void ModemEmulator::expectData(size_t size,data_handler done)
+{
+    channel *c=&_channels[_current];
+    c->dataLeft=size;
+    c->dataCtrlZ=size==0;
+    c->data.clear();
+    c->dataDone=done;
+    c->skipLf=true;
+}
+
+int ModemEmulator::deliver(const std::string &number,const std::string &text,uint8_t dcs,const std::string &udh)
+{
+    int index;
+    EmulatedSms m;
+
+    if (sms.size()>=storageSize) return -1;
+    for (index=1; sms.count(index); index++);
+    m.status="REC UNREAD";
+    m.number=number;
+    m.text=text;
+    m.dcs=dcs;
+    m.udh=udh;
+    sms[index]=m;
+    urc("\r\n+CMTI: \"SM\","+std::to_string(index)+"\r\n",0,muxed ? 1 : 0);
+    return index;
+}
+
+size_t ModemEmulator::count(const char *prefix) const
+{
+    size_t n=0;
+    for (size_t i=0; i<commands.size(); i++) if (startsWith(commands[i],prefix)) n++;
+    return n;
+}
+
+// Bytes due latency+delay ms from now, paced at the baud rate behind what is already queued.
+void ModemEmulator::_emitRaw(const std::string &bytes,uint32_t delay)
+{
+    uint64_t due=_now()+(uint64_t)(latency+delay)*1000;
+    uint64_t byteUs=baud ? 10000000ULL/baud : 0;
+    pending p;
+
+    if (bytes.empty() || _rateLost()) return;
+    if (due<_lastDue) due=_lastDue;
+    for (size_t i=0; i<bytes.size(); i++)
+    {
+        due+=byteUs;
+        p.due=due;
+        p.byte=(uint8_t)bytes[i];
+        _out.push_back(p);
+    }
+    _lastDue=due;
+    bytesOut+=bytes.size();
+}
+
+void ModemEmulator::_emit(uint8_t ch,const std::string &text,uint32_t delay)
+{
+    size_t pos;
+    if (!muxed || ch==0)
+    {
+        _emitRaw(text,delay);
+        return;
+    }
+    for (pos=0; pos<text.size(); pos+=127) _muxSend(ch,0xEF,text.substr(pos,127),delay);
+}
+
+void ModemEmulator::_muxSend(uint8_t dlci,uint8_t ctrl,const std::string &info,uint32_t delay)
+{
+    std::string head;
+    head+=(char)((dlci<<2)|0x01);
+    head+=(char)ctrl;
+    head+=(char)((info.size()<<1)|0x01);
+    _emitRaw("\xF9"+head+info+(char)muxFcs(head)+"\xF9",delay);
+}
+
+void ModemEmulator::input(const uint8_t *data,size_t size)
+{
+    while (size--) write(*data++);
+}
+
+size_t ModemEmulator::output(uint8_t *data,size_t size)
+{
+    size_t n=0;
+    int b;
+    while (n<size && (b=read())>=0) data[n++]=(uint8_t)b;
+    return n;
+}
+
+int ModemEmulator::available()
+{
+    uint64_t now=_now();
+    size_t n=0;
+    while (n<_out.size() && _out[n].due<=now) n++;
+    return n;
+}
+
+int ModemEmulator::read()
+{
+    uint8_t b;
+    if (_out.empty() || _out.front().due>_now()) return -1;
+    b=_out.front().byte;
+    _out.pop_front();
+    return b;
+}
+
+int ModemEmulator::peek()
+{
+    if (_out.empty() || _out.front().due>_now()) return -1;
+    return _out.front().byte;
+}
+
+size_t ModemEmulator::write(uint8_t b)
+{
+    bytesIn++;
+    if (_rateLost()) return 1;
+    if (muxed) _muxByte(b);
+    else
+    {
+        if (echo) _emitRaw(std::string(1,(char)b),0);
+        _channelByte(0,b);
+    }
+    return 1;
+}
+
+void ModemEmulator::_muxByte(uint8_t b)
+{
+    if (!_inFrame)
+    {
+        if (b==0xF9)
+        {
+            _inFrame=true;
+            _frame.clear();
+        }
+        return;
+    }
+    if (b!=0xF9)
+    {
+        _frame+=(char)b;
+        return;
+    }
+    // repeated flags between frames
+    if (_frame.empty()) return;
+    _muxFrame(_frame);
+    _frame.clear();
+}
+
+void ModemEmulator::_muxFrame(const std::string &f)
+{
+    uint8_t dlci,ctrl;
+    size_t len,head;
+    std::string info;
+
+    if (f.size()<4) return;
+    dlci=(uint8_t)f[0]>>2;
+    ctrl=(uint8_t)f[1]&~0x10;
+    len=(uint8_t)f[2]>>1;
+    head=3;
+    if (!((uint8_t)f[2]&1))
+    {
+        len|=(size_t)(uint8_t)f[3]<<7;
+        head=4;
+    }
+    if (f.size()!=head+len+1 || muxFcs(f.substr(0,head))!=(uint8_t)f[head+len]) return;
+    info=f.substr(head,len);
+
+    switch (ctrl)
+    {
+    case 0x2F:			// SABM
+        if (dlci<4) _channels[dlci].open=true;
+        _muxSend(dlci,0x73,"",0);
+        break;
+
+    case 0x43:			// DISC
+        if (dlci<4) _channels[dlci].open=false;
+        _muxSend(dlci,0x73,"",0);
+        break;
+
+    case 0xEF:			// UIH
+        if (dlci==0)
+        {
+            if (info.size()<2 || !((uint8_t)info[0]&0x02)) break;
+            std::string resp=info;
+            resp[0]=(char)((uint8_t)resp[0]&~0x02);
+            _muxSend(0,0xEF,resp,0);
+            if (((uint8_t)info[0]&~0x02)==0xC1) muxed=false;		// CLD
+        }
+        else if (dlci<4 && _channels[dlci].open)
+        {
+            for (size_t i=0; i<info.size(); i++) _channelByte(dlci,(uint8_t)info[i]);
+        }
+        break;
+    }
+}
+
+void ModemEmulator::_channelByte(uint8_t ch,uint8_t b)
+{
+    channel *c=&_channels[ch];
+    std::string line,reply;
+
+    if (c->skipLf)
+    {
+        c->skipLf=false;
+        if (b=='\n') return;
+    }
+    if (c->dataLeft || c->dataCtrlZ)
+    {
+        if (c->dataCtrlZ && b==0x1B)
+        {
+            c->dataCtrlZ=false;
+            return;
+        }
+        if (!(c->dataCtrlZ && b==0x1A)) c->data+=(char)b;
+        if (c->dataCtrlZ ? b!=0x1A : --c->dataLeft!=0) return;
+        c->dataCtrlZ=false;
+        _current=ch;
+        reply=c->dataDone(*this,c->data);
+        _emit(ch,reply,0);
+        return;
+    }
+    // ESC outside a prompt cancels the line typed so far
+    if (b==0x1B)
+    {
+        c->line.clear();
+        return;
+    }
+    if (b!='\r')
+    {
+        c->line+=(char)b;
+        return;
+    }
+    line=c->line;
+    c->line.clear();
+    line.erase(0,line.find_first_not_of("\r\n "));
+    if (!line.empty()) _command(ch,line);
+}
+
+void ModemEmulator::_command(uint8_t ch,const std::string &line)
+{
+    std::string reply;
+    bool scripted=false;
+    size_t i;
+
+    commands.push_back(line);
+    _current=ch;
+    for (i=0; i<_rules.size() && !scripted; i++)
+    {
+        if (!startsWith(line,_rules[i].prefix.c_str())) continue;
+        handler h=_rules[i].reply;
+        if (_rules[i].times>0 && --_rules[i].times==0) _rules.erase(_rules.begin()+i);
+        reply=h(*this,line);
+        scripted=true;
+    }
+    // a scripted reply places its URCs itself, the built-in ones follow the result code
+    _answering=!scripted;
+    if (!scripted) reply=_builtin(line);
+    _answering=false;
+    _emit(ch,reply,0);
+    if (_iprSet)
+    {
+        ipr=_iprNext;
+        _iprSet=false;
+    }
+    if (line=="AT+CMUX=0")
+    {
+        muxed=true;
+        for (i=1; i<4; i++) _channels[i].open=false;
+    }
+    for (i=0; i<_after.size(); i++) _emit(ch,_after[i].first,_after[i].second);
+    _after.clear();
+}
+
+/*
+ * A command line: ATD alone, the others split at ';' outside quotes, each
+ * part answered by _single(). The information of all parts, then one OK,
+ * or ERROR at the first part that fails.
+ */
+std::string ModemEmulator::_builtin(const std::string &line)
+{
+    std::string reply,part;
+    std::vector<std::string> parts;
+    bool quoted=false;
+    int result;
+    size_t i;
+
+    if (!startsWith(line,"AT") && !startsWith(line,"at")) return "";
+    if (startsWith(line,"ATD"))
+    {
+        reply=_single(line,result);
+        return result==2 ? reply : reply+(result ? "\r\nERROR\r\n" : "\r\nOK\r\n");
+    }
+    for (i=2; i<=line.size(); i++)
+    {
+        if (i==line.size() || (line[i]==';' && !quoted))
+        {
+            parts.push_back("AT"+part);
+            part.clear();
+            continue;
+        }
+        if (line[i]=='"') quoted=!quoted;
+        part+=line[i];
+    }
+    for (i=0; i<parts.size(); i++)
+    {
+        reply+=_single(parts[i],result);
+        if (result==1) return reply+"\r\nERROR\r\n";
+        if (result==2) return reply;
+    }
+    return reply+"\r\nOK\r\n";
+}
+
+std::string ModemEmulator::_single(const std::string &cmd,int &result)
+{
+    std::string name,value;
+    size_t eq;
+    int n;
+
+    result=0;
+    if (startsWith(cmd,"AT+IPR="))
+    {
+        _iprNext=strtoul(cmd.c_str()+7,NULL,10);
+        _iprSet=true;
+        return "";
+    }
+    if (cmd=="AT" || startsWith(cmd,"ATE") || startsWith(cmd,"AT&W")) return "";
+    if (cmd=="AT+CMUX=0") return "";
+    if (cmd=="ATI") return "\r\nSIM800 R14.18\r\n";
+    if (cmd=="AT+GMR") return "\r\nRevision:1418B05SIM800C32\r\n";
+    if (cmd=="AT+CGMM") return "\r\nSIMCOM_SIM800C\r\n";
+    if (cmd=="AT+GMI") return "\r\nSIMCOM_Ltd\r\n";
+    if (cmd=="AT+GSN") return "\r\n867567040000000\r\n";
+    if (cmd=="AT+CSQ") return "\r\n+CSQ: 20,0\r\n";
+    if (cmd=="AT+CPAS") return "\r\n+CPAS: "+std::to_string(callStatus)+"\r\n";
+    if (cmd=="AT+CCLK?") return "\r\n+CCLK: \""+rtc+"\"\r\n";
+    if (cmd=="AT+COPS?") return "\r\n+COPS: 0,0,\"MCI\"\r\n";
+    if (cmd=="AT+COPS=?") return "\r\n+COPS: (2,\"MCI\",\"MCI\",\"43211\"),,(0-4),(0-2)\r\n";
+    if (cmd=="AT+CSMS?") return "\r\n+CSMS: 0,1,1,1\r\n";
+    if (cmd=="AT+CREG?") return "\r\n+CREG: "+(settings.count("+CREG") ? settings["+CREG"] : std::string("0"))+",1,\"1A2B\",\"3C4D\"\r\n";
+    if (cmd=="AT+CPMS?")
+    {
+        std::string used=std::to_string(sms.size())+","+std::to_string(storageSize);
+        return "\r\n+CPMS: \"SM\","+used+",\"SM\","+used+",\"SM\","+used+"\r\n";
+    }
+    if (cmd=="AT+CIPGSMLOC=2,1") return "\r\n+CIPGSMLOC: 0,2019/01/17,10:06:21\r\n";
+    if (cmd=="ATA" || cmd=="ATH") return "";
+    if (startsWith(cmd,"ATD"))
+    {
+        urc("\r\n+CLCC: 1,0,3,0,0,\""+cmd.substr(3,cmd.size()-4)+"\",129,\"\"\r\n",500);
+        return "";
+    }
+    if (startsWith(cmd,"AT+CMGR="))
+    {
+        return _cmgr(atoi(cmd.c_str()+8));
+    }
+    if (startsWith(cmd,"AT+CMGL=")) return _cmgl(cmd.substr(9,cmd.size()-10));
+    if (startsWith(cmd,"AT+CMGD="))
+    {
+        sms.erase(atoi(cmd.c_str()+8));
+        return "";
+    }
+    if (cmd=="AT+CMGDA=\"DEL ALL\"")
+    {
+        sms.clear();
+        return "";
+    }
+    if (startsWith(cmd,"AT+CMGS="))
+    {
+        result=2;
+        expectData(0,[](ModemEmulator &m,const std::string &text)
+        {
+            m.smsSent=text;
+            return std::string("\r\n+CMGS: 12\r\n\r\nOK\r\n");
+        });
+        return "\r\n> ";
+    }
+    if (cmd=="AT+CWHITELIST?") return _whitelist();
+    if (startsWith(cmd,"AT+CWHITELIST="))
+    {
+        const char *p=cmd.c_str()+14;
+        whiteMode=atoi(p);
+        if ((p=strchr(p,','))==NULL) return "";
+        n=atoi(p+1);
+        if (n<1 || n>30 || (p=strchr(p+1,','))==NULL)
+        {
+            result=1;
+            return "";
+        }
+        value=p+1;
+        if (!value.empty() && value[0]=='"') value=value.substr(1,value.size()-2);
+        whitelist[n-1]=value;
+        return "";
+    }
+
+    // GPRS and connections
+    if (cmd=="AT+CIFSR")
+    {
+        result=2;
+        return "\r\n10.0.0.2\r\n";
+    }
+    if (cmd=="AT+CIPSHUT")
+    {
+        result=2;
+        return "\r\nSHUT OK\r\n";
+    }
+    if (startsWith(cmd,"AT+CIPSTART="))
+    {
+        n=atoi(cmd.c_str()+12);
+        urc("\r\n"+std::to_string(n)+", CONNECT OK\r\n",100);
+        return "";
+    }
+    if (startsWith(cmd,"AT+CIPSEND="))
+    {
+        n=atoi(cmd.c_str()+11);
+        result=2;
+        expectData(atoi(strchr(cmd.c_str(),',')+1),[n](ModemEmulator &m,const std::string &data)
+        {
+            m.socketData[n]+=data;
+            return "\r\n"+std::to_string(n)+", SEND OK\r\n";
+        });
+        return "\r\n> ";
+    }
+    if (startsWith(cmd,"AT+CIPCLOSE="))
+    {
+        result=2;
+        return "\r\n"+cmd.substr(12)+", CLOSE OK\r\n";
+    }
+    if (cmd=="AT+SAPBR=2,1") return "\r\n+SAPBR: 1,1,\"10.0.0.3\"\r\n";
+    if (startsWith(cmd,"AT+HTTP")) return _http(cmd,result);
+
+    // settings: "AT+X=v" is kept and answers "AT+X?"
+    if (startsWith(cmd,"AT+"))
+    {
+        eq=cmd.find('=');
+        if (eq!=std::string::npos && cmd.compare(eq,2,"=?")!=0)
+        {
+            name=cmd.substr(2,eq-2);
+            settings[name]=cmd.substr(eq+1);
+            if (name=="+CMGF") configured=true;
+            return "";
+        }
+        if (cmd[cmd.size()-1]=='?')
+        {
+            name=cmd.substr(2,cmd.size()-3);
+            if (settings.count(name)) return "\r\n"+name+": "+settings[name]+"\r\n";
+            return "";
+        }
+    }
+    return "";
+}
+
+static std::string hexOctet(uint8_t o)
+{
+    static const char digits[]="0123456789ABCDEF";
+    return std::string(1,digits[o>>4])+digits[o&0x0F];
+}
+
+// Septets of the GSM 7 bit default alphabet, the escaped characters as two.
+static void gsmSeptets(const std::string &text,std::vector<uint8_t> &out)
+{
+    static const char escaped[]="^{}\\[~]|";
+    static const uint8_t escapeCodes[]={ 0x14,0x28,0x29,0x2F,0x3C,0x3D,0x3E,0x40 };
+    const char *e;
+
+    for (size_t i=0; i<text.size(); i++)
+    {
+        char c=text[i];
+        if ((e=strchr(escaped,c))!=NULL && c)
+        {
+            out.push_back(0x1B);
+            out.push_back(escapeCodes[e-escaped]);
+        }
+        else if (c=='@') out.push_back(0x00);
+        else if (c=='$') out.push_back(0x02);
+        else if (c=='_') out.push_back(0x11);
+        else             out.push_back((uint8_t)c);
+    }
+}
+
+/*
+ * The SMS-DELIVER TPDU of a stored message, as the modem shows it in PDU
+ * mode: no SMSC, the sender in BCD, the user data header before the text.
+ */
+static std::string deliverPdu(const EmulatedSms &m)
+{
+    std::string pdu,digits;
+    std::vector<uint8_t> septets;
+    size_t udhLen=m.udh.size()/2,i;
+    uint32_t acc=0;
+    uint8_t bits=0,skip=0;
+
+    for (i=0; i<m.number.size(); i++) if (isdigit((uint8_t)m.number[i])) digits+=m.number[i];
+    pdu=hexOctet(m.udh.empty() ? 0x04 : 0x44)+hexOctet(digits.size())+(m.number[0]=='+' ? "91" : "81");
+    if (digits.size()%2) digits+='F';
+    for (i=0; i<digits.size(); i+=2) pdu+=std::string(1,digits[i+1])+digits[i];
+    pdu+="00"+hexOctet(m.dcs)+"91107101601241";
+    if (m.dcs!=0) return pdu+hexOctet(udhLen+m.text.size()/2)+m.udh+m.text;
+
+    // the header is padded to a septet boundary, its septets count in the length
+    gsmSeptets(m.text,septets);
+    if (udhLen)
+    {
+        skip=(udhLen*8+6)/7;
+        bits=skip*7-udhLen*8;
+    }
+    pdu+=hexOctet(skip+septets.size())+m.udh;
+    for (i=0; i<septets.size(); i++)
+    {
+        acc|=(uint32_t)septets[i]<<bits;
+        bits+=7;
+        while (bits>=8) { pdu+=hexOctet(acc&0xFF); acc>>=8; bits-=8; }
+    }
+    if (bits) pdu+=hexOctet(acc&0xFF);
+    return pdu;
+}
+
+std::string ModemEmulator::_cmgr(int index)
+{
+    static const char *const states[]={ "REC UNREAD","REC READ","STO UNSENT","STO SENT" };
+    std::map<int,EmulatedSms>::iterator it=sms.find(index);
+    EmulatedSms *m;
+    size_t len;
+    std::string reply,pdu;
+    int stat;
+
+    if (it==sms.end()) return "";
+    m=&it->second;
+    if (settings["+CMGF"]=="0")
+    {
+        for (stat=0; stat<3 && m->status!=states[stat]; stat++);
+        pdu=deliverPdu(*m);
+        if (m->status=="REC UNREAD") m->status="REC READ";
+        return "\r\n+CMGR: "+std::to_string(stat)+",,"+std::to_string(pdu.size()/2)+"\r\n00"+pdu+"\r\n";
+    }
+    // +CSDH=1 length: characters of a GSM text, octets of 8 bit and UCS2 bodies sent as hex
+    len=m->dcs==0 ? m->text.size() : m->text.size()/2;
+    reply="\r\n+CMGR: \""+m->status+"\",\""+m->number+"\",\"\",\""+smsDate+"\",145,4,0,"+
+          std::to_string(m->dcs)+",\"+98912\",145,"+std::to_string(len)+"\r\n"+m->text+"\r\n";
+    if (m->status=="REC UNREAD") m->status="REC READ";
+    return reply;
+}
+
+std::string ModemEmulator::_cmgl(const std::string &filter)
+{
+    std::map<int,EmulatedSms>::iterator it;
+    std::string reply;
+    size_t len;
+
+    for (it=sms.begin(); it!=sms.end(); ++it)
+    {
+        if (filter!="ALL" && filter!=it->second.status) continue;
+        len=it->second.dcs==0 ? it->second.text.size() : it->second.text.size()/2;
+        reply+="\r\n+CMGL: "+std::to_string(it->first)+",\""+it->second.status+"\",\""+it->second.number+"\",\"\",\""+
+               smsDate+"\",145,"+std::to_string(len)+"\r\n"+it->second.text;
+        if (it->second.status=="REC UNREAD") it->second.status="REC READ";
+    }
+    return reply.empty() ? "" : reply+"\r\n";
+}
+
+std::string ModemEmulator::_whitelist()
+{
+    std::string reply="\r\n+CWHITELIST: "+std::to_string(whiteMode);
+    for (int i=0; i<30; i++) reply+=",\""+whitelist[i]+"\"";
+    return reply+"\r\n";
+}
+
+/*
+ * AT+HTTP*: the parameters are parsed as the modem does, a malformed string
+ * is an ERROR. The resource is httpBody with the validator httpEtag, a GET
+ * whose If-None-Match carries it gets 304.
+ */
+std::string ModemEmulator::_http(const std::string &cmd,int &result)
+{
+    std::string name,value;
+    const char *p;
+    size_t offset,len;
+    int method,status;
+
+    if (cmd=="AT+HTTPINIT" || cmd=="AT+HTTPTERM") return "";
+    if (startsWith(cmd,"AT+HTTPPARA="))
+    {
+        p=cmd.c_str()+12;
+        if (!atString(p,name) || *p!=',') { result=1; return ""; }
+        p++;
+        if (*p=='"')
+        {
+            if (!atString(p,value) || *p!=0) { result=1; return ""; }
+        }
+        else value=p;
+        if (name=="USERDATA") httpUserData=value;
+        settings["HTTP."+name]=value;
+        return "";
+    }
+    if (startsWith(cmd,"AT+HTTPACTION="))
+    {
+        method=atoi(cmd.c_str()+14);
+        status=200;
+        len=httpBody.size();
+        if (method==0 && !httpEtag.empty() && httpUserData=="If-None-Match: "+httpEtag)
+        {
+            status=304;
+            len=0;
+        }
+        urc("\r\n+HTTPACTION: "+std::to_string(method)+","+std::to_string(status)+","+std::to_string(len)+"\r\n",200);
+        return "";
+    }
+    if (cmd=="AT+HTTPHEAD")
+    {
+        value="HTTP/1.1 200 OK\r\nContent-Length: "+std::to_string(httpBody.size())+"\r\n";
+        if (!httpEtag.empty()) value+="ETag: "+httpEtag+"\r\n";
+        return "\r\n+HTTPHEAD: "+std::to_string(value.size())+"\r\n"+value;
+    }
+    if (startsWith(cmd,"AT+HTTPREAD="))
+    {
+        offset=atoi(cmd.c_str()+12);
+        len=atoi(strchr(cmd.c_str(),',')+1);
+        value=offset<httpBody.size() ? httpBody.substr(offset,len) : "";
+        result=2;
+        return "\r\n+HTTPREAD: "+std::to_string(value.size())+"\r\n"+value+"\r\nOK\r\n";
+    }
+    if (startsWith(cmd,"AT+HTTPDATA="))
+    {
+        result=2;
+        expectData(atoi(cmd.c_str()+12),[](ModemEmulator &m,const std::string &data)
+        {
+            m.settings["HTTP.DATA"]=data;
+            return std::string("\r\nOK\r\n");
+        });
+        return "\r\nDOWNLOAD\r\n";
+    }
+    return "";
+}
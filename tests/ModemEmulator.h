@@ -0,0 +1,181 @@
+/*
+ *	SCRIPTED SIM800C
+ *
+ *		A Stream that answers like a SIM800C: the commands the library sends
+ *		get the replies of the real modem, with a configurable latency, bytes
+ *		paced at the configured baud rate and URCs injected on demand. Tests
+ *		replace any reply with on(). After AT+CMUX=0 it speaks GSM 07.10 basic
+ *		mode with a command interpreter per channel.
+ *
+ *		Time is virtual: VirtualClock is handed to the library with
+ *		setClock() and every millis() call moves it a little, so a test of a
+ *		60 s timeout runs in milliseconds. Without a clock the emulator runs
+ *		in real time, which is how the pseudo terminal tests drive it.
+*/
+
+#ifndef ModemEmulator_h
+#define ModemEmulator_h
+#include "Sim800C.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class VirtualClock : public Sim800CClock
+{
+private:
+
+    uint64_t _us;
+
+public:
+
+    uint32_t step;			// us each millis() call takes
+
+    VirtualClock() : _us(0), step(10) {}
+
+    uint32_t millis() { _us+=step; return (uint32_t)(_us/1000); }
+    void delay(uint32_t ms) { _us+=(uint64_t)ms*1000; }
+    uint64_t micros() const { return _us; }
+    void advance(uint64_t us) { _us+=us; }
+};
+
+struct EmulatedSms
+{
+    std::string status;		// "REC UNREAD", "REC READ", "STO SENT"...
+    std::string number;
+    std::string text;		// hex digits for a dcs other than 0
+    uint8_t dcs;
+    std::string udh;		// hex digits of the user data header, "" for none
+};
+
+class ModemEmulator : public Stream
+{
+public:
+
+    // Returns the reply, "" for none. line is the command without its CR.
+    typedef std::function<std::string(ModemEmulator &modem,const std::string &line)> handler;
+    typedef std::function<std::string(ModemEmulator &modem,const std::string &data)> data_handler;
+
+private:
+
+    struct rule
+    {
+        std::string prefix;
+        handler reply;
+        int times;			// -1 for always
+    };
+
+    struct channel
+    {
+        std::string line;
+        size_t dataLeft;		// bytes of a data phase still to come, 0 when none
+        bool dataCtrlZ;			// the data phase ends at Ctrl-Z
+        std::string data;
+        data_handler dataDone;
+        bool skipLf;			// the LF after the command line that started the data phase
+        bool open;
+    };
+
+    struct pending
+    {
+        uint64_t due;
+        uint8_t byte;
+    };
+
+    VirtualClock *_clock;
+    std::vector<rule> _rules;
+    std::deque<pending> _out;
+    channel _channels[4];		// 0 the plain link, 1..3 the DLCIs of the multiplexer
+    uint8_t _current;			// channel of the command being answered
+    bool _answering;			// urc() waits for the built-in reply of the command
+    std::vector<std::pair<std::string,uint32_t> > _after;
+    uint64_t _lastDue;
+
+    // receive state of the multiplexer frames
+    std::string _frame;
+    bool _inFrame;
+
+    uint64_t _now();
+    void _emitRaw(const std::string &bytes,uint32_t delay);
+    void _muxByte(uint8_t b);
+    void _muxFrame(const std::string &frame);
+    void _muxSend(uint8_t dlci,uint8_t ctrl,const std::string &info,uint32_t delay);
+    void _channelByte(uint8_t ch,uint8_t b);
+    void _command(uint8_t ch,const std::string &line);
+    void _emit(uint8_t ch,const std::string &text,uint32_t delay);
+    std::string _builtin(const std::string &line);
+    // result: 0 append OK, 1 ERROR, 2 the reply is complete as it is
+    std::string _single(const std::string &cmd,int &result);
+    std::string _cmgr(int index);
+    std::string _cmgl(const std::string &filter);
+    std::string _whitelist();
+    std::string _http(const std::string &cmd,int &result);
+
+    uint32_t _iprNext;
+    bool _iprSet;			// AT+IPR= takes effect after its OK
+    bool _rateLost();
+
+public:
+
+    uint32_t baud;				// pacing of the replies, 0 sends them at once
+    uint32_t latency;			// ms from the end of a command to its reply
+    bool echo;
+    bool muxed;
+    uint32_t ipr;				// rate stored with AT+IPR, 0 autobauds
+    const uint32_t *hostBaud;	// rate of the host's port, bytes at another rate than ipr are lost both ways
+
+    // observation
+    std::vector<std::string> commands;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+
+    // state the built-in replies use and tests inspect
+    std::map<int,EmulatedSms> sms;
+    uint8_t storageSize;
+    std::string smsSent;			// text of the last AT+CMGS
+    uint8_t whiteMode;
+    std::string whitelist[30];
+    bool configured;
+    int callStatus;
+    std::string rtc;
+    std::string httpBody;
+    std::string httpEtag;
+    std::string httpUserData;
+    std::map<int,std::string> socketData;	// what each connection received
+    std::map<std::string,std::string> settings;	// "+CMGF" -> "1", answers the matching query
+
+    ModemEmulator(VirtualClock *clock=NULL);
+
+    // Scripted replies, matched by prefix before the built-in ones. times -1 keeps the rule.
+    void on(const char *prefix,const std::string &reply,int times=-1);
+    void on(const char *prefix,handler reply,int times=-1);
+    void clearRules();
+
+    // Unsolicited output after delay ms, on the channel of the running command or on ch.
+    void urc(const std::string &text,uint32_t delay=0,int ch=-1);
+    // The next bytes of the channel are data: size of them, or up to Ctrl-Z with size 0.
+    void expectData(size_t size,data_handler done);
+    // Store a message and announce it with +CMTI, index returned. AT+CMGF=0 reads it as a PDU.
+    int deliver(const std::string &number,const std::string &text,uint8_t dcs=0,const std::string &udh="");
+    size_t count(const char *prefix) const;
+    // Bytes queued for the library, due or not.
+    size_t pendingOutput() const { return _out.size(); }
+    // us at which the last queued byte is due, the end of the modem's part of a command
+    uint64_t lastDue() const { return _lastDue; }
+
+    // the plain byte interface, for transports other than this Stream
+    void input(const uint8_t *data,size_t size);
+    size_t output(uint8_t *data,size_t size);
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t b);
+    using Print::write;
+};
+
+// V.250 string constant at *p: quotes, \HH escapes. False when malformed.
+bool atString(const char *&p,std::string &out);
+
+#endif
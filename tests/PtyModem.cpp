@@ -0,0 +1,72 @@
+#include "PtyModem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+
+PtyModem::PtyModem()
+{
+    _master=-1;
+    _slave=-1;
+    _running=false;
+    path[0]=0;
+}
+
+PtyModem::~PtyModem()
+{
+    stop();
+}
+
+bool PtyModem::start()
+{
+    struct termios tio;
+
+    if (openpty(&_master,&_slave,path,NULL,NULL)!=0) return false;
+    tcgetattr(_slave,&tio);
+    cfmakeraw(&tio);
+    tcsetattr(_slave,TCSANOW,&tio);
+    fcntl(_master,F_SETFL,fcntl(_master,F_GETFL)|O_NONBLOCK);
+    _running=true;
+    _thread=std::thread(&PtyModem::_run,this);
+    return true;
+}
+
+void PtyModem::stop()
+{
+    if (_running)
+    {
+        _running=false;
+        _thread.join();
+    }
+    if (_master>=0) close(_master);
+    if (_slave>=0) close(_slave);
+    _master=_slave=-1;
+}
+
+void PtyModem::_run()
+{
+    struct pollfd p;
+    uint8_t buf[256];
+    ssize_t n;
+    size_t out,done;
+
+    p.fd=_master;
+    p.events=POLLIN;
+    while (_running)
+    {
+        poll(&p,1,1);
+        std::lock_guard<std::mutex> guard(lock);
+        while ((n=read(_master,buf,sizeof(buf)))>0) modem.input(buf,n);
+        while ((out=modem.output(buf,sizeof(buf)))>0)
+        {
+            for (done=0; done<out; )
+            {
+                n=write(_master,buf+done,out-done);
+                if (n>0) done+=n;
+                else if (errno!=EAGAIN && errno!=EINTR) break;
+            }
+        }
+    }
+}
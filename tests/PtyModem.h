@@ -0,0 +1,40 @@
+/*
+ *	EMULATED MODEM ON A PSEUDO TERMINAL
+ *
+ *		openpty() pair with a ModemEmulator in real time on the master side,
+ *		serviced by a thread of its own. The library opens the slave path like
+ *		a /dev/ttyUSB port. Hold lock while touching modem from the test.
+*/
+
+#ifndef PtyModem_h
+#define PtyModem_h
+#include "ModemEmulator.h"
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+class PtyModem
+{
+private:
+
+    int _master;
+    int _slave;				// kept open so the master does not see a hangup between opens
+    std::thread _thread;
+    std::atomic<bool> _running;
+
+    void _run();
+
+public:
+
+    ModemEmulator modem;
+    std::mutex lock;
+    char path[64];
+
+    PtyModem();
+    ~PtyModem();
+
+    bool start();
+    void stop();
+};
+
+#endif
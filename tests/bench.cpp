@@ -0,0 +1,200 @@
+/*
+ *	END TO END COST OF THE PUBLIC COMMANDS
+ *
+ *		Every command runs a number of times against the scripted modem at
+ *		each baud rate, in virtual time. Per command:
+ *		  p50, p99		latency of the call, ms
+ *		  modem			ms until the modem's last reply byte was on the wire
+ *		  overhead		ms the call took beyond that: polling, parsing and
+ *						the library's own delays
+ *		  slept			of which deliberate delays (lastTiming().slept)
+ *		  bytes			both directions, per call
+ *		  ram			sizeof(Sim800C) plus the stack high-water mark, an upper
+ *						bound as the emulator runs on the same stack
+ *		The table goes to stdout, -j writes the same as JSON for diffing in review.
+ *
+ *		sim800c_bench [-n iterations] [-j file] [baud...]
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include <algorithm>
+#include <functional>
+#include <stdlib.h>
+
+#define STACK_PAINT		32768
+#define STACK_COLOR		0xA5
+
+struct bench_command
+{
+    const char *name;
+    std::function<void(Sim800C &gsm,ModemEmulator &modem)> prepare;	// untimed
+    std::function<void(Sim800C &gsm,ModemEmulator &modem)> run;
+};
+
+struct bench_result
+{
+    uint32_t baud;
+    const char *name;
+    double p50,p99,modem,overhead,slept;
+    uint32_t bytes;
+    uint32_t ram;
+    uint16_t ringPeak,arenaPeak;
+};
+
+// Stack high-water mark, the way it is measured on an AVR: paint, run, count the untouched paint.
+static __attribute__((noinline)) void stackPaint()
+{
+    volatile uint8_t area[STACK_PAINT];
+    for (size_t i=0; i<STACK_PAINT; i++) area[i]=STACK_COLOR;
+    (void)area;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+static __attribute__((noinline)) uint32_t stackUsed()
+{
+    volatile uint8_t area[STACK_PAINT];
+    size_t i;
+    for (i=0; i<STACK_PAINT && area[i]==STACK_COLOR; i++);
+    return STACK_PAINT-i;
+}
+#pragma GCC diagnostic pop
+
+static double percentile(std::vector<double> v,int p)
+{
+    std::sort(v.begin(),v.end());
+    return v[std::min(v.size()-1,v.size()*p/100)];
+}
+
+static std::vector<bench_command> commands()
+{
+    static char number[]="+989121234567";
+    static char text[]="benchmark message of a typical length";
+    static char phone[SMS_NUMBER_SIZE];
+    static char body[SMS_TEXT_SIZE];
+    static uint8_t index=1;
+
+    std::vector<bench_command> list;
+    list.push_back({ "sendSms", NULL,
+        [](Sim800C &gsm,ModemEmulator &) { gsm.sendSms(number,text); } });
+    list.push_back({ "readSms",
+        [](Sim800C &,ModemEmulator &modem) { modem.sms[index]={ "REC UNREAD", number, text, 0, "" }; },
+        [](Sim800C &gsm,ModemEmulator &) { gsm.readSms(index,phone,body); } });
+    list.push_back({ "deleteSMS",
+        [](Sim800C &,ModemEmulator &modem) { modem.sms[index]={ "REC UNREAD", number, text, 0, "" }; },
+        [](Sim800C &gsm,ModemEmulator &) { gsm.deleteSMS(index); } });
+    list.push_back({ "getCallStatus", NULL,
+        [](Sim800C &gsm,ModemEmulator &) { gsm.getCallStatus(); } });
+    list.push_back({ "is_network_registered", NULL,
+        [](Sim800C &gsm,ModemEmulator &) { gsm.is_network_registered(); } });
+    list.push_back({ "check_receive_command",
+        [](Sim800C &,ModemEmulator &modem) { modem.sms.clear(); modem.deliver(number,text); },
+        [](Sim800C &gsm,ModemEmulator &) { while (gsm.check_receive_command()!=Sms_received); } });
+    return list;
+}
+
+static void benchBaud(uint32_t baud,int iterations,std::vector<bench_result> &results)
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    std::vector<bench_command> list=commands();
+    std::vector<double> latency;
+    uint64_t start,end,due;
+    uint32_t bytes,slept,stack;
+    bench_result r;
+
+    clock.step=2;
+    modem.baud=baud;
+    gsm.setClock(clock);
+    gsm.begin(modem,baud);
+
+    for (size_t n=0; n<list.size(); n++)
+    {
+        latency.clear();
+        r.modem=r.overhead=r.slept=0;
+        r.bytes=0;
+        stack=0;
+        for (int i=0; i<iterations; i++)
+        {
+            // let the previous call settle so that only this one is on the wire
+            clock.advance(1000000);
+            while (gsm.check_receive_command()!=No_data);
+            if (list[n].prepare) list[n].prepare(gsm,modem);
+
+            bytes=modem.bytesIn+modem.bytesOut;
+            slept=gsm.lastTiming().slept;
+            start=clock.micros();
+            stackPaint();
+            list[n].run(gsm,modem);
+            stack=std::max(stack,stackUsed());
+            end=clock.micros();
+            // a call answered from the library's cache leaves earlier output as the last due byte
+            due=std::min(std::max(modem.lastDue(),start),end);
+
+            latency.push_back((end-start)/1000.0);
+            r.modem+=(due-start)/1000.0;
+            r.overhead+=(end-due)/1000.0;
+            r.slept+=gsm.lastTiming().slept-slept;
+            r.bytes+=modem.bytesIn+modem.bytesOut-bytes;
+        }
+        r.baud=baud;
+        r.name=list[n].name;
+        r.p50=percentile(latency,50);
+        r.p99=percentile(latency,99);
+        r.modem/=iterations;
+        r.overhead/=iterations;
+        r.slept/=iterations;
+        r.bytes/=iterations;
+        r.ram=sizeof(Sim800C)+stack;
+        r.ringPeak=gsm.lastTiming().ringPeak;
+        r.arenaPeak=gsm.lastTiming().arenaPeak;
+        results.push_back(r);
+    }
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<uint32_t> bauds;
+    std::vector<bench_result> results;
+    const char *json=NULL;
+    int iterations=100;
+    FILE *f;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i],"-n")==0 && i+1<argc) iterations=atoi(argv[++i]);
+        else if (strcmp(argv[i],"-j")==0 && i+1<argc) json=argv[++i];
+        else bauds.push_back(atol(argv[i]));
+    }
+    if (bauds.empty()) bauds={ 9600, 19200, 57600, 115200 };
+    if (iterations<1) iterations=1;
+
+    for (size_t i=0; i<bauds.size(); i++) benchBaud(bauds[i],iterations,results);
+
+    printf("%7s %-22s %9s %9s %9s %9s %9s %6s %6s\n","baud","command","p50 ms","p99 ms","modem ms","overhead","slept ms","bytes","ram B");
+    for (size_t i=0; i<results.size(); i++)
+    {
+        bench_result &r=results[i];
+        printf("%7u %-22s %9.2f %9.2f %9.2f %9.2f %9.2f %6u %6u\n",r.baud,r.name,r.p50,r.p99,r.modem,r.overhead,r.slept,r.bytes,r.ram);
+    }
+
+    if (json!=NULL)
+    {
+        if ((f=fopen(json,"w"))==NULL) return 1;
+        fprintf(f,"[\n");
+        for (size_t i=0; i<results.size(); i++)
+        {
+            bench_result &r=results[i];
+            fprintf(f,"  {\"baud\": %u, \"command\": \"%s\", \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"modem_ms\": %.3f, "
+                      "\"overhead_ms\": %.3f, \"slept_ms\": %.3f, \"bytes\": %u, \"ram_bytes\": %u, \"ring_peak\": %u, \"arena_peak\": %u}%s\n",
+                    r.baud,r.name,r.p50,r.p99,r.modem,r.overhead,r.slept,r.bytes,r.ram,r.ringPeak,r.arenaPeak,
+                    i+1<results.size() ? "," : "");
+        }
+        fprintf(f,"]\n");
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "Arduino.h"
+#include "EEPROM.h"
+#include <time.h>
+#include <errno.h>
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+uint32_t digitalWrites;
+
+static uint8_t pins[256];
+
+unsigned long micros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (unsigned long)(ts.tv_sec*1000000ULL+ts.tv_nsec/1000);
+}
+
+unsigned long millis()
+{
+    return micros()/1000;
+}
+
+void delay(unsigned long ms)
+{
+    struct timespec ts;
+    ts.tv_sec=ms/1000;
+    ts.tv_nsec=(ms%1000)*1000000L;
+    while (nanosleep(&ts,&ts)!=0 && errno==EINTR);
+}
+
+void pinMode(uint8_t,uint8_t)
+{
+}
+
+void digitalWrite(uint8_t pin,uint8_t value)
+{
+    pins[pin]=value;
+    digitalWrites++;
+}
+
+uint8_t digitalState(uint8_t pin)
+{
+    return pins[pin];
+}
+
+size_t Print::write(const uint8_t *buffer,size_t size)
+{
+    size_t n=0;
+    while (size--) n+=write(*buffer++);
+    return n;
+}
+
+size_t Print::_number(unsigned long v,int base,bool negative)
+{
+    char buf[24];
+    char *p=buf+sizeof(buf)-1;
+
+    *p=0;
+    do
+    {
+        *--p="0123456789ABCDEF"[v%base];
+        v/=base;
+    } while (v);
+    if (negative) *--p='-';
+    return write(p);
+}
@@ -0,0 +1,125 @@
+/*
+ *	HOST ARDUINO CORE
+ *
+ *		The part of the Arduino core the library uses, for building it and its
+ *		tests on a Linux host: Print, Stream, String, the PROGMEM accessors
+ *		and millis() / delay() on CLOCK_MONOTONIC. Pins do nothing.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+#define PROGMEM
+class __FlashStringHelper;
+#define F(s)					((const __FlashStringHelper *)(s))
+#define pgm_read_byte(p)		(*(const uint8_t *)(p))
+#define pgm_read_word(p)		(*(const uint16_t *)(p))
+#define pgm_read_dword(p)		(*(const uint32_t *)(p))
+#define pgm_read_ptr(p)			(*(void * const *)(p))
+#define memcpy_P				memcpy
+#define strcmp_P				strcmp
+#define strncmp_P				strncmp
+#define strlen_P				strlen
+#define strcasecmp_P			strcasecmp
+
+#define DEC		10
+#define HEX		16
+#define LOW		0
+#define HIGH	1
+#define INPUT	0
+#define OUTPUT	1
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void pinMode(uint8_t pin,uint8_t mode);
+void digitalWrite(uint8_t pin,uint8_t value);
+// Last value written to a pin, for tests of the power key.
+uint8_t digitalState(uint8_t pin);
+extern uint32_t digitalWrites;		// every digitalWrite() call, pin pulses show here
+
+class String
+{
+private:
+
+    std::string _s;
+
+public:
+
+    String() {}
+    String(const char *s) : _s(s!=NULL ? s : "") {}
+    String(long v) : _s(std::to_string(v)) {}
+
+    String &operator+=(const char *s) { _s+=s; return *this; }
+    String &operator+=(const String &s) { _s+=s._s; return *this; }
+    bool operator==(const char *s) const { return _s==s; }
+    bool operator!=(const char *s) const { return _s!=s; }
+    const char *c_str() const { return _s.c_str(); }
+    unsigned int length() const { return _s.size(); }
+};
+
+class Print
+{
+private:
+
+    size_t _number(unsigned long v,int base,bool negative);
+
+public:
+
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b)=0;
+    virtual size_t write(const uint8_t *buffer,size_t size);
+    virtual void flush() {}
+    size_t write(const char *s) { return write((const uint8_t *)s,strlen(s)); }
+
+    size_t print(const char *s) { return write(s); }
+    size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char v,int base=DEC) { return _number(v,base,false); }
+    size_t print(int v,int base=DEC) { return print((long)v,base); }
+    size_t print(unsigned int v,int base=DEC) { return _number(v,base,false); }
+    size_t print(long v,int base=DEC) { return v<0 && base==DEC ? _number(-(unsigned long)v,base,true) : _number(v,base,false); }
+    size_t print(unsigned long v,int base=DEC) { return _number(v,base,false); }
+
+    size_t println() { return write("\r\n"); }
+    template<typename T> size_t println(T v) { size_t n=print(v); return n+println(); }
+    template<typename T> size_t println(T v,int base) { size_t n=print(v,base); return n+println(); }
+};
+
+class Stream : public Print
+{
+public:
+
+    virtual int available()=0;
+    virtual int read()=0;
+    virtual int peek()=0;
+    void setTimeout(unsigned long) {}
+};
+
+// A serial port that is never connected, Serial of the sketches.
+class HardwareSerial : public Stream
+{
+public:
+
+    void begin(unsigned long) {}
+    void end() {}
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
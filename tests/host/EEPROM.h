@@ -0,0 +1,43 @@
+/*
+ *	HOST EEPROM
+ *
+ *		1 KB of RAM initialised to 0xFF like an erased part, with a count of
+ *		the bytes put() changed so tests can tell whether the library wrote it.
+*/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+#include "Arduino.h"
+
+#define EEPROM_SIZE		1024
+
+class EEPROMClass
+{
+public:
+
+    uint8_t data[EEPROM_SIZE];
+    uint32_t writes;
+
+    EEPROMClass() : writes(0) { memset(data,0xFF,sizeof(data)); }
+
+    uint16_t length() { return EEPROM_SIZE; }
+    uint8_t read(int addr) { return data[addr]; }
+    void write(int addr,uint8_t v) { if (data[addr]!=v) writes++; data[addr]=v; }
+
+    template<typename T> T &get(int addr,T &t)
+    {
+        memcpy(&t,data+addr,sizeof(T));
+        return t;
+    }
+
+    template<typename T> const T &put(int addr,const T &t)
+    {
+        const uint8_t *p=(const uint8_t *)&t;
+        for (size_t i=0; i<sizeof(T); i++) write(addr+i,p[i]);
+        return t;
+    }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ *	HOST SOFTWARESERIAL
+ *
+ *		Stands in for the default port of the library. It talks to the modem a
+ *		test sets as its peer and is otherwise never connected, most tests
+ *		pass their modem to begin(Stream&). begin() records the rate so the
+ *		baud rate logic can be checked.
+*/
+
+#ifndef SoftwareSerial_h
+#define SoftwareSerial_h
+#include "Arduino.h"
+
+class SoftwareSerial : public Stream
+{
+public:
+
+    uint32_t baud;
+    uint16_t begins;
+    Stream *peer;
+
+    SoftwareSerial(uint8_t,uint8_t) : baud(0), begins(0), peer(NULL) {}
+
+    void begin(long speed) { baud=speed; begins++; }
+    bool overflow() { return false; }
+    int available() { return peer!=NULL ? peer->available() : 0; }
+    int read() { return peer!=NULL ? peer->read() : -1; }
+    int peek() { return peer!=NULL ? peer->peek() : -1; }
+    size_t write(uint8_t b) { return peer!=NULL ? peer->write(b) : 1; }
+    using Print::write;
+};
+
+#endif
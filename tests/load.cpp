@@ -0,0 +1,130 @@
+/*
+ *	GATEWAY LOAD
+ *
+ *		Messages per second against the number of modems: each modem is an
+ *		emulator on a pseudo terminal answering with a fixed latency, every
+ *		one gets the same number of messages and the clock runs until the last
+ *		GATEWAY_SMS event. One line per modem count, with -j also as JSON.
+ *
+ *		sim800c_load [-n messages per modem] [-t threads] [-l latency ms] [-j file] [modems...]
+*/
+
+#include "Sim800CLinux.h"
+#include "PtyModem.h"
+#include <vector>
+
+struct load_result
+{
+    uint8_t modems;
+    uint8_t threads;
+    uint32_t sent;
+    uint32_t failed;
+    double seconds;
+};
+
+static bool loadRun(uint8_t count,uint8_t threads,uint32_t messages,uint32_t latency,load_result &r)
+{
+    std::vector<PtyModem *> modems;
+    std::vector<uint32_t> queued(count,0),inFlight(count,0);
+    Sim800CGateway gw;
+    gateway_event e;
+    uint32_t ready=0,done=0,i;
+    uint64_t start;
+    bool ok=true;
+
+    for (i=0; i<count && ok; i++)
+    {
+        modems.push_back(new PtyModem());
+        modems[i]->modem.latency=latency;
+        ok=modems[i]->start() && gw.addModem(modems[i]->path)>=0;
+    }
+    ok=ok && gw.start(threads);
+    start=micros();
+    while (ok && ready<count)
+    {
+        if (gw.event(e) && e.kind==GATEWAY_READY) ready++;
+        else if (micros()-start>10000000ULL) ok=false;
+    }
+
+    r.modems=count;
+    r.threads=threads<count ? threads : count;
+    r.sent=0;
+    r.failed=0;
+    start=micros();
+    while (ok && done<count*messages)
+    {
+        // keep every outbox full, a message beyond it would fail at once
+        for (i=0; i<count; i++)
+        {
+            while (queued[i]<messages && inFlight[i]<SMS_OUTBOX_SIZE && gw.sendSms(i,"+989121234567","load test message"))
+            {
+                queued[i]++;
+                inFlight[i]++;
+            }
+        }
+        if (!gw.event(e))
+        {
+            delay(1);
+            continue;
+        }
+        if (e.kind!=GATEWAY_SMS) continue;
+        inFlight[e.modem]--;
+        done++;
+        if (e.result==OK) r.sent++;
+        else r.failed++;
+    }
+    r.seconds=(micros()-start)/1e6;
+
+    gw.stop();
+    for (i=0; i<modems.size(); i++) delete modems[i];
+    return ok;
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<int> counts;
+    std::vector<load_result> results;
+    const char *json=NULL;
+    uint32_t messages=50,latency=20;
+    uint8_t threads=4;
+    load_result r;
+    FILE *f;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i],"-n")==0 && i+1<argc) messages=atoi(argv[++i]);
+        else if (strcmp(argv[i],"-t")==0 && i+1<argc) threads=atoi(argv[++i]);
+        else if (strcmp(argv[i],"-l")==0 && i+1<argc) latency=atoi(argv[++i]);
+        else if (strcmp(argv[i],"-j")==0 && i+1<argc) json=argv[++i];
+        else counts.push_back(atoi(argv[i]));
+    }
+    if (counts.empty()) counts={ 1, 2, 4, 8, 16 };
+
+    printf("%7s %7s %7s %7s %9s %9s\n","modems","threads","sent","failed","seconds","msg/s");
+    for (size_t i=0; i<counts.size(); i++)
+    {
+        if (!loadRun(counts[i],threads,messages,latency,r))
+        {
+            fprintf(stderr,"%d modems: the gateway did not come up\n",counts[i]);
+            return 1;
+        }
+        results.push_back(r);
+        printf("%7u %7u %7u %7u %9.3f %9.1f\n",r.modems,r.threads,r.sent,r.failed,r.seconds,r.sent/r.seconds);
+        if (r.failed) return 1;
+    }
+
+    if (json!=NULL)
+    {
+        if ((f=fopen(json,"w"))==NULL) return 1;
+        fprintf(f,"[\n");
+        for (size_t i=0; i<results.size(); i++)
+        {
+            load_result &x=results[i];
+            fprintf(f,"  {\"modems\": %u, \"threads\": %u, \"sent\": %u, \"failed\": %u, \"seconds\": %.3f, \"per_second\": %.1f}%s\n",
+                    x.modems,x.threads,x.sent,x.failed,x.seconds,x.sent/x.seconds,i+1<results.size() ? "," : "");
+        }
+        fprintf(f,"]\n");
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ *	HOST TESTS
+ *
+ *		CHECK() reports a failed condition with its line and goes on, the
+ *		test program returns the number of failures so ctest sees them.
+ *		Each TEST_CASE is a function run() calls in order.
+*/
+
+#ifndef test_h
+#define test_h
+#include <stdio.h>
+
+static int testFailures=0;
+
+#define CHECK(cond) do { if (!(cond)) { testFailures++; fprintf(stderr,"%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#cond); } } while (0)
+#define CHECK_EQ(a,b) do { long long _a=(long long)(a), _b=(long long)(b); if (_a!=_b) { testFailures++; fprintf(stderr,"%s:%d: CHECK_EQ(%s,%s) failed: %lld != %lld\n",__FILE__,__LINE__,#a,#b,_a,_b); } } while (0)
+#define CHECK_STR(a,b) do { if (strcmp((a),(b))!=0) { testFailures++; fprintf(stderr,"%s:%d: CHECK_STR(%s,%s) failed: \"%s\" != \"%s\"\n",__FILE__,__LINE__,#a,#b,(a),(b)); } } while (0)
+
+#define RUN(test) do { int _before=testFailures; test(); printf("%-32s %s\n",#test,testFailures==_before ? "ok" : "FAILED"); } while (0)
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ *	No heap allocation on the receive path: a long session of URCs, reads,
+ *	deletes and status queries with operator new counted. The emulator
+ *	allocates freely, so it runs behind a Stream that pauses the count.
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include "test.h"
+#include <new>
+#include <stdlib.h>
+
+static bool counting=false;
+static uint32_t allocations=0;
+
+void *operator new(size_t size)
+{
+    if (counting) allocations++;
+    void *p=malloc(size ? size : 1);
+    if (p==NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p,size_t) noexcept { free(p); }
+void operator delete[](void *p,size_t) noexcept { free(p); }
+
+// Everything the emulator does is outside the count.
+class Uncounted
+{
+private:
+
+    bool _was;
+
+public:
+
+    Uncounted() : _was(counting) { counting=false; }
+    ~Uncounted() { counting=_was; }
+};
+
+class CountedLink : public Stream
+{
+public:
+
+    ModemEmulator &modem;
+
+    CountedLink(ModemEmulator &m) : modem(m) {}
+
+    int available() { Uncounted u; return modem.available(); }
+    int read() { Uncounted u; return modem.read(); }
+    int peek() { Uncounted u; return modem.peek(); }
+    size_t write(uint8_t b) { Uncounted u; return modem.write(b); }
+    using Print::write;
+};
+
+static uint8_t waitUrc(Sim800C &gsm)
+{
+    uint8_t type;
+    for (int i=0; i<100000; i++)
+    {
+        if ((type=gsm.check_receive_command())!=No_data) return type;
+    }
+    return No_data;
+}
+
+static void longSession()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    CountedLink link(modem);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+    int day,month,year,hour,minute,second;
+    uint32_t received=0;
+
+    clock.step=100;
+    gsm.setClock(clock);
+    gsm.begin(link,115200);
+    CHECK(modem.configured);
+
+    counting=true;
+    for (int i=0; i<500; i++)
+    {
+        {
+            Uncounted u;
+            modem.deliver("+989121234567","message "+std::to_string(i));
+            modem.urc("\r\nRING\r\n\r\n+CLIP: \"+989131112222\",145,\"\",0,\"\",0\r\n",20);
+        }
+        if (waitUrc(gsm)==Sms_received)
+        {
+            received++;
+            CHECK_EQ(gsm.readSms(gsm.sms_index,number,text),GETSMS_UNREAD_SMS);
+            CHECK(gsm.deleteSMS(gsm.sms_index));
+        }
+        CHECK_EQ(waitUrc(gsm),RING);
+        CHECK_EQ(waitUrc(gsm),Calling_with_number);
+        gsm.getCallStatus();
+        gsm.is_network_registered();
+        gsm.RTCtime(&day,&month,&year,&hour,&minute,&second);
+    }
+    counting=false;
+
+    CHECK_EQ(received,500);
+    CHECK_EQ(modem.sms.size(),0);
+    CHECK_EQ(allocations,0);
+    printf("receive path allocations over %u messages: %u\n",received,allocations);
+}
+
+int main()
+{
+    RUN(longSession);
+    return testFailures;
+}
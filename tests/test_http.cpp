@@ -0,0 +1,86 @@
+/*
+ *	HTTP client against the scripted modem: body windows, and a conditional
+ *	GET whose quoted ETag must reach the modem as a valid string parameter.
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include "test.h"
+
+static std::string body;
+static uint16_t doneStatus;
+static bool done;
+
+static void onBody(Sim800C &/*gsm*/,const uint8_t *data,uint16_t len,uint32_t offset)
+{
+    if (offset==body.size()) body.append((const char *)data,len);
+}
+
+static void onDone(Sim800C &/*gsm*/,uint16_t status,uint32_t /*length*/)
+{
+    doneStatus=status;
+    done=true;
+}
+
+static bool get(Sim800C &gsm,bool conditional)
+{
+    body.clear();
+    done=false;
+    if (!gsm.httpGet("http://example.com/data",onBody,onDone,conditional)) return false;
+    for (int i=0; i<200000 && !done; i++) gsm.poll();
+    return done;
+}
+
+static void conditionalGet()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    std::string sent;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.httpBody=std::string(150,'x')+"end";
+    modem.httpEtag="\"33a64df5\"";
+    CHECK(gsm.httpBearer("mcinet"));
+
+    CHECK(get(gsm,true));
+    CHECK_EQ(doneStatus,200);
+    CHECK(body==modem.httpBody);
+
+    CHECK(get(gsm,true));
+    CHECK_EQ(doneStatus,304);
+    CHECK(body.empty());
+    for (size_t i=0; i<modem.commands.size(); i++)
+    {
+        if (modem.commands[i].find("If-None-Match")!=std::string::npos) sent=modem.commands[i];
+    }
+    CHECK(sent=="AT+HTTPPARA=\"USERDATA\",\"If-None-Match: \\2233a64df5\\22\"");
+    CHECK(modem.httpUserData=="If-None-Match: \"33a64df5\"");
+
+    // a changed resource is fetched again
+    modem.httpEtag="\"5f2b\"";
+    CHECK(get(gsm,true));
+    CHECK_EQ(doneStatus,200);
+    CHECK(body==modem.httpBody);
+}
+
+// The emulator parses string parameters like the modem: an inner quote ends the string.
+static void strictParameters()
+{
+    const char *p;
+    std::string out;
+
+    p="\"If-None-Match: \"abc\"\"";
+    CHECK(!atString(p,out));
+    p="\"If-None-Match: \\22abc\\22\"";
+    CHECK(atString(p,out));
+    CHECK(out=="If-None-Match: \"abc\"");
+}
+
+int main()
+{
+    RUN(strictParameters);
+    RUN(conditionalGet);
+    return testFailures;
+}
@@ -0,0 +1,137 @@
+/*
+ *	The Linux layer: the SPSC queue across two threads, and a gateway of
+ *	modems on pseudo terminals serviced by worker threads.
+*/
+
+#include "Sim800CLinux.h"
+#include "PtyModem.h"
+#include "test.h"
+#include <errno.h>
+
+#define WAIT_MS		5000
+
+static void spscTwoThreads()
+{
+    static Sim800CSpsc<uint32_t,64> queue;
+    const uint32_t total=1000000;
+    uint32_t v,expect=0;
+    bool ordered=true;
+
+    std::thread producer([&]()
+    {
+        for (uint32_t i=0; i<total; )
+        {
+            if (queue.push(i)) i++;
+            else std::this_thread::yield();
+        }
+    });
+    while (expect<total)
+    {
+        if (!queue.pop(v))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        if (v!=expect) ordered=false;
+        expect++;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK_EQ(queue.size(),0);
+    CHECK(!queue.pop(v));
+}
+
+static bool waitEvent(Sim800CGateway &gw,gateway_event &e,uint8_t kind)
+{
+    uint32_t start=millis();
+    while (millis()-start<WAIT_MS)
+    {
+        if (gw.event(e) && e.kind==kind) return true;
+        delay(1);
+    }
+    return false;
+}
+
+static void gatewayOnPty()
+{
+    PtyModem modems[3];
+    Sim800CGateway gw;
+    gateway_event e;
+    uint8_t ready=0,i;
+
+    for (i=0; i<3; i++)
+    {
+        modems[i].modem.latency=5;
+        CHECK(modems[i].start());
+        CHECK_EQ(gw.addModem(modems[i].path),i);
+    }
+    modems[2].modem.on("AT+CUSD=1,\"*555#\"","\r\nERROR\r\n");
+    CHECK(gw.start(2));
+
+    while (ready<3 && waitEvent(gw,e,GATEWAY_READY))
+    {
+        CHECK_EQ(e.result,OK);
+        ready++;
+    }
+    CHECK_EQ(ready,3);
+
+    CHECK(gw.command(1,"AT+CSQ",1000,42));
+    CHECK(waitEvent(gw,e,GATEWAY_COMMAND));
+    CHECK_EQ(e.modem,1);
+    CHECK_EQ(e.tag,42);
+    CHECK_EQ(e.result,CMD_OK);
+
+    CHECK(gw.command(2,"AT+CUSD=1,\"*555#\"",1000,43));
+    CHECK(waitEvent(gw,e,GATEWAY_COMMAND));
+    CHECK_EQ(e.tag,43);
+    CHECK_EQ(e.result,CMD_ERROR);
+
+    CHECK(gw.sendSms(0,"+989121234567","over a pseudo terminal",7));
+    CHECK(waitEvent(gw,e,GATEWAY_SMS));
+    CHECK_EQ(e.modem,0);
+    CHECK_EQ(e.tag,7);
+    CHECK_EQ(e.result,OK);
+    {
+        std::lock_guard<std::mutex> guard(modems[0].lock);
+        CHECK(modems[0].modem.smsSent=="over a pseudo terminal");
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(modems[2].lock);
+        modems[2].modem.deliver("+989121234567","hi");
+    }
+    CHECK(waitEvent(gw,e,GATEWAY_URC));
+    CHECK_EQ(e.modem,2);
+    CHECK_EQ(e.type,Sms_received);
+    CHECK_EQ(e.index,1);
+
+    gw.stop();
+    CHECK_EQ(gw.dropped(),0);
+}
+
+// A rate termios has no constant for fails the open instead of running at 9600.
+static void unsupportedRate()
+{
+    PtyModem modem;
+    Sim800CTty tty;
+    Sim800CGateway gw;
+
+    CHECK(modem.start());
+    errno=0;
+    CHECK(!tty.open(modem.path,12345));
+    CHECK_EQ(errno,EINVAL);
+    CHECK_EQ(tty.fd(),-1);
+    CHECK(tty.open(modem.path,9600));
+    tty.close();
+
+    CHECK_EQ(gw.addModem(modem.path,250000),0);
+    CHECK(!gw.start(1));
+}
+
+int main()
+{
+    RUN(spscTwoThreads);
+    RUN(gatewayOnPty);
+    RUN(unsupportedRate);
+    return testFailures;
+}
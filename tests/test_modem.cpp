@@ -0,0 +1,899 @@
+/*
+ *	Boot and the everyday commands against the scripted modem.
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include "EEPROM.h"
+#include "test.h"
+
+static void bootRunningModem()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    CHECK(modem.configured);
+    CHECK_EQ(gsm.bootTiming().powerOn,0);
+    CHECK_EQ(modem.count("AT+CMGF=1"),0);		// sent chained, not on its own
+    CHECK(modem.settings["+CMGF"]=="1");
+    CHECK(modem.settings["+CNMI"]=="2,1,0,0,0");
+}
+
+static void bootSilentModem()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    uint32_t pulses=digitalWrites;
+
+    // the first probes go unanswered as if the modem were off
+    modem.on("AT",std::string(),3);
+    gsm.setClock(clock);
+    gsm.begin(modem,115200,DEFAULT_POWER_PIN);
+    CHECK(modem.configured);
+    CHECK(gsm.bootTiming().powerOn>0);
+    CHECK_EQ(digitalWrites-pulses,2);
+}
+
+static void readStoredSms()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.deliver("+989121234567","hello");
+    CHECK_EQ(gsm.check_receive_command(),No_data);		// the URC is still on its way
+    clock.advance(100000);
+    CHECK_EQ(gsm.check_receive_command(),Sms_received);
+    CHECK_EQ(gsm.sms_index,1);
+    CHECK_EQ(gsm.readSms(gsm.sms_index,number,text),GETSMS_UNREAD_SMS);
+    CHECK_STR(number,"9121234567");			// the legacy form drops "+98"
+    CHECK_STR(text,"hello");
+    CHECK_EQ(gsm.readSms(gsm.sms_index,number,text),GETSMS_READ_SMS);
+    CHECK_EQ(gsm.readSms(7,number,text),GETSMS_NO_SMS);
+}
+
+// A configuration line the modem keeps refusing: paced retries, then one command at a time.
+static void configRefused()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    modem.urc("\r\nSMS Ready\r\n");
+    modem.on("AT+CSMP",[](ModemEmulator &,const std::string &line)
+    {
+        return std::string(line.find("+CPMS")!=std::string::npos ? "\r\nERROR\r\n" : "\r\nOK\r\n");
+    });
+    modem.on("AT+CPMS","\r\nERROR\r\n");
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    CHECK_EQ(gsm.Setup(),ERROR);
+    CHECK(modem.count("AT+CSMP=17,167,0,0;")<2*BOOT_TIMEOUT/1000);
+    CHECK_EQ(modem.count("AT+CLIP=1"),2);
+    CHECK(modem.settings["+CNMI"]=="2,1,0,0,0");
+    CHECK(modem.settings["+CREG"]=="2");
+}
+
+// The descriptor is written only with a store, which then skips the configuration of a warm start.
+static void configStore()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800CConfigStore store;
+    uint32_t writes=EEPROM.writes;
+
+    {
+        Sim800C gsm;
+        gsm.setClock(clock);
+        gsm.begin(modem,115200);
+    }
+    CHECK_EQ(EEPROM.writes,writes);
+    CHECK_EQ(modem.count("AT+CSMP"),1);
+    {
+        Sim800C gsm;
+        gsm.setClock(clock);
+        gsm.setConfigStore(&store);
+        gsm.begin(modem,115200);
+        CHECK_EQ(gsm.bootTiming().powerOn,0);
+    }
+    CHECK(EEPROM.writes>writes);
+    CHECK_EQ(modem.count("AT+CSMP"),2);
+    {
+        Sim800C gsm;
+        gsm.setClock(clock);
+        gsm.setConfigStore(&store);
+        gsm.begin(modem,115200);
+    }
+    CHECK_EQ(modem.count("AT+CSMP"),2);
+}
+
+class CountingPrint : public Print
+{
+public:
+    size_t bytes;
+    CountingPrint() : bytes(0) {}
+    size_t write(uint8_t) { bytes++; return 1; }
+};
+
+// A Stream of the sketch keeps its rate: no AT+IPR, no report.
+static void baudOfForeignStream()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    CountingPrint out;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    gsm.benchmarkBaud(out);
+    CHECK_EQ(out.bytes,0);
+    CHECK_EQ(gsm.negotiateBaud(),115200);
+    CHECK_EQ(modem.count("AT+IPR"),0);
+}
+
+extern SoftwareSerial HwSwSerial;
+
+// The default port finds a modem at any rate of AT+IPR.
+static void detectRate()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    CHECK_EQ(gsm.detectBaud(),115200);		// a Stream of the sketch only answers or not
+    modem.on("AT",std::string());
+    CHECK_EQ(gsm.detectBaud(),0);
+    modem.clearRules();
+
+    HwSwSerial.peer=&modem;
+    modem.hostBaud=&HwSwSerial.baud;
+    modem.ipr=38400;
+    gsm.begin(9600);
+    CHECK_EQ(gsm.detectBaud(),9600);		// Setup() moved the modem to the rate of begin()
+    modem.ipr=38400;
+    CHECK_EQ(gsm.detectBaud(),38400);
+    CHECK_EQ(HwSwSerial.baud,38400);
+    modem.ipr=0;
+    HwSwSerial.peer=NULL;
+}
+
+// An MCU restart leaves the modem locked to the rate of the previous run: found, moved, never pulsed.
+static void bootLockedRate()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    uint32_t pulses=digitalWrites;
+
+    HwSwSerial.peer=&modem;
+    modem.hostBaud=&HwSwSerial.baud;
+    modem.ipr=115200;
+    gsm.setClock(clock);
+    gsm.begin(9600);
+    CHECK(modem.configured);
+    CHECK_EQ(digitalWrites-pulses,0);
+    CHECK_EQ(gsm.bootTiming().powerOn,0);
+    CHECK_EQ(modem.ipr,9600);
+    CHECK_EQ(HwSwSerial.baud,9600);
+    HwSwSerial.peer=NULL;
+}
+
+// Unrecognised lines never push a URC out of the full queue, lost events are counted.
+static void urcQueueFull()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    std::string seen;
+    uint8_t type;
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    for (i=0; i<URC_QUEUE_SIZE+2; i++) modem.urc("\r\nnoise "+std::to_string(i)+"\r\n");
+    modem.urc("\r\n+CMTI: \"SM\",3\r\n\r\nRING\r\n");
+    clock.advance(100000);
+    gsm.poll();
+    for (i=0; i<1000; i++)
+    {
+        type=gsm.check_receive_command();
+        if (type==Sms_received) seen+="sms;";
+        else if (type==RING)    seen+="ring;";
+    }
+    CHECK(seen=="sms;ring;");
+    CHECK_EQ(gsm.urcDropped(),0);
+
+    for (i=0; i<URC_QUEUE_SIZE+1; i++) modem.urc("\r\nRING\r\n");
+    clock.advance(100000);
+    gsm.poll();
+    CHECK_EQ(gsm.urcDropped(),1);
+}
+
+// With +CSMS service 1 the acknowledgement goes ahead of the commands already queued.
+static void directSmsAck()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+    size_t first;
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.on("AT+CSMS?","\r\n+CSMS: 1,1,1,1\r\n\r\nOK\r\n");
+    CHECK(gsm.setDirectSms(true,NULL,number,sizeof(number),text,sizeof(text)));
+    modem.on("AT+GMR",[](ModemEmulator &m,const std::string &)
+    {
+        m.urc("\r\n+CMT: \"+989132383246\",\"\",\"19/01/17,10:06:21+14\",145,4,0,0,\"+989350001500\",145,2\r\nhi\r\n");
+        return std::string("\r\nRevision:1418B05SIM800C32\r\n\r\nOK\r\n");
+    },1);
+    first=modem.commands.size();
+    CHECK(gsm.submit("AT+GMR\r\n",RESPON_OK,1000,NULL));
+    CHECK(gsm.submit("AT+CSQ\r\n",RESPON_OK,1000,NULL));
+    CHECK(gsm.submit("AT+CBC\r\n",RESPON_OK,1000,NULL));
+    for (i=0; i<10000 && gsm.busy(); i++) gsm.poll();
+    CHECK_STR(text,"hi");
+    CHECK_EQ(modem.commands.size()-first,4);
+    CHECK(modem.commands[first+1]=="AT+CNMA");
+}
+
+// Storage mode re-checks the SIM on each +CMTI and moves to the phone memory once it is full.
+static void storageFills()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.storageSize=2;
+    CHECK(gsm.setDirectSms(false,NULL,number,sizeof(number),text,sizeof(text)));
+    CHECK_EQ(modem.count("AT+CPMS=\"ME\""),0);
+    modem.deliver("+989121234567","one");
+    clock.advance(100000);
+    for (i=0; i<100000 && (i<1000 || gsm.busy()); i++) gsm.poll();
+    CHECK_EQ(modem.count("AT+CPMS?"),2);
+    CHECK_EQ(modem.count("AT+CPMS=\"ME\""),0);
+    modem.deliver("+989121234567","two");
+    clock.advance(100000);
+    for (i=0; i<100000 && (i<1000 || gsm.busy()); i++) gsm.poll();
+    CHECK_EQ(modem.count("AT+CPMS=\"ME\""),1);
+    modem.storageSize=3;
+    modem.deliver("+989121234567","three");
+    clock.advance(100000);
+    for (i=0; i<100000 && (i<1000 || gsm.busy()); i++) gsm.poll();
+    CHECK_EQ(modem.count("AT+CPMS?"),3);
+}
+
+static std::string listed;
+
+static void listSms(Sim800C &/*gsm*/,uint8_t index,uint8_t /*status*/,const char * /*phone_number*/,const char *SMS_text)
+{
+    listed+=std::to_string(index)+"="+SMS_text+";";
+}
+
+// UCS2 bodies are hex in text mode while the +CSDH length counts octets.
+static void readUnicodeSms()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.sms[1]={ "REC UNREAD", "+989121234567", "06330644062706450020", 8, "" };
+    modem.sms[2]={ "REC UNREAD", "+989121234567", "plain", 0, "" };
+    CHECK_EQ(gsm.readSms(1,number,sizeof(number),text,sizeof(text)),GETSMS_UNREAD_SMS);
+    CHECK_STR(text,"06330644062706450020");
+    CHECK(!gsm.smsTruncated());
+    CHECK_EQ(gsm.readSms(2,number,sizeof(number),text,sizeof(text)),GETSMS_UNREAD_SMS);
+    CHECK_STR(text,"plain");
+
+    // +CMGL has no DCS, the rest of the hex body continues the text
+    CHECK_EQ(gsm.readAllSms(false,listSms,number,sizeof(number),text,sizeof(text),false),2);
+    CHECK(listed=="1=06330644062706450020;2=plain;");
+
+    CHECK(gsm.setDirectSms(true,NULL,number,sizeof(number),text,sizeof(text)));
+    modem.urc("\r\n+CMT: \"+989132383246\",\"\",\"19/01/17,10:06:21+14\",145,4,0,8,\"+989350001500\",145,4\r\n06330644\r\n");
+    clock.advance(100000);
+    for (int i=0; i<1000; i++) gsm.poll();
+    CHECK_STR(text,"06330644");
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+}
+
+// Parts of one message read in any order come out whole with the last one.
+static void longSmsOutOfOrder()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.on("AT+CMGR=1","\r\n+CMGR: 0,,36\r\n00440C9189191232547600006210119100008012050003420303E8E8B49C0C8287E57417\r\n\r\nOK\r\n",1);
+    modem.deliver("+989121234567","third part.",0,"050003420303");
+    modem.deliver("+989121234567","First part, ",0,"050003420301");
+    modem.deliver("+989121234567","second part, ",0,"050003420302");
+
+    CHECK_EQ(gsm.readLongSms(1,number,sizeof(number),text,sizeof(text)),GETSMS_PART_SMS);
+    CHECK_STR(text,"");
+    CHECK_EQ(gsm.readLongSms(2,number,sizeof(number),text,sizeof(text)),GETSMS_PART_SMS);
+    CHECK_EQ(gsm.readLongSms(3,number,sizeof(number),text,sizeof(text)),GETSMS_UNREAD_SMS);
+    CHECK_STR(number,"+989121234567");
+    CHECK_STR(text,"First part, second part, third part.");
+    CHECK(!gsm.smsTruncated());
+    CHECK_EQ(modem.count("AT+CMGF=0"),3);
+    CHECK(modem.settings["+CMGF"]=="1");
+
+    // a part read without a text buffer is only cached
+    modem.deliver("+989121234567","lost",0,"050003430201");
+    CHECK_EQ(gsm.readLongSms(4,number,sizeof(number),NULL,0),GETSMS_PART_SMS);
+}
+
+// The part added to least recently goes when the cache is full, its message never completes.
+static void longSmsEviction()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[400];
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.deliver("+989121234567",std::string(150,'A'),0,"050003010201");
+    modem.deliver("+989121234567",std::string(150,'B'),0,"050003020201");
+    modem.deliver("+989121234567",std::string(150,'C'),0,"050003030201");
+    modem.deliver("+989121234567","a",0,"050003010202");
+    modem.deliver("+989121234567","c",0,"050003030202");
+
+    for (uint8_t i=1; i<=4; i++)
+    {
+        CHECK_EQ(gsm.readLongSms(i,number,sizeof(number),text,sizeof(text)),GETSMS_PART_SMS);
+        CHECK_STR(text,"");
+    }
+    CHECK_EQ(gsm.readLongSms(5,number,sizeof(number),text,sizeof(text)),GETSMS_UNREAD_SMS);
+    CHECK(std::string(text)==std::string(150,'C')+"c");
+}
+
+// 180 characters go as two concatenated parts, both written as the known PDUs.
+static void sendLongSmsVectors()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    std::vector<std::string> pdus;
+    std::string text;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.on("AT+CMGS=",[&pdus](ModemEmulator &m,const std::string &)
+    {
+        m.expectData(0,[&pdus](ModemEmulator &,const std::string &pdu)
+        {
+            pdus.push_back(pdu);
+            return std::string("\r\n+CMGS: 12\r\n\r\nOK\r\n");
+        });
+        return std::string("\r\n> ");
+    });
+    for (int i=0; i<4; i++) text+="The quick brown fox jumps over the lazy dog. ";
+    modem.commands.clear();
+    CHECK_EQ(gsm.sendLongSms("+989121234567",text.c_str()),OK);
+    CHECK_EQ(modem.commands.size(),4);
+    if (modem.commands.size()==4)
+    {
+        CHECK(modem.commands[0]=="AT+CMGF=0");
+        CHECK(modem.commands[1]=="AT+CMGS=154");
+        CHECK(modem.commands[2]=="AT+CMGS=44");
+        CHECK(modem.commands[3]=="AT+CMGF=1");
+    }
+    CHECK_EQ(pdus.size(),2);
+    if (pdus.size()==2)
+    {
+        CHECK(pdus[0]=="0051000C918919123254760000A7A0050003010201A8E832285E4F8FD720B1FC7D7783CC6F3C485D6FC3E7A0B7BD2C07D1D1"
+                       "65103BACCF83C8EFB30B44459741F17A7ABC0689E5EFBB1B647EE341EA7A1B3E07BDED6539888E2E83D8617D1E447E9F5D20"
+                       "2ABA0C8AD7D3E335482C7FDFDD20F31B0F52D7DBF039E86D2FCB41747419C40EEBF320F2FBEC0251D16550BC9E1EAF4162F9"
+                       "FBEE0699DF");
+        CHECK(pdus[1]=="0051000C918919123254760000A722050003010202F02075BD0D9F83DEF6B21C44479741ECB03E0F22BFCF2E10");
+    }
+}
+
+// A refused read or send still leaves the modem in text mode.
+static void longSmsTextModeAfterError()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+    std::string longText(200,'x');
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.on("AT+CMGR=","\r\n+CMS ERROR: 321\r\n",1);
+    CHECK_EQ(gsm.readLongSms(1,number,sizeof(number),text,sizeof(text)),ERROR);
+    CHECK(modem.settings["+CMGF"]=="1");
+
+    modem.on("AT+CMGS=","\r\n+CMS ERROR: 500\r\n",1);
+    CHECK_EQ(gsm.sendLongSms("+989121234567",longText.c_str()),ERROR);
+    CHECK_EQ(modem.count("AT+CMGS="),1);
+    CHECK(modem.settings["+CMGF"]=="1");
+    CHECK(modem.commands.back()=="AT+CMGF=1");
+}
+
+static void whitelistAndClock()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char numbers[400];
+    int day,month,year,hour,minute,second;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.whiteMode=1;
+    modem.whitelist[0]="09121234567";
+    modem.whitelist[4]="09357654321";
+    CHECK_EQ(gsm.whiteListStatus(numbers,sizeof(numbers)),1);
+    CHECK(strstr(numbers,"09121234567")!=NULL);
+    CHECK(strstr(numbers,"09357654321")!=NULL);
+
+    gsm.RTCtime(&day,&month,&year,&hour,&minute,&second);
+    CHECK_EQ(day,17);
+    CHECK_EQ(month,1);
+    CHECK_EQ(hour,10);
+    CHECK_EQ(second,21);
+}
+
+// The mirror answers without the modem, follows sync and removal, and compares digits, not hashes.
+static void whitelistMirror()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    const char *numbers[]={ "09121234567", "+989120022782", "09351112233" };
+    size_t sent;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.whiteMode=1;
+    modem.whitelist[0]="09121234567";
+    modem.whitelist[4]="09357654321";
+    CHECK(gsm.whiteListLoad());
+    sent=modem.commands.size();
+    CHECK(gsm.isAuthorized("+989121234567"));
+    CHECK(gsm.isAuthorized("09357654321"));
+    CHECK(!gsm.isAuthorized("09357654320"));
+    CHECK(!gsm.isAuthorized("4321"));
+    CHECK(!gsm.isAuthorized(""));
+    CHECK_EQ(modem.commands.size(),sent);
+
+    // only the slots that change are written, slot 5 is emptied
+    CHECK_EQ(gsm.whiteListSync(1,numbers,3),3);
+    CHECK_EQ(modem.count("AT+CWHITELIST="),3);
+    CHECK(modem.whitelist[1]=="+989120022782");
+    CHECK(modem.whitelist[2]=="09351112233");
+    CHECK(modem.whitelist[4]=="");
+    CHECK(!gsm.isAuthorized("09357654321"));
+    CHECK(gsm.isAuthorized("09120022782"));
+    CHECK(gsm.isAuthorized("09351112233"));
+    CHECK_EQ(gsm.whiteListSync(1,numbers,3),0);
+
+    // 9120239199 has the FNV-1a hash of the listed 9120022782
+    CHECK(!gsm.isAuthorized("+989120239199"));
+
+    // a fresh load sees what sync wrote
+    Sim800C other;
+    other.setClock(clock);
+    other.begin(modem,115200);
+    CHECK(other.whiteListLoad());
+    CHECK(other.isAuthorized("+989351112233"));
+    CHECK(!other.isAuthorized("09357654321"));
+
+    // disabling leaves the numbers in place
+    CHECK_EQ(gsm.whiteListSync(Disable,NULL,0),0);
+    CHECK_EQ(modem.whiteMode,0);
+    CHECK(gsm.isAuthorized("09121234567"));
+
+    // with the list off every caller gets through, until it is on again
+    CHECK(gsm.isAuthorized("09357654321"));
+    CHECK(gsm.isAuthorized(""));
+    CHECK_EQ(gsm.whiteListSync(Enable_call_and_SMS,numbers,3),1);
+    CHECK_EQ(modem.whiteMode,Enable_call_and_SMS);
+    CHECK(!gsm.isAuthorized("09357654321"));
+    CHECK(gsm.isAuthorized("09351112233"));
+    Sim800C unloaded;
+    unloaded.setClock(clock);
+    unloaded.begin(modem,115200);
+    CHECK(!unloaded.isAuthorized("09351112233"));
+}
+
+// reset() gives up after BOOT_TIMEOUT when the modem stays silent or never reports SMS Ready.
+static void resetBounded()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    uint64_t start;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.urc("\r\nSMS Ready\r\n",2000);
+    CHECK_EQ(gsm.reset(),OK);
+
+    start=clock.micros();
+    CHECK_EQ(gsm.reset(),ERROR);
+    CHECK(clock.micros()-start<(BOOT_TIMEOUT+5000)*1000ULL);
+
+    modem.on("AT","");
+    start=clock.micros();
+    CHECK_EQ(gsm.reset(),ERROR);
+    CHECK(clock.micros()-start<(BOOT_TIMEOUT+5000)*1000ULL);
+}
+
+// A PWRKEY pulse returns at once, poll() raises the pin and waits out the settle time.
+static void powerPulseInPoll()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    uint32_t pulses;
+    uint64_t start;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200,DEFAULT_POWER_PIN);
+    CHECK(!gsm.powerBusy());
+    pulses=digitalWrites;
+    start=clock.micros();
+    gsm.PowerOff();
+    CHECK(clock.micros()-start<1000);
+    CHECK(gsm.powerBusy());
+    CHECK_EQ(digitalWrites-pulses,1);
+
+    gsm.poll();
+    CHECK_EQ(digitalWrites-pulses,1);
+    clock.advance(POWER_PULSE*1000ULL);
+    gsm.poll();
+    CHECK_EQ(digitalWrites-pulses,2);
+    CHECK(gsm.powerBusy());
+    clock.advance(POWER_OFF_SETTLE*1000ULL);
+    gsm.poll();
+    CHECK(!gsm.powerBusy());
+}
+
+static const char *calledNumber;
+static uint8_t callResult;
+static int callsDone;
+
+static void callDone(Sim800C &/*gsm*/,const char *number,uint8_t result)
+{
+    calledNumber=number;
+    callResult=result;
+    callsDone++;
+}
+
+// ringAndDrop() returns at once, poll() dials, lets it ring for ringTime and hangs up.
+static void ringAndDropCall()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    uint32_t start;
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    callsDone=0;
+    CHECK(gsm.ringAndDrop("+989131112222",2,2000,callDone));
+    CHECK_EQ(gsm.callState(),CALL_DIALING);
+    CHECK(!gsm.ringAndDrop("+989131112222"));
+    CHECK_EQ(modem.count("ATD"),0);
+    start=clock.millis();
+    for (i=0; i<200000 && callsDone==0; i++) gsm.poll();
+    CHECK_EQ(callsDone,1);
+    CHECK_EQ(callResult,MO_RING);
+    CHECK_STR(calledNumber,"+989131112222");
+    CHECK(clock.millis()-start>=2000);
+    CHECK_EQ(modem.count("ATD+989131112222;"),1);
+    CHECK_EQ(modem.count("ATH"),1);
+    CHECK_EQ(gsm.callState(),CALL_IDLE);
+
+    // a busy callee is tried again, then reported
+    modem.on("ATD","\r\nOK\r\n");
+    CHECK(gsm.ringAndDrop("09357654321",2,2000,callDone));
+    modem.urc("\r\nBUSY\r\n",1000);
+    for (i=0; i<200000 && gsm.callState()!=CALL_DIALING; i++) gsm.poll();
+    for (i=0; i<200000 && modem.count("ATD09357654321;")<2; i++) gsm.poll();
+    modem.urc("\r\nBUSY\r\n",1000);
+    for (i=0; i<200000 && callsDone==1; i++) gsm.poll();
+    CHECK_EQ(callsDone,2);
+    CHECK_EQ(callResult,BUSY);
+    CHECK_EQ(modem.count("ATD09357654321;"),2);
+
+    // cancelled while dialing, hung up without a retry
+    CHECK(gsm.ringAndDrop("09357654321",3,2000,callDone));
+    for (i=0; i<200000 && modem.count("ATD09357654321;")<3; i++) gsm.poll();
+    gsm.cancelCall();
+    for (i=0; i<200000 && callsDone==2; i++) gsm.poll();
+    CHECK_EQ(callsDone,3);
+    CHECK_EQ(callResult,ERROR);
+    CHECK_EQ(modem.count("ATD09357654321;"),3);
+    CHECK(!gsm.ringAndDrop("+98913111222233334444"));
+}
+
+// The final result of every failed command is kept with its class and number.
+static void lastResultClasses()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.on("ATI","\r\n+CME ERROR: 10\r\n",1);
+    gsm.getProductInfo();
+    CHECK_EQ(gsm.lastResult().type,RESULT_CME);
+    CHECK_EQ(gsm.lastResult().code,10);
+
+    modem.on("ATI","\r\n+CME ERROR: SIM not inserted\r\n",1);
+    gsm.getProductInfo();
+    CHECK_EQ(gsm.lastResult().type,RESULT_CME);
+    CHECK_EQ(gsm.lastResult().code,10);
+
+    modem.on("ATI","\r\n+CMS ERROR: 500\r\n",1);
+    gsm.getProductInfo();
+    CHECK_EQ(gsm.lastResult().type,RESULT_CMS);
+    CHECK_EQ(gsm.lastResult().code,500);
+
+    modem.on("ATI","\r\n+CMS ERROR: unknown error\r\n",1);
+    gsm.getProductInfo();
+    CHECK_EQ(gsm.lastResult().type,RESULT_CMS);
+    CHECK_EQ(gsm.lastResult().code,RESULT_CODE_UNKNOWN);
+
+    modem.on("ATI","\r\nERROR\r\n",1);
+    gsm.getProductInfo();
+    CHECK_EQ(gsm.lastResult().type,RESULT_ERROR);
+    CHECK_EQ(gsm.lastResult().code,0);
+
+    modem.on("ATI","",1);
+    gsm.getProductInfo();
+    CHECK_EQ(gsm.lastResult().type,RESULT_TIMEOUT);
+
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+    CHECK_EQ(gsm.lastResult().type,RESULT_OK);
+    CHECK_EQ(gsm.lastResult().code,0);
+}
+
+// The outbox takes what fits one message, escaped characters counted as two septets.
+static void outboxTextLength()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    std::string fits(160,'a'),escaped(159,'a');
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    CHECK(!gsm.enqueueSms("+989121234567",(fits+"a").c_str()));
+    CHECK(!gsm.enqueueSms("+989121234567",(escaped+"[").c_str()));
+    CHECK_EQ(gsm.outboxPending(),0);
+    escaped.resize(158);
+    escaped+="[";
+    CHECK(gsm.enqueueSms("+989121234567",escaped.c_str()));
+    CHECK(gsm.enqueueSms("+989121234567",fits.c_str()));
+    for (i=0; i<100000 && gsm.outboxPending(); i++) gsm.poll();
+    CHECK_EQ(gsm.outboxPending(),0);
+    CHECK(modem.smsSent==fits);
+}
+
+static int networkChanges;
+
+static void networkChanged(Sim800C &/*gsm*/,const network_status &/*status*/)
+{
+    networkChanges++;
+}
+
+// Registration and signal come from the cache, AT+CREG? and AT+CSQ only when it has nothing fresh.
+static void networkCache()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    size_t csq;
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    gsm.onNetworkChange(networkChanged);
+    networkChanges=0;
+
+    // no +CREG report during boot: its one AT+CREG? filled the cache
+    CHECK_EQ(modem.count("AT+CREG?"),1);
+    CHECK(gsm.networkStatus().regTime!=0);
+    CHECK_EQ(gsm.networkStatus().registration,1);
+    CHECK_EQ(gsm.networkStatus().lac,0x1A2B);
+    CHECK_EQ(gsm.networkStatus().ci,0x3C4D);
+    CHECK_EQ(gsm.is_network_registered(),REG_REGISTERED);
+    CHECK_EQ(modem.count("AT+CREG?"),1);
+
+    // the reports keep it current without a query
+    modem.urc("\r\n+CREG: 0\r\n");
+    clock.advance(100000);
+    for (i=0; i<1000 && gsm.networkStatus().registration!=0; i++) gsm.poll();
+    CHECK_EQ(gsm.is_network_registered(),REG_NOT_REGISTERED);
+    modem.urc("\r\n+CREG: 5,\"1A2B\",\"3C4E\"\r\n");
+    clock.advance(100000);
+    for (i=0; i<1000 && gsm.networkStatus().registration!=5; i++) gsm.poll();
+    CHECK_EQ(gsm.is_network_registered(),REG_REGISTERED);
+    CHECK_EQ(gsm.networkStatus().ci,0x3C4E);
+    CHECK_EQ(modem.count("AT+CREG?"),1);
+    CHECK_EQ(networkChanges,2);
+
+    // the first signalQuality() asks, a fresh value answers from the cache, a stale one asks again
+    CHECK_EQ(gsm.networkStatus().csqTime,0);
+    CHECK(gsm.signalQuality()=="+CSQ: 20,0");
+    CHECK(gsm.signalQuality()=="+CSQ: 20,0");
+    csq=modem.count("AT+CSQ");
+    CHECK_EQ(csq,1);
+    modem.on("AT+CSQ","\r\n+CSQ: 11,3\r\n\r\nOK\r\n",1);
+    clock.advance(NET_CSQ_INTERVAL*1000ULL);
+    CHECK(gsm.signalQuality()=="+CSQ: 11,3");
+    CHECK_EQ(modem.count("AT+CSQ"),csq+1);
+    CHECK_EQ(gsm.networkStatus().rssi,11);
+
+    // a refused AT+CSQ leaves the cache as it was
+    modem.on("AT+CSQ","\r\nERROR\r\n",1);
+    clock.advance(NET_CSQ_INTERVAL*1000ULL);
+    gsm.signalQuality();
+    CHECK_EQ(gsm.networkStatus().rssi,11);
+    CHECK_EQ(gsm.networkStatus().ber,3);
+
+    // poll() refreshes it in the background once registered
+    clock.advance(NET_CSQ_INTERVAL*1000ULL);
+    csq=modem.count("AT+CSQ");
+    for (i=0; i<10000 && gsm.networkStatus().rssi!=20; i++) gsm.poll();
+    CHECK_EQ(modem.count("AT+CSQ"),csq+1);
+    CHECK_EQ(gsm.networkStatus().rssi,20);
+
+    // a boot whose AT+CREG? failed leaves the cache empty, the next call asks again
+    ModemEmulator refused(&clock);
+    Sim800C late;
+    refused.on("AT+CREG?","\r\nERROR\r\n",1);
+    late.setClock(clock);
+    late.begin(refused,115200);
+    CHECK_EQ(late.networkStatus().regTime,0);
+    CHECK_EQ(late.is_network_registered(),REG_REGISTERED);
+    CHECK_EQ(refused.count("AT+CREG?"),2);
+    CHECK_EQ(late.networkStatus().ci,0x3C4D);
+}
+
+// Messages go to the modem with the shortest outbox, ties taken in turn after the last one used.
+static void poolLeastBusy()
+{
+    VirtualClock clock;
+    ModemEmulator modems[3]={ ModemEmulator(&clock), ModemEmulator(&clock), ModemEmulator(&clock) };
+    Sim800C gsm[3];
+    Sim800CPool pool;
+    int i;
+
+    for (i=0; i<3; i++)
+    {
+        gsm[i].setClock(clock);
+        gsm[i].begin(modems[i],115200);
+        CHECK(pool.add(gsm[i]));
+    }
+    CHECK(!pool.add(gsm[0]));
+
+    // six messages, two rounds over the three modems
+    for (i=0; i<6; i++) CHECK(pool.enqueueSms("+989121234567","round robin")==&gsm[i%3]);
+    for (i=0; i<3; i++) CHECK_EQ(gsm[i].outboxPending(),2);
+
+    // a shorter outbox wins over the turn
+    for (i=0; i<100000 && gsm[2].outboxPending(); i++) gsm[2].poll();
+    CHECK_EQ(gsm[2].outboxPending(),0);
+    CHECK(pool.leastBusy()==&gsm[2]);
+    CHECK(pool.enqueueSms("+989121234567","shortest")==&gsm[2]);
+    CHECK(pool.enqueueSms("+989121234567","shortest")==&gsm[2]);
+    CHECK(pool.enqueueSms("+989121234567","tie")==&gsm[0]);
+
+    // full outboxes are never chosen
+    while (gsm[0].outboxPending()<SMS_OUTBOX_SIZE) CHECK(gsm[0].enqueueSms("+989121234567","filler"));
+    while (gsm[1].outboxPending()<SMS_OUTBOX_SIZE) CHECK(gsm[1].enqueueSms("+989121234567","filler"));
+    while (gsm[2].outboxPending()<SMS_OUTBOX_SIZE) CHECK(pool.enqueueSms("+989121234567","last room")==&gsm[2]);
+    CHECK(pool.leastBusy()==NULL);
+    CHECK(pool.enqueueSms("+989121234567","no room")==NULL);
+}
+
+// Counts the waits of blocking calls, virtual time passes in them.
+class IdleClock : public VirtualClock
+{
+public:
+
+    uint32_t idles;
+    uint32_t longest;
+
+    IdleClock() : idles(0), longest(0) {}
+
+    void idle(uint32_t ms)
+    {
+        idles++;
+        if (ms>longest) longest=ms;
+        advance((uint64_t)ms*1000);
+    }
+};
+
+// A slow boot in a pool waits in the clock, the modem already up keeps sending meanwhile.
+static void poolBootIdles()
+{
+    IdleClock clock;
+    ModemEmulator modems[2]={ ModemEmulator(&clock), ModemEmulator(&clock) };
+    Sim800C gsm[2];
+    Sim800CPool pool;
+
+    gsm[0].setClock(clock);
+    gsm[1].setClock(clock);
+    CHECK(pool.add(gsm[0]));
+    CHECK(pool.add(gsm[1]));
+    gsm[0].begin(modems[0],115200);
+    CHECK(gsm[0].enqueueSms("+989121234567","during the boot"));
+
+    clock.idles=0;
+    modems[1].on("AT",std::string(),3);
+    gsm[1].begin(modems[1],115200,DEFAULT_POWER_PIN);
+    CHECK(modems[1].configured);
+    CHECK(clock.idles>0);
+    CHECK(clock.longest<=IDLE_TICK);
+    CHECK_EQ(gsm[0].outboxPending(),0);
+    CHECK(modems[0].smsSent=="during the boot");
+}
+
+int main()
+{
+    RUN(bootRunningModem);
+    RUN(bootSilentModem);
+    RUN(configRefused);
+    RUN(configStore);
+    RUN(baudOfForeignStream);
+    RUN(detectRate);
+    RUN(bootLockedRate);
+    RUN(readStoredSms);
+    RUN(readUnicodeSms);
+    RUN(longSmsOutOfOrder);
+    RUN(longSmsEviction);
+    RUN(sendLongSmsVectors);
+    RUN(longSmsTextModeAfterError);
+    RUN(urcQueueFull);
+    RUN(directSmsAck);
+    RUN(storageFills);
+    RUN(whitelistAndClock);
+    RUN(whitelistMirror);
+    RUN(resetBounded);
+    RUN(powerPulseInPoll);
+    RUN(ringAndDropCall);
+    RUN(lastResultClasses);
+    RUN(outboxTextLength);
+    RUN(networkCache);
+    RUN(poolLeastBusy);
+    RUN(poolBootIdles);
+    return testFailures;
+}
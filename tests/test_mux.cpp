@@ -0,0 +1,73 @@
+/*
+ *	Two Sim800C on channels of one multiplexed link: each boots over its own
+ *	DLCI without touching the rate or the PWRKEY of the shared modem.
+*/
+
+#include "Sim800C.h"
+#include "Sim800CMux.h"
+#include "ModemEmulator.h"
+#include "test.h"
+
+static void twoChannels()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800CMux mux;
+    Sim800C gsm,sms;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+    uint32_t pulses=digitalWrites;
+    uint8_t type=No_data;
+    int i;
+
+    mux.setClock(clock);
+    mux.begin(modem);
+    CHECK(mux.start());
+    CHECK(modem.muxed);
+    gsm.setClock(clock);
+    sms.setClock(clock);
+    gsm.begin(mux.channel(0),115200);
+    sms.begin(mux.channel(1),115200);
+    CHECK_EQ(digitalWrites-pulses,0);
+    CHECK_EQ(modem.count("AT+IPR"),0);
+    CHECK_EQ(modem.count("ATE0;+IPR"),0);
+    CHECK_EQ(modem.count("ATE0"),2);
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+
+    // the +CMTI arrives on the first channel, the message is read on the second
+    modem.deliver("+989121234567","over the mux");
+    clock.advance(100000);
+    for (i=0; i<1000 && type==No_data; i++) type=gsm.check_receive_command();
+    CHECK_EQ(type,Sms_received);
+    CHECK_EQ(sms.readSms(gsm.sms_index,number,sizeof(number),text,sizeof(text)),GETSMS_UNREAD_SMS);
+    CHECK_STR(number,"+989121234567");
+    CHECK_STR(text,"over the mux");
+    CHECK_EQ(mux.badFrames,0);
+}
+
+// A channel that does not answer yet is waited for, never powered on.
+static void channelNotAnswering()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800CMux mux;
+    Sim800C gsm;
+    uint32_t pulses=digitalWrites;
+
+    mux.setClock(clock);
+    mux.begin(modem);
+    CHECK(mux.start());
+    modem.on("AT",std::string(),2);
+    gsm.setClock(clock);
+    gsm.begin(mux.channel(0),115200);
+    CHECK_EQ(digitalWrites-pulses,0);
+    CHECK_EQ(gsm.bootTiming().powerOn,0);
+    CHECK(modem.configured);
+}
+
+int main()
+{
+    RUN(twoChannels);
+    RUN(channelNotAnswering);
+    return testFailures;
+}
@@ -0,0 +1,125 @@
+/*
+ *	Blocking calls made from URC handlers and command callbacks while
+ *	another blocking call waits for its reply.
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include "test.h"
+
+static int nestedStatus;
+static bool nestedRan;
+
+static void bootWith(Sim800C &gsm,ModemEmulator &modem,VirtualClock &clock)
+{
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    modem.callStatus=3;
+}
+
+static void clipHandler(Sim800C &gsm,const urc_event &/*event*/)
+{
+    nestedStatus=gsm.getCallStatus();
+    nestedRan=true;
+}
+
+// A +CLIP arriving during getProductInfo(): the handler runs after it returns.
+static void handlerDuringBlockingCall()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    bootWith(gsm,modem,clock);
+    gsm.onUrc(Calling_with_number,clipHandler);
+    modem.on("ATI",[](ModemEmulator &m,const std::string &)
+    {
+        m.urc("\r\n+CLIP: \"+989131112222\",145,\"\",0,\"\",0\r\n");
+        return std::string("\r\nSIM800 R14.18\r\n\r\nOK\r\n");
+    },1);
+    nestedRan=false;
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+    CHECK(!nestedRan);
+    for (int i=0; i<1000 && !nestedRan; i++) gsm.poll();
+    CHECK(nestedRan);
+    CHECK_EQ(nestedStatus,3);
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+}
+
+static void statusCallback(Sim800C &gsm,uint8_t /*result*/)
+{
+    nestedStatus=gsm.getCallStatus();
+    nestedRan=true;
+}
+
+// An asynchronous command finishes while a blocking one is queued behind it: its callback's call goes first.
+static void callbackAheadOfQueued()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    bootWith(gsm,modem,clock);
+    nestedRan=false;
+    CHECK(gsm.submit("AT\r\n",RESPON_OK,1000,statusCallback));
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+    CHECK(nestedRan);
+    CHECK_EQ(nestedStatus,3);
+    CHECK_EQ(modem.count("AT+CPAS"),1);
+    CHECK(modem.commands.back()=="ATI");
+}
+
+static void networkCallback(Sim800C &gsm,const network_status &/*status*/)
+{
+    nestedStatus=gsm.getCallStatus();
+    nestedRan=true;
+}
+
+// A callback inside the wait of a command already on the line: refused, the outer reply is intact.
+static void callbackRefusedWhileWaiting()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    bootWith(gsm,modem,clock);
+    gsm.onNetworkChange(networkCallback);
+    modem.on("ATI",[](ModemEmulator &m,const std::string &)
+    {
+        m.urc("\r\n+CREG: 5,\"1A2B\",\"3C4D\"\r\n");
+        return std::string("\r\nSIM800 R14.18\r\n\r\nOK\r\n");
+    },1);
+    nestedRan=false;
+    nestedStatus=-1;
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+    CHECK(nestedRan);
+    CHECK_EQ(nestedStatus,0);
+    CHECK_EQ(modem.count("AT+CPAS"),0);
+    CHECK_EQ(gsm.getCallStatus(),3);
+}
+
+// The other modems of a pool keep working while miss_call() waits for the call.
+static void missCallPollsPool()
+{
+    VirtualClock clock;
+    ModemEmulator caller(&clock),other(&clock);
+    Sim800C gsm,peer;
+    Sim800CPool pool;
+
+    pool.add(gsm);
+    pool.add(peer);
+    bootWith(gsm,caller,clock);
+    bootWith(peer,other,clock);
+    CHECK(peer.enqueueSms("+989121234567","meanwhile"));
+    CHECK_EQ(gsm.miss_call("+989131112222",1),OK);
+    CHECK(other.smsSent=="meanwhile");
+}
+
+int main()
+{
+    RUN(handlerDuringBlockingCall);
+    RUN(callbackAheadOfQueued);
+    RUN(callbackRefusedWhileWaiting);
+    RUN(missCallPollsPool);
+    return testFailures;
+}
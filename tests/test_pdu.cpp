@@ -0,0 +1,200 @@
+/*
+ *	The PDU encoder, the streaming decoder and the reassembly cache on their
+ *	own, against vectors built outside the library.
+*/
+
+#include "Sim800CPdu.h"
+#include "test.h"
+#include <string>
+
+class HexSink : public Print
+{
+public:
+
+    std::string hex;
+
+    size_t write(uint8_t b) { hex+=(char)b; return 1; }
+    using Print::write;
+};
+
+struct decoded
+{
+    char number[20];
+    char text[64];
+    Sim800CPduDecoder pdu;
+};
+
+static void decode(decoded &d,const char *hex,uint8_t numberSize=sizeof(decoded::number),uint16_t textSize=sizeof(decoded::text))
+{
+    d.pdu.begin(d.number,numberSize,d.text,textSize);
+    while (*hex) d.pdu.put(*hex++);
+}
+
+static void gsm7Packing()
+{
+    HexSink out;
+    const char *text="hellohello";
+
+    CHECK_EQ(pduSeptets(text),10);
+    CHECK_EQ(pduWriteSubmit(out,"+46708251358",text,text+10,0,0,0),out.hex.size());
+    CHECK_STR(out.hex.c_str(),"0011000B916407281553F80000A70AE8329BFD4697D9EC37");
+    CHECK_EQ(pduSubmitLength("+46708251358",10,false),out.hex.size()/2-1);
+}
+
+static void gsm7Escapes()
+{
+    HexSink out;
+    decoded d;
+    const char *text="[1]{2}";
+    const char *end;
+    char longText[160];
+    uint8_t septets;
+
+    // every escaped character takes two septets, ESC then its code
+    CHECK_EQ(pduSeptets(text),10);
+    pduWriteSubmit(out,"+989121234567",text,text+6,0,0,0);
+    CHECK_STR(out.hex.c_str(),"0011000C918919123254760000A70A1B5E6CE3DBA0649B14");
+
+    // an escape pair is never split between two parts
+    memset(longText,'a',152);
+    strcpy(longText+152,"{b");
+    end=pduSegment(longText,SMS_SEGMENT_SEPTETS,&septets);
+    CHECK_EQ(end-longText,152);
+    CHECK_EQ(septets,152);
+
+    decode(d,"00040C9189191232547600006210119100008016E10D4ABC496D78E38D6FD3DB0037AF0D05208800");
+    CHECK(d.pdu.done());
+    CHECK_STR(d.number,"+989121234567");
+    CHECK_STR(d.text,"a{b}[c]~|\\^@$_");
+    CHECK_EQ(d.pdu.total,0);
+    CHECK(!d.pdu.truncated);
+}
+
+static void concatenated8BitRef()
+{
+    decoded d;
+
+    decode(d,"00440C918919123254760000621011910000800F0500032A0302E061391D44BFBF01");
+    CHECK(d.pdu.done());
+    CHECK_EQ(d.pdu.ref,0x2A);
+    CHECK_EQ(d.pdu.total,3);
+    CHECK_EQ(d.pdu.seq,2);
+    CHECK_STR(d.text,"part two");
+}
+
+static void concatenated16BitRef()
+{
+    decoded d;
+
+    decode(d,"00440C918919123254760000621011910000800F06080412340201F3349E5E2EBB01");
+    CHECK(d.pdu.done());
+    CHECK_EQ(d.pdu.ref,0x1234);
+    CHECK_EQ(d.pdu.total,2);
+    CHECK_EQ(d.pdu.seq,1);
+    CHECK_STR(d.text,"sixteen");
+}
+
+static void ucs2ToUtf8()
+{
+    decoded d;
+
+    // one, two and three byte UTF-8 sequences: A, e acute, the euro sign, Arabic seen
+    decode(d,"00040C9189191232547600086210119100008008004100E920AC0633");
+    CHECK(d.pdu.done());
+    CHECK_STR(d.text,"A\xC3\xA9\xE2\x82\xAC\xD8\xB3");
+    CHECK_EQ(d.pdu.textLen,8);
+
+    // a message waiting indication in the UCS2 group
+    decode(d,"00040C9189191232547600E06210119100008008004100E920AC0633");
+    CHECK(d.pdu.done());
+    CHECK_STR(d.text,"A\xC3\xA9\xE2\x82\xAC\xD8\xB3");
+
+    // the header of a UCS2 part is skipped whole
+    decode(d,"00440C918919123254760008621011910000800A05000307020120AC0031");
+    CHECK_EQ(d.pdu.ref,7);
+    CHECK_EQ(d.pdu.seq,1);
+    CHECK_STR(d.text,"\xE2\x82\xAC" "1");
+
+    // 8 bit data as it is, to a national sender
+    decode(d,"00040B819021214365F7000462101191000080030141FF");
+    CHECK_STR(d.number,"09121234567");
+    CHECK_EQ(d.pdu.textLen,3);
+    CHECK_EQ((uint8_t)d.text[2],0xFF);
+}
+
+static void decoderTruncates()
+{
+    decoded d;
+
+    decode(d,"00040C9189191232547600006210119100008016E10D4ABC496D78E38D6FD3DB0037AF0D05208800",6,5);
+    CHECK(d.pdu.done());
+    CHECK(d.pdu.truncated);
+    CHECK_STR(d.number,"+9891");
+    CHECK_STR(d.text,"a{b}");
+}
+
+static void cacheEviction()
+{
+    Sim800CSmsCache cache;
+    char part[150],text[400];
+    bool truncated;
+    uint16_t ref;
+
+    // three first halves do not fit together, the one added to least recently goes
+    for (ref=1; ref<=3; ref++)
+    {
+        memset(part,'@'+ref,sizeof(part));
+        CHECK(!cache.add("+989121234567",ref,2,1,part,sizeof(part),ref*1000));
+    }
+    CHECK(!cache.add("+989121234567",1,2,2,"a",1,4000));
+    memset(part,'C',sizeof(part));
+    CHECK(cache.add("+989121234567",3,2,2,"c",1,5000));
+    CHECK_EQ(cache.take("+989121234567",3,text,sizeof(text),&truncated),151);
+    CHECK(memcmp(text,part,sizeof(part))==0 && strcmp(text+150,"c")==0);
+    CHECK(!truncated);
+
+    // what was taken is gone, the parts of the other senders stay apart
+    CHECK_EQ(cache.take("+989121234567",3,text,sizeof(text),&truncated),0);
+    CHECK(!cache.add("+989120000000",2,2,2,"x",1,6000));
+    CHECK(cache.add("+989121234567",2,2,2,"b",1,7000));
+    CHECK_EQ(cache.take("+989121234567",2,text,10,&truncated),9);
+    CHECK(truncated);
+    CHECK_STR(text,"BBBBBBBBB");
+
+    // a part that comes twice is stored once
+    cache.clear();
+    CHECK(!cache.add("+989121234567",9,2,1,"one ",4,8000));
+    CHECK(!cache.add("+989121234567",9,2,1,"one ",4,8001));
+    CHECK(cache.add("+989121234567",9,2,2,"two",3,8002));
+    CHECK_EQ(cache.take("+989121234567",9,text,sizeof(text),&truncated),7);
+    CHECK_STR(text,"one two");
+}
+
+static void cacheSenderCollision()
+{
+    Sim800CSmsCache cache;
+    char text[20];
+    bool truncated;
+
+    // both senders hash to the same key, their parts with one reference stay apart
+    CHECK(!cache.add("+989120000602",7,2,1,"first ",6,1000));
+    CHECK(!cache.add("+989120002060",7,2,2,"other",5,1001));
+    CHECK(cache.add("+989120000602",7,2,2,"half",4,1002));
+    CHECK_EQ(cache.take("+989120000602",7,text,sizeof(text),&truncated),10);
+    CHECK_STR(text,"first half");
+    CHECK_EQ(cache.take("+989120002060",7,text,sizeof(text),&truncated),5);
+    CHECK_STR(text,"other");
+}
+
+int main()
+{
+    RUN(gsm7Packing);
+    RUN(gsm7Escapes);
+    RUN(concatenated8BitRef);
+    RUN(concatenated16BitRef);
+    RUN(ucs2ToUtf8);
+    RUN(decoderTruncates);
+    RUN(cacheEviction);
+    RUN(cacheSenderCollision);
+    return testFailures;
+}
@@ -0,0 +1,162 @@
+/*
+ *	GPRS connections against the scripted modem: framing of received data,
+ *	data of connections the library does not keep, ERROR replies, and the
+ *	throughput of both directions at 115200 baud.
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include "test.h"
+
+static char directNumber[20];
+static char directText[40];
+static char directSeen[40];
+
+static void directSms(Sim800C &/*gsm*/,uint8_t /*index*/,uint8_t /*status*/,const char * /*phone_number*/,const char *SMS_text)
+{
+    strcpy(directSeen,SMS_text);
+}
+
+static void connect(Sim800C &gsm,ModemEmulator &modem,VirtualClock &clock)
+{
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    CHECK(gsm.gprsAttach("mcinet"));
+    CHECK_EQ(gsm.socketOpen("example.com",80),0);
+    CHECK_EQ(gsm.socketOpen("example.com",81,true),1);
+}
+
+// Past the emulator's latency and every byte due.
+static void drain(Sim800C &gsm,VirtualClock &clock)
+{
+    clock.advance(200000);
+    for (int i=0; i<2000; i++) gsm.poll();
+}
+
+static void receiveFraming()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    uint8_t buf[32];
+
+    connect(gsm,modem,clock);
+    modem.urc("\r\n+RECEIVE,0,6:\r\nab\r\ncd");
+    modem.urc("+IPD,1,5:x\r\nyz");
+    modem.urc("\r\n+IPD,4:1234");
+    drain(gsm,clock);
+    CHECK_EQ(gsm.socketAvailable(0),10);
+    CHECK_EQ(gsm.socketRead(0,buf,sizeof(buf)),10);
+    CHECK(memcmp(buf,"ab\r\ncd1234",10)==0);
+    CHECK_EQ(gsm.socketAvailable(1),5);
+    CHECK_EQ(gsm.socketRead(1,buf,sizeof(buf)),5);
+    CHECK(memcmp(buf,"x\r\nyz",5)==0);
+}
+
+// +RECEIVE of a connection past SOCKET_COUNT after a readSms(): dropped, no SMS buffer touched.
+static void foreignConnection()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    char number[SMS_NUMBER_SIZE];
+    char text[SMS_TEXT_SIZE];
+
+    connect(gsm,modem,clock);
+    modem.sms[1]={ "REC UNREAD", "+989121234567", "kept", 0, "" };
+    CHECK_EQ(gsm.readSms(1,number,text),GETSMS_UNREAD_SMS);
+    CHECK(gsm.setDirectSms(true,directSms,directNumber,sizeof(directNumber),directText,sizeof(directText)));
+
+    modem.urc("\r\n+RECEIVE,5,12:\r\nnot for us!!");
+    modem.urc("\r\n+IPD,5,3:zzz");
+    drain(gsm,clock);
+    CHECK_STR(text,"kept");
+    CHECK_EQ(gsm.socketAvailable(0),0);
+    CHECK_EQ(gsm.socketAvailable(1),0);
+
+    // the direct delivery buffer kept its size
+    directSeen[0]=0;
+    modem.urc("\r\n+CMT: \"+989132383246\",\"\",\"19/01/17,10:06:21+14\",145,4,0,0,\"+989350001500\",145,11\r\nhello there\r\n");
+    drain(gsm,clock);
+    CHECK_STR(directSeen,"hello there");
+    CHECK(gsm.getProductInfo()=="SIM800 R14.18");
+}
+
+// Commands that end on their first reply line fail on ERROR.
+static void lineCommandErrors()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+
+    connect(gsm,modem,clock);
+    modem.on("AT+CIPCLOSE=1","\r\nERROR\r\n",1);
+    CHECK(!gsm.socketClose(1));
+    CHECK(gsm.socketClose(0));
+
+    // a failed close leaves the connection open, the retry asks the modem again
+    CHECK(gsm.socketClose(1));
+    CHECK_EQ(modem.count("AT+CIPCLOSE=1"),2);
+    modem.on("AT+CIPCLOSE=0","\r\nOK\r\n",1);
+    CHECK_EQ(gsm.socketOpen("example.com",80),0);
+    CHECK(!gsm.socketClose(0));
+    CHECK(gsm.socketClose(0));
+
+    modem.on("AT+CIFSR","\r\nERROR\r\n",1);
+    CHECK(!gsm.gprsAttach("mcinet"));
+    modem.on("AT+CIFSR","\r\nOK\r\n",1);
+    CHECK(!gsm.gprsAttach("mcinet"));
+}
+
+static void throughput()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    static uint8_t data[32768];
+    uint8_t buf[64];
+    uint64_t start;
+    double txRate,rxRate,line=115200/10.0;
+    uint32_t got=0,i;
+    std::string chunk;
+
+    connect(gsm,modem,clock);
+    for (i=0; i<sizeof(data); i++) data[i]=(uint8_t)(i*7);
+
+    start=clock.micros();
+    CHECK(gsm.socketSend(0,data,sizeof(data)));
+    txRate=sizeof(data)/((clock.micros()-start)/1e6);
+    CHECK(modem.socketData[0].size()==sizeof(data));
+    CHECK(memcmp(modem.socketData[0].data(),data,sizeof(data))==0);
+
+    // the modem pushes 1024 byte packets as fast as the line goes, the application reads as they come
+    modem.latency=0;
+    start=clock.micros();
+    for (i=0; i<sizeof(data); i+=1024)
+    {
+        chunk.assign((const char *)data+i,1024);
+        modem.urc("\r\n+RECEIVE,0,1024:\r\n"+chunk);
+    }
+    while (got<sizeof(data) && clock.micros()-start<60000000ULL)
+    {
+        uint16_t n=gsm.socketRead(0,buf,sizeof(buf));
+        if (n && memcmp(buf,data+got,n)!=0) break;
+        got+=n;
+        if (n==0) gsm.poll();
+    }
+    rxRate=got/((clock.micros()-start)/1e6);
+    CHECK_EQ(got,sizeof(data));
+
+    printf("socket send %.0f B/s, receive %.0f B/s, line %.0f B/s\n",txRate,rxRate,line);
+    CHECK(txRate>line*0.5);
+    CHECK(rxRate>line*0.8);
+}
+
+int main()
+{
+    RUN(receiveFraming);
+    RUN(foreignConnection);
+    RUN(lineCommandErrors);
+    RUN(throughput);
+    return testFailures;
+}
@@ -0,0 +1,83 @@
+/*
+ *	Per-command counters of SIM800C_STATS.
+*/
+
+#include "Sim800C.h"
+#include "ModemEmulator.h"
+#include "test.h"
+
+static const command_stats *row(Sim800C &gsm,const char *name)
+{
+    const command_stats *stats=gsm.getStats();
+    for (uint8_t i=0; i<STATS_COMMANDS; i++)
+    {
+        if (strcmp(stats[i].name,name)==0) return &stats[i];
+    }
+    return NULL;
+}
+
+// Calls to different numbers share one row, the numbers never reach the table.
+static void dialKey()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    const command_stats *dial;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    CHECK_EQ(gsm.miss_call("+989131112222",1),OK);
+    CHECK_EQ(gsm.miss_call("09357654321",1),OK);
+    dial=row(gsm,"ATD");
+    CHECK(dial!=NULL);
+    if (dial!=NULL) CHECK_EQ(dial->count,2);
+    CHECK(row(gsm,"ATD+98913")==NULL);
+    CHECK(row(gsm,"ATD093576")==NULL);
+    CHECK(row(gsm,"AT+CREG")!=NULL);
+}
+
+// Only what the library sends again counts as a retry, not two failures of one command in a row.
+static void retriesWhereSent()
+{
+    VirtualClock clock;
+    ModemEmulator modem(&clock);
+    Sim800C gsm;
+    const command_stats *cmgs,*cusd;
+    int i;
+
+    gsm.setClock(clock);
+    gsm.begin(modem,115200);
+    gsm.clearStats();
+    modem.on("AT+CUSD=","\r\nERROR\r\n",2);
+    CHECK(gsm.submit("AT+CUSD=1,\"*555#\"\r\n",RESPON_OK,1000));
+    CHECK(gsm.submit("AT+CUSD=1,\"*555#\"\r\n",RESPON_OK,1000));
+    for (i=0; i<100000 && gsm.busy(); i++) gsm.poll();
+    cusd=row(gsm,"AT+CUSD");
+    CHECK(cusd!=NULL);
+    if (cusd!=NULL)
+    {
+        CHECK_EQ(cusd->results[STATS_ERROR],2);
+        CHECK_EQ(cusd->retries,0);
+    }
+
+    // the outbox sends a refused message again after SMS_RETRY_DELAY
+    modem.on("AT+CMGS=","\r\n+CMS ERROR: 500\r\n",1);
+    CHECK(gsm.enqueueSms("+989121234567","again"));
+    for (i=0; i<100000 && gsm.outboxPending(); i++)
+    {
+        clock.advance(1000);
+        gsm.poll();
+    }
+    CHECK_EQ(gsm.outboxPending(),0);
+    CHECK_EQ(modem.count("AT+CMGS="),2);
+    cmgs=row(gsm,"AT+CMGS");
+    CHECK(cmgs!=NULL);
+    if (cmgs!=NULL) CHECK_EQ(cmgs->retries,1);
+}
+
+int main()
+{
+    RUN(dialKey);
+    RUN(retriesWhereSent);
+    return testFailures;
+}